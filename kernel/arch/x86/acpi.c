@@ -0,0 +1,149 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <mm/malloc.h>
+#include <lib/memory.h>
+#include <arch/x86/acpi.h>
+#include <arch/x86/paging.h>
+
+/**
+ * @file A minimal ACPI tables parser, used during the boot to find the
+ * tables describing the hardware (only the MADT for now). The tables may
+ * be anywhere in the physical memory, even above the direct map: they are
+ * read page by page with kmap_atomic() and copied in allocated memory.
+ */
+
+/**
+ * @brief Copy physical memory, which may be above the direct map.
+ * 
+ * @param dst The destination
+ * @param src The physical address to copy
+ * @param length The number of bytes to copy
+ */
+_init void acpi_read(void *dst, paddr_t src, size_t length)
+{
+    char *d = dst;
+    while (length > 0) {
+        size_t count = PAGE_SIZE - pg_offset(src);
+        if (count > length)
+            count = length;
+        const vaddr_t vaddr = kmap_atomic(src);
+        memcpy(d, vaddr, count);
+        kunmap_atomic(vaddr);
+        length -= count;
+        src += count;
+        d += count;
+    }
+}
+
+_init bool acpi_checksum(const void *data, const size_t length)
+{
+    const uint8_t *bytes = data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+/**
+ * @brief Search the RSDP in a range of the low memory, which is always in
+ * the direct map.
+ * 
+ * @return const struct acpi_rsdp* The RSDP, or NULL if not found
+ */
+_init const struct acpi_rsdp *acpi_scan_rsdp(
+    const paddr_t start,
+    const paddr_t end)
+{
+    for (paddr_t addr = start;
+         addr + sizeof(struct acpi_rsdp) <= end;
+         addr += ACPI_RSDP_ALIGN) {
+        const struct acpi_rsdp *rsdp = (void *) phys_to_virt(addr);
+        if (memcmp(rsdp->signature, ACPI_RSDP_SIGNATURE, 8) == 0 &&
+            acpi_checksum(rsdp, sizeof(struct acpi_rsdp)))
+            return rsdp;
+    }
+    return NULL;
+}
+
+_init const struct acpi_rsdp *acpi_find_rsdp(void)
+{
+    const uint16_t ebda = *(uint16_t *) phys_to_virt(ACPI_EBDA_POINTER);
+    if (ebda != 0) {
+        const paddr_t start = (paddr_t) ebda << 4;
+        const struct acpi_rsdp *rsdp = acpi_scan_rsdp(start, start + 1024);
+        if (rsdp != NULL)
+            return rsdp;
+    }
+    return acpi_scan_rsdp(ACPI_BIOS_START, ACPI_BIOS_END);
+}
+
+/**
+ * @brief Copy a whole table in allocated memory and check it.
+ * 
+ * @param paddr The physical address of the table
+ * @return struct acpi_header* The copy of the table, or NULL if the
+ * table is invalid or if there is not enough memory
+ */
+_init struct acpi_header *acpi_load_table(const paddr_t paddr)
+{
+    struct acpi_header header;
+    acpi_read(&header, paddr, sizeof(header));
+    if (header.length < sizeof(header))
+        return NULL;
+
+    struct acpi_header *table = malloc(header.length);
+    if (table == NULL)
+        return NULL;
+    acpi_read(table, paddr, header.length);
+    if (!acpi_checksum(table, header.length)) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+/**
+ * @brief Find an ACPI table through the RSDT. ACPI 2.0 tables are found
+ * through the RSDT as well, which is always present.
+ * 
+ * @param signature The signature of the table
+ * @return struct acpi_header* A copy of the table, that must be released
+ * with free(), or NULL if the table was not found
+ */
+_init struct acpi_header *acpi_find_table(const char *signature)
+{
+    const struct acpi_rsdp *rsdp = acpi_find_rsdp();
+    if (rsdp == NULL)
+        return NULL;
+    struct acpi_header *rsdt = acpi_load_table(rsdp->rsdt);
+    if (rsdt == NULL)
+        return NULL;
+
+    struct acpi_header *table = NULL;
+    const uint32_t *entries = (uint32_t *) (rsdt + 1);
+    const uint_t count = (rsdt->length - sizeof(*rsdt)) / sizeof(uint32_t);
+    for (uint_t i = 0; i < count && table == NULL; i++) {
+        struct acpi_header header;
+        acpi_read(&header, entries[i], sizeof(header));
+        if (memcmp(header.signature, signature, 4) == 0)
+            table = acpi_load_table(entries[i]);
+    }
+    free(rsdt);
+    return table;
+}
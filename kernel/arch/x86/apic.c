@@ -0,0 +1,220 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <mm/vmalloc.h>
+#include <arch/x86/idt.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/pit.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/paging.h>
+
+/**
+ * @file The local APIC of each CPU. The registers of all local APICs are at
+ * the same physical address, where each CPU sees its own APIC: they are
+ * mapped once, uncached, and used by all CPUs. The local APIC is used to
+ * send interrupts to other CPUs, and as a timer on the application
+ * processors: the bootstrap processor keeps the PIT, which also drives the
+ * time and the timers of the kernel.
+ */
+#define install_apic(i) ({                              \
+    extern void apic_##i(void);                         \
+    set_interrupt_gate(APIC_VECTOR_BASE + i, &apic_##i);\
+})
+
+static volatile uint32_t *registers = NULL;
+static apic_handler_t handlers[APIC_VECTORS];
+static uint32_t timer_count = 0;    // APIC timer count of one tick
+
+static uint32_t apic_read(const uint_t reg)
+{
+    return registers[reg / sizeof(uint32_t)];
+}
+
+static void apic_write(const uint_t reg, const uint32_t value)
+{
+    registers[reg / sizeof(uint32_t)] = value;
+}
+
+/**
+ * @brief Map the registers of the local APIC and install the handlers of
+ * its interrupt vectors. The local APIC of the bootstrap processor must
+ * still be enabled with apic_enable().
+ * 
+ * @param base The physical address of the registers
+ */
+_init void apic_setup(const paddr_t base)
+{
+    const vaddr_t vaddr = vmalloc(PAGE_SIZE, VMALLOC_NONE);
+    if (vaddr == 0)
+        panic("Failed to allocate the local APIC registers mapping");
+    if (paging_map_page(vaddr, base, PAGING_READ | PAGING_WRITE,
+            PAGING_PRESENT | PAGING_NOCACHE) < 0)
+        panic("Failed to map the local APIC registers");
+    registers = (volatile uint32_t *) vaddr;
+
+    extern void apic_spurious(void);
+    install_apic(0);
+    install_apic(1);
+    install_apic(2);
+    set_interrupt_gate(APIC_SPURIOUS_VECTOR, &apic_spurious);
+    for (uint_t i = 0; i < APIC_VECTORS; i++)
+        handlers[i] = NULL;
+}
+
+/**
+ * @brief Enable the local APIC of the current CPU. Its local interrupts
+ * are left as configured by the firmware.
+ */
+_init void apic_enable(void)
+{
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+/**
+ * @brief Measure the APIC timer count elapsed during one tick of the PIT,
+ * so that the APIC timers tick at the same frequency. The local APIC timers
+ * of all CPUs run at the same frequency (the bus frequency).
+ */
+_init void apic_timer_calibrate(void)
+{
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+    apic_write(APIC_REG_TIMER_INIT, 0xFFFFFFFF);
+    pit_udelay(1000000 / PIT_KERN_FREQ);
+    timer_count = 0xFFFFFFFF - apic_read(APIC_REG_TIMER_COUNT);
+    apic_write(APIC_REG_TIMER_INIT, 0);
+}
+
+/**
+ * @brief Start the periodic APIC timer of the current CPU, at PIT_KERN_FREQ.
+ * The timer must have been calibrated with apic_timer_calibrate().
+ */
+_init void apic_timer_start(void)
+{
+    assert(timer_count != 0);
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INIT, timer_count);
+}
+
+/**
+ * @brief Send an interprocessor interrupt. The interrupts are disabled while
+ * the command is written, so that an interrupt handler sending another
+ * interrupt cannot change the destination of this one.
+ * 
+ * @param apic_id The local APIC ID of the destination CPU
+ * @param command The low word of the command
+ */
+static void apic_send(const uint_t apic_id, const uint32_t command)
+{
+    irq_acquire() {
+        while (apic_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING)
+            cpu_relax();
+        apic_write(APIC_REG_ICR_HIGH, apic_id << 24);
+        apic_write(APIC_REG_ICR_LOW, command);
+    }
+}
+
+/**
+ * @brief Send an INIT interprocessor interrupt: the destination CPU is reset
+ * and waits for a startup interrupt.
+ * 
+ * @param apic_id The local APIC ID of the destination CPU
+ */
+_init void apic_send_init(const uint_t apic_id)
+{
+    apic_send(apic_id, APIC_ICR_INIT | APIC_ICR_ASSERT | APIC_ICR_LEVEL);
+}
+
+/**
+ * @brief Send a startup interprocessor interrupt: the destination CPU starts
+ * in real mode at the given address.
+ * 
+ * @param apic_id The local APIC ID of the destination CPU
+ * @param entry The physical address of the code to run: must be aligned on a
+ * page boundary and below 1 MiB
+ */
+_init void apic_send_startup(const uint_t apic_id, const paddr_t entry)
+{
+    assert(PAGE_ALIGNED(entry) && entry < 0x100000);
+    apic_send(apic_id, APIC_ICR_STARTUP | APIC_ICR_ASSERT |
+        (entry >> PAGE_SHIFT));
+}
+
+/**
+ * @brief Send an interrupt to another CPU.
+ * 
+ * @param apic_id The local APIC ID of the destination CPU
+ * @param vector The vector of the interrupt
+ */
+void apic_send_ipi(const uint_t apic_id, const uint_t vector)
+{
+    apic_send(apic_id, APIC_ICR_FIXED | APIC_ICR_ASSERT | vector);
+}
+
+/**
+ * @brief Request the handler of a local APIC vector. The end of interrupt
+ * is signaled by the caller of the handler.
+ * 
+ * @param vector The vector, from APIC_VECTOR_BASE
+ * @param handler The handler
+ * @return int 0 on success, or
+ *  -EBUSY if the vector is already used
+ */
+int apic_request(const uint_t vector, const apic_handler_t handler)
+{
+    assert(vector >= APIC_VECTOR_BASE);
+    assert(vector < APIC_VECTOR_BASE + APIC_VECTORS);
+    if (handlers[vector - APIC_VECTOR_BASE] != NULL)
+        return -EBUSY;
+    handlers[vector - APIC_VECTOR_BASE] = handler;
+    return 0;
+}
+
+/**
+ * @brief Get the local APIC ID of the current CPU.
+ * 
+ * @return uint_t The local APIC ID
+ */
+uint_t apic_id(void)
+{
+    return apic_read(APIC_REG_ID) >> 24;
+}
+
+/**
+ * @brief Signal the end of the current interrupt to the local APIC.
+ */
+void apic_eoi(void)
+{
+    apic_write(APIC_REG_EOI, 0);
+}
+
+/**
+ * @brief The handler of the local APIC vectors.
+ * 
+ * @param state The CPU state
+ */
+_asmlinkage
+void apic_handler(cpu_state_t *state)
+{
+    assert(state->data < APIC_VECTORS);
+    if (handlers[state->data] != NULL)
+        handlers[state->data](state);
+    apic_eoi();
+}
@@ -8,6 +8,7 @@
 #   - esp: return address
 #   - esp + 4: Pointer to location to store esp
 #   - esp + 8: Pointer to the saved CPU state
+#   - esp + 12: Cleared once the old stack is no longer used
 # ####################################################
 .global save_switch_to
 .type save_switch_to, @function
@@ -19,15 +20,17 @@ save_switch_to:
     pushad
 	pushd ds
 	pushd es
-	pushd gs
 	pushd fs
+	pushd gs
 	pushd ss
 
     # 72 bytes have been pushed on the stack.
 
     mov eax, [esp + 72 + 4]     # Store address of cpu_state in eax
+    mov ecx, [esp + 72 + 12]    # Store address of the flag in ecx
     mov [eax], esp              # Update cpu_state of the thread
     mov esp, [esp + 72 + 8]     # Load the saved CPU state
+    mov dword ptr [ecx], 0      # Another CPU may now run the old thread
     popd ss
     popd gs
     popd fs
@@ -42,12 +45,18 @@ save_switch_to:
 # Parameters
 #   - esp: return address
 #   - esp + 4: Pointer to the saved CPU state
+#   - esp + 8: Cleared once the old stack is no longer used, or NULL
 # ####################################################
 .global switch_to
 .type switch_to, @function
 switch_to:
+    mov ecx, [esp + 8]
     mov ebp, [esp + 4]      # Load the saved CPU state
     mov esp, ebp
+    test ecx, ecx
+    jz 1f
+    mov dword ptr [ecx], 0
+1:
     popd ss
     popd gs
     popd fs
@@ -58,15 +58,16 @@ exception_common:
 	pushad
 	pushd ds
 	pushd es
-	pushd gs
+	pushd fs
 	pushd gs
 	pushd ss
 	mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     mov ss, ax
+    mov ax, 0x28            # Per-CPU data, see percpu.h
+    mov gs, ax
 	push esp
 	call exception_handler
 	jmp ret_from_interrupt
@@ -9,6 +9,16 @@
         jmp irq_common
 .endm
 
+# Interrupts of the local APIC, see apic.c
+.macro DECLARE_APIC num
+    .global apic_\num
+    .type apic_\num, @function
+    apic_\num:
+        push 0
+        push \num
+        jmp apic_common
+.endm
+
 .section .text
 .align 4
 
@@ -33,16 +43,45 @@ irq_common:
 	pushad
 	pushd ds
 	pushd es
-	pushd gs
+	pushd fs
 	pushd gs
 	pushd ss
 	mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     mov ss, ax
+    mov ax, 0x28            # Per-CPU data, see percpu.h
+    mov gs, ax
 	push esp
 	call irq_handler
 	jmp ret_from_interrupt
+
+DECLARE_APIC 0
+DECLARE_APIC 1
+DECLARE_APIC 2
+
+apic_common:
+	pushad
+	pushd ds
+	pushd es
+	pushd fs
+	pushd gs
+	pushd ss
+	mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ss, ax
+    mov ax, 0x28            # Per-CPU data, see percpu.h
+    mov gs, ax
+	push esp
+	call apic_handler
+	jmp ret_from_interrupt
+
+# Spurious interrupts of the local APIC must not be acknowledged
+.global apic_spurious
+.type apic_spurious, @function
+apic_spurious:
+	iretd
 	
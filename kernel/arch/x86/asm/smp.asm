@@ -0,0 +1,84 @@
+.intel_syntax noprefix
+
+# Offsets of the fields of the trampoline data, see struct smp_trampoline
+.set TRAMPOLINE_GDTR,       0
+.set TRAMPOLINE_ENTRY32,    6
+.set TRAMPOLINE_CR0,        12
+.set TRAMPOLINE_CR3,        16
+.set TRAMPOLINE_CR4,        20
+.set TRAMPOLINE_STACK,      24
+.set TRAMPOLINE_ENTRY,      28
+
+.set TRAMPOLINE_DATA,       smp_trampoline_data - smp_trampoline_start
+
+.section .text
+
+# ####################################################
+# Entry of the application processors, copied in low memory by smp.c. The
+# startup IPI starts the CPU in real mode at CS:0, where CS is the physical
+# address of the copy divided by 16. The trampoline switches to protected
+# mode, enables paging with the values written in its data by the bootstrap
+# processor, and calls the entry of the CPU on the given stack.
+# ####################################################
+.code16
+.global smp_trampoline_start
+smp_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx                # Physical address of the trampoline
+    mov bx, ax
+    shl ebx, 4
+    lgdt [TRAMPOLINE_DATA + TRAMPOLINE_GDTR]
+    mov eax, cr0
+    or eax, 0x01                # Protected mode
+    mov cr0, eax
+    jmp fword ptr [TRAMPOLINE_DATA + TRAMPOLINE_ENTRY32]
+
+.code32
+.global smp_trampoline_32
+smp_trampoline_32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    # The page directory maps the trampoline at its physical address
+    mov eax, [ebx + TRAMPOLINE_DATA + TRAMPOLINE_CR4]
+    mov cr4, eax
+    mov eax, [ebx + TRAMPOLINE_DATA + TRAMPOLINE_CR3]
+    mov cr3, eax
+    mov eax, [ebx + TRAMPOLINE_DATA + TRAMPOLINE_CR0]
+    mov cr0, eax
+
+    mov esp, [ebx + TRAMPOLINE_DATA + TRAMPOLINE_STACK]
+    xor ebp, ebp                # First stack frame
+    call [ebx + TRAMPOLINE_DATA + TRAMPOLINE_ENTRY]
+1:
+    hlt
+    jmp 1b
+
+.align 8
+.global smp_trampoline_gdt
+smp_trampoline_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF    # Kernel code
+    .quad 0x00CF92000000FFFF    # Kernel data
+
+.global smp_trampoline_data
+smp_trampoline_data:
+    .word 23                    # GDT limit
+    .long 0                     # GDT base
+    .long 0                     # Physical address of smp_trampoline_32
+    .word 0x08                  # Kernel code selector
+    .long 0                     # CR0
+    .long 0                     # CR3
+    .long 0                     # CR4
+    .long 0                     # Stack
+    .long 0                     # Entry
+
+.global smp_trampoline_end
+smp_trampoline_end:
@@ -31,6 +31,7 @@
 #include <arch/x86/pic.h>
 #include <arch/x86/pit.h>
 #include <arch/x86/tss.h>
+#include <arch/x86/percpu.h>
 #include <arch/x86/paging.h>
 #include <arch/x86/exception.h>
 
@@ -38,9 +39,10 @@ extern void startup(char *initrd);
 
 _init void start(struct mb_info *info)
 {
+    percpu_setup();
     pic_remap();
-    gdt_install();
-    tss_install();
+    gdt_install(0);
+    tss_install(0);
     idt_install();
     irq_install();
     exception_install();
@@ -49,19 +51,22 @@ _init void start(struct mb_info *info)
     page_setup(info);
     paging_remap_kernel();
     page_map_table();
+    page_zero_setup();
     slub_setup();
     vmalloc_setup();
     kmalloc_setup();
+    fpu_state_setup();
     symbol_init(info);
 
     // Find the initrd inside the multiboot info structure module
     struct mb_module *module = mb_get_module(info, "initrd");
 
-    // Allocate the initrd memory and copy it to the kernel memory
+    // Allocate the initrd memory and copy it to the kernel memory. The
+    // initrd may be large: vmalloc maps it with large pages if possible
     char *initrd = NULL;
     if (module != NULL) {
         const size_t length = module->mod_end - module->mod_start;
-        initrd = malloc(length);
+        initrd = vmallocp(length, VMALLOC_MAP);
         if (initrd == NULL)
             panic("Failed to allocate memory for initrd");
         memcpy(initrd, module->mod_start, length);
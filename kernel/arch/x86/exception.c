@@ -17,9 +17,15 @@
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <assert.h>
+#include <mm/fault.h>
 #include <arch/x86/cpu.h>
+#include <arch/x86/fpu.h>
 #include <arch/x86/idt.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/uaccess.h>
 #include <arch/x86/exception.h>
+#include <process/process.h>
+#include <process/schedule.h>
 
 #define install_exception(i) ({                 \
     extern void exception_##i(void);            \
@@ -99,8 +105,7 @@ void invalid_opcode_exception(struct cpu_state *cpu)
 
 void device_not_available_exception(struct cpu_state *cpu)
 {
-    // TODO: Restore the FPU state or initialize it
-    panic("Device not available exception at 0x%x", cpu->eip);
+    fpu_trap();
 }
 
 void double_fault_exception(struct cpu_state *cpu)
@@ -135,7 +140,31 @@ void general_protection_exception(struct cpu_state *cpu)
 
 void page_fault_exception(struct cpu_state *cpu)
 {
-    panic("Page fault exception at 0x%x", cpu->eip);
+    const vaddr_t addr = get_cr2();
+
+    // The fault may sleep or wait for other CPUs to invalidate their TLB,
+    // so interrupts are enabled again if the faulting code allowed them
+    if (cpu->eflags & EFLAGS_IF)
+        sti();
+
+    // Kernel page tables are synchronized lazily between page directories
+    if (!(cpu->error_code & PAGE_FAULT_PRESENT))
+        if (paging_sync_kernel_pde(addr))
+            return;
+
+    const thread_t *thread = scheduler_get_current_thread();
+    if (thread != NULL && thread->process != NULL) {
+        struct mm_context *context = thread->process->mm_context;
+        if (mm_page_fault(context, addr, cpu->error_code) == 0)
+            return;
+    }
+
+    // Faults on user memory accessed by the kernel are expected in a few
+    // functions, which handle them with the exception table
+    if (!(cpu->error_code & PAGE_FAULT_USER) && exception_fixup(cpu))
+        return;
+    panic("Page fault exception at 0x%x (address 0x%x, error 0x%x)",
+        cpu->eip, addr, cpu->error_code);
 }
 
 void reserved_exception(struct cpu_state *cpu)
@@ -16,8 +16,80 @@
  * You should have received a copy of the GNU General Public License
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <mm/slub.h>
+#include <lib/maths.h>
+#include <lib/memory.h>
 #include <arch/x86/cpu.h>
 #include <arch/x86/fpu.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/percpu.h>
+#include <process/thread.h>
+#include <process/schedule.h>
+
+/**
+ * The FPU state is switched lazily: the TS flag is set when a thread is
+ * scheduled, and its state is only loaded when it executes its first FPU
+ * instruction, which raises a device not available exception (#NM). A
+ * thread that used the FPU during its time slice has its state saved when
+ * it is switched out, so that it can be loaded on any CPU: threads that
+ * never use the FPU never save nor restore any FPU state.
+ * 
+ * The registers keep the last state loaded on the CPU. If the thread that
+ * owns it uses the FPU again and did not use it on another CPU meanwhile,
+ * the state is not restored again.
+ */
+static DEFINE_PER_CPU(thread_t *, fpu_owner);
+
+static int mode = FPU_MODE_FXSAVE;
+static size_t state_size = FPU_LEGACY_SIZE;
+static slub_allocator_t *allocator = NULL;
+
+// XSAVE area with every component in its initial state: restoring it
+// initializes the FPU, SSE and AVX registers at once
+static fpu_state_t init_state = {
+    .legacy[24] = FPU_MXCSR_DEFAULT & 0xFF,
+    .legacy[25] = FPU_MXCSR_DEFAULT >> 8,
+};
+
+#define xsetbv(index, value)                        \
+    asm volatile("xsetbv" :: "c"(index),            \
+                 "a"((uint32_t) (value)),           \
+                 "d"((uint32_t) ((value) >> 32)))
+
+/**
+ * @brief Enable XSAVE on the current CPU if it is supported, with the x87,
+ * SSE and AVX state components. The instruction used to save the FPU state
+ * and the size of the state areas are chosen from what the CPU supports.
+ * Called on each CPU, which are assumed to support the same features.
+ */
+_init void fpu_setup_xsave(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GET_FEATURE, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CPUID_ECX_FEATURE_XSAVE))
+        return;
+
+    uint64_t xcr0 = XSTATE_X87 | XSTATE_SSE;
+    if (ecx & CPUID_ECX_FEATURE_AVX)
+        xcr0 |= cpuid_eax(CPUID_GET_XSTATE) & XSTATE_AVX;
+    set_cr4(get_cr4() | CR4_OSXSAVE);
+    xsetbv(0, xcr0);
+
+    // The sizes reported depend on the components enabled in XCR0
+    cpuid_count(CPUID_GET_XSTATE, 1, &eax, &ebx, &ecx, &edx);
+    if (eax & CPUID_XSTATE_XSAVEOPT) {
+        mode = FPU_MODE_XSAVEOPT;
+        state_size = cpuid_ebx(CPUID_GET_XSTATE);
+    } else if (eax & CPUID_XSTATE_XSAVEC) {
+        mode = FPU_MODE_XSAVEC;
+        state_size = ebx;
+    } else {
+        mode = FPU_MODE_XSAVE;
+        state_size = cpuid_ebx(CPUID_GET_XSTATE);
+    }
+    state_size = max(state_size, (size_t) FPU_XSAVE_MIN_SIZE);
+}
 
 _init void fpu_setup(void)
 {
@@ -36,36 +108,209 @@ _init void fpu_setup(void)
         "or eax, %0     \n"
         "mov cr4, eax   \n"
          :: "i"(CR4_OSFXRS | CR4_OSMXMME): "eax");
+    fpu_setup_xsave();
     set_task_switched();
 }
 
 /**
- * @brief Initialize the current FPU state
+ * @brief Create the allocator of the FPU state areas, once the size of the
+ * areas is known and the memory allocators are initialized.
+ */
+_init void fpu_state_setup(void)
+{
+    allocator = creat_slub_allocator(
+        state_size,
+        FPU_XSAVE_ALIGN,
+        0,
+        8,
+        1,
+        SLUB_LAZY);
+    if (allocator == NULL)
+        panic("Failed to create the FPU state allocator");
+}
+
+/**
+ * @brief Get the size of the FPU state areas
+ * 
+ * @return size_t The size of a FPU state area in bytes
+ */
+size_t fpu_state_size(void)
+{
+    return state_size;
+}
+
+/**
+ * @brief Allocate a FPU state area. The area is cleared because XRSTOR
+ * faults if the reserved bytes of the XSAVE header are not zero.
+ * 
+ * @return fpu_state_t* The new FPU state area, or NULL if the kernel ran
+ * out of memory
+ */
+fpu_state_t *fpu_alloc_state(void)
+{
+    fpu_state_t *state = slub_allocate(allocator);
+    if (state != NULL)
+        memzero(state, state_size);
+    return state;
+}
+
+/**
+ * @brief Free a FPU state area allocated with fpu_alloc_state()
  * 
+ * @param state The FPU state area to free
+ */
+void fpu_free_state(fpu_state_t *state)
+{
+    slub_free(allocator, state);
+}
+
+/**
+ * @brief Initialize the current FPU state. The SSE registers are cleared
+ * too, so that no state of another thread is visible.
  */
 void fpu_init(void)
 {
+    if (mode != FPU_MODE_FXSAVE) {
+        fpu_restore(&init_state);
+        return;
+    }
+
+    const uint32_t mxcsr = FPU_MXCSR_DEFAULT;
     asm volatile("finit");
+    asm volatile("ldmxcsr %0" :: "m"(mxcsr));
+    asm volatile(
+        "xorps xmm0, xmm0   \n"
+        "xorps xmm1, xmm1   \n"
+        "xorps xmm2, xmm2   \n"
+        "xorps xmm3, xmm3   \n"
+        "xorps xmm4, xmm4   \n"
+        "xorps xmm5, xmm5   \n"
+        "xorps xmm6, xmm6   \n"
+        "xorps xmm7, xmm7   \n");
 }
 
 /**
  * @brief Save the current FPU state. The FPU must be initialized before.
+ * With XSAVEOPT and XSAVEC, the components in their initial state are not
+ * written, and XSAVEOPT also skips the components not modified since they
+ * were restored from the same area.
  * 
- * @param state The location where to save the FPU state: must be aligned 
- * on a 16 bytes boundary
+ * @param state The location where to save the FPU state, allocated with
+ * fpu_alloc_state()
  */
 void fpu_save(fpu_state_t *state)
 {
-    asm volatile("fxsave [%0]" :: "r"(state->data) : "memory");
+    switch (mode) {
+        case FPU_MODE_XSAVEOPT:
+            asm volatile("xsaveopt [%0]"
+                :: "r"(state), "a"(-1), "d"(-1) : "memory");
+            break;
+        case FPU_MODE_XSAVEC:
+            asm volatile("xsavec [%0]"
+                :: "r"(state), "a"(-1), "d"(-1) : "memory");
+            break;
+        case FPU_MODE_XSAVE:
+            asm volatile("xsave [%0]"
+                :: "r"(state), "a"(-1), "d"(-1) : "memory");
+            break;
+        default:
+            asm volatile("fxsave [%0]" :: "r"(state) : "memory");
+            break;
+    }
 }
 
 /**
- * @brief Restore the FPU state
+ * @brief Restore the FPU state. The components that were not saved are
+ * set to their initial state.
  * 
  * @param state The FPU state to restore: must be already initialized
- * and aligned on a 16 bytes boundary.
+ * and allocated with fpu_alloc_state().
  */
 void fpu_restore(fpu_state_t *state)
 {
-    asm volatile("fxrstor [%0]" :: "r"(state->data));
+    if (mode != FPU_MODE_FXSAVE)
+        asm volatile("xrstor [%0]" :: "r"(state), "a"(-1), "d"(-1));
+    else
+        asm volatile("fxrstor [%0]" :: "r"(state));
+}
+
+/**
+ * @brief Load the FPU state of a thread on the current CPU. The TS flag
+ * must be cleared and interrupts disabled. The state is initialized if the
+ * thread never used the FPU, and not restored if the registers still hold
+ * it.
+ * 
+ * @param thread The thread that will use the FPU
+ */
+static void fpu_load(thread_t *thread)
+{
+    const int cpu = smp_cpu_id();
+    if (!thread->fpu_used) {
+        fpu_init();
+        thread->fpu_used = true;
+    } else if (percpu_read(fpu_owner) != thread || thread->fpu_cpu != cpu) {
+        fpu_restore(thread->fpu_state);
+    }
+    percpu_write(fpu_owner, thread);
+    thread->fpu_cpu = cpu;
+    thread->fpu_loaded = true;
+}
+
+/**
+ * @brief Handle a device not available exception: the current thread uses
+ * the FPU for the first time since it was scheduled. Called with
+ * interrupts disabled.
+ */
+void fpu_trap(void)
+{
+    thread_t *thread = scheduler_get_current_thread();
+    if (thread == NULL)
+        panic("FPU used before the first thread");
+    clts();
+    fpu_load(thread);
+}
+
+/**
+ * @brief Save the FPU state of a thread in its FPU state area if it is
+ * loaded in the registers, for example before copying it. The thread must
+ * be the current thread.
+ * 
+ * @param thread The current thread
+ */
+void fpu_flush(const thread_t *thread)
+{
+    irq_acquire() {
+        if (thread->fpu_loaded)
+            fpu_save(thread->fpu_state);
+    }
+}
+
+/**
+ * @brief Switch the FPU state between two threads on the current CPU,
+ * called by the scheduler with interrupts disabled. The state of the
+ * previous thread is saved if it used the FPU. The state of the next thread
+ * is loaded immediately if it used the FPU during its last time slices,
+ * otherwise the TS flag is set and it will be loaded by fpu_trap().
+ * 
+ * @param prev The thread switched out
+ * @param next The thread that will run
+ */
+void fpu_switch(thread_t *prev, thread_t *next)
+{
+    // The counter wraps around, so that a thread that stopped using the
+    // FPU eventually goes back to the lazy switching
+    if (prev->fpu_loaded) {
+        fpu_save(prev->fpu_state);
+        prev->fpu_loaded = false;
+        prev->fpu_counter++;
+    } else {
+        prev->fpu_counter = 0;
+    }
+
+    if (next->fpu_counter > FPU_EAGER_THRESHOLD) {
+        clts();
+        fpu_load(next);
+    } else {
+        set_task_switched();
+    }
 }
\ No newline at end of file
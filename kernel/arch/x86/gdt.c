@@ -18,11 +18,14 @@
  */
 #include <assert.h>
 #include <arch/x86/gdt.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/percpu.h>
 
-static struct gdt_register gdtr;
-static struct gdt_entry gdt[GDT_MAX_ENTRY];
+// Each CPU has its own GDT, which holds its own TSS and per-CPU descriptors
+static struct gdt_entry gdt[SMP_MAX_CPUS][GDT_MAX_ENTRY];
 
 void gdt_install_desc(
+    const uint_t cpu,
     const uint32_t index,
     const uint32_t base,
     const uint32_t limit,
@@ -30,19 +33,22 @@ void gdt_install_desc(
     const uint32_t flags,
     const bool is_tss)
 {
+    assert(cpu < SMP_MAX_CPUS);
     assert(index < GDT_MAX_ENTRY);
-    gdt[index].base0_15 = (base & 0xFFFF);
-    gdt[index].base16_23 = ((base >> 16) & 0xFF);
-    gdt[index].base24_31 = ((base >> 24) & 0xFF);
-    gdt[index].limit0_15 = (limit & 0xFFFF);
-    gdt[index].limit16_19 = ((limit >> 16) & 0x0F);
-    gdt[index].flags = (flags & 0x0F);
-    gdt[index].access = (is_tss) ? (access) : (access | 0x10);
+    struct gdt_entry *const entry = &gdt[cpu][index];
+    entry->base0_15 = (base & 0xFFFF);
+    entry->base16_23 = ((base >> 16) & 0xFF);
+    entry->base24_31 = ((base >> 24) & 0xFF);
+    entry->limit0_15 = (limit & 0xFFFF);
+    entry->limit16_19 = ((limit >> 16) & 0x0F);
+    entry->flags = (flags & 0x0F);
+    entry->access = (is_tss) ? (access) : (access | 0x10);
 }
 
-_init void gdt_flush(void)
+_init void gdt_flush(const uint_t cpu)
 {
-    gdtr.base = (uint32_t)gdt;
+    struct gdt_register gdtr;
+    gdtr.base = (uint32_t) gdt[cpu];
     gdtr.size = GDT_MAX_ENTRY * sizeof(gdt_entry_t);
     asm volatile("lgdt %0" ::"m"(gdtr));
     asm volatile(" mov ax, 0x10     \n\
@@ -50,34 +56,47 @@ _init void gdt_flush(void)
                     mov ds, ax      \n\
                     mov es, ax      \n\
                     mov fs, ax      \n\
+                    mov ax, 0x28    \n\
                     mov gs, ax      \n\
                     ljmp 0x08:1f    \n\
                     1:" ::
                      : "eax");
 }
 
-_init void gdt_install(void)
+/**
+ * @brief Install and load the GDT of a CPU, and load its per-CPU segment in
+ * GS. The TSS descriptor of the CPU is installed later, by tss_install().
+ * 
+ * @param cpu The index of the CPU
+ */
+_init void gdt_install(const uint_t cpu)
 {
-    gdt_install_desc(0, 0, 0, 0, 0, 0);
+    gdt_install_desc(cpu, 0, 0, 0, 0, 0, 0);
     // Kernel code
-    gdt_install_desc(1, 0, 0xFFFFFFFF,
+    gdt_install_desc(cpu, 1, 0, 0xFFFFFFFF,
         GDT_IS_CODE_SEGMENT | GDT_SEGMENT_PRESENT | GDT_RING0,
         GDT_BLOCK_SIZE_4_KO | GDT_SEGMENT_32BITS,
         false);
     // Kernel data
-    gdt_install_desc(2, 0, 0xFFFFFFFF,
+    gdt_install_desc(cpu, 2, 0, 0xFFFFFFFF,
         GDT_SEGMENT_PRESENT | GDT_DATA_CAN_WRITE | GDT_RING0,
         GDT_BLOCK_SIZE_4_KO | GDT_SEGMENT_32BITS,
         false);
     // User data
-    gdt_install_desc(3, 0, 0xFFFFFFFF, 
+    gdt_install_desc(cpu, 3, 0, 0xFFFFFFFF, 
         GDT_SEGMENT_PRESENT | GDT_DATA_CAN_WRITE | GDT_RING3,
         GDT_BLOCK_SIZE_4_KO | GDT_SEGMENT_32BITS,
         false);
     // User code
-    gdt_install_desc(4, 0, 0xFFFFFFFF, 
+    gdt_install_desc(cpu, 4, 0, 0xFFFFFFFF, 
         GDT_IS_CODE_SEGMENT | GDT_SEGMENT_PRESENT | GDT_RING3,
         GDT_BLOCK_SIZE_4_KO | GDT_SEGMENT_32BITS,
         false);
-    gdt_flush();
+    // Per-CPU data: the base is the offset of the copy of the CPU, and
+    // addresses wrap around so that the offset can be negative
+    gdt_install_desc(cpu, GDT_PERCPU_ENTRY, percpu_offsets[cpu], 0xFFFFFFFF,
+        GDT_SEGMENT_PRESENT | GDT_DATA_CAN_WRITE | GDT_RING0,
+        GDT_BLOCK_SIZE_4_KO | GDT_SEGMENT_32BITS,
+        false);
+    gdt_flush(cpu);
 }
\ No newline at end of file
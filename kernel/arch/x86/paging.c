@@ -19,7 +19,11 @@
 #include <lib/maths.h>
 #include <lib/memory.h>
 #include <mm/page.h>
+#include <mm/zram.h>
+#include <core/preempt.h>
+#include <arch/x86/smp.h>
 #include <arch/x86/paging.h>
+#include <arch/x86/percpu.h>
 
 /**
  * @brief This file contains the implementation of the paging system. The
@@ -30,17 +34,80 @@
  */
 
 static pde_t kernel_pd[1024] _align(PAGE_SIZE);
+static DECLARE_SPINLOCK(kernel_pd_lock);
+static uint_t kernel_pd_generation = 0;
+
+/**
+ * Quicklists keep a few page tables and page directories ready to be reused,
+ * so creating and destroying address spaces does not go through the page
+ * allocator nor clear whole pages each time. Page tables in a quicklist are
+ * zeroed. Page directories have an empty user part, and a kernel part that
+ * was synchronized with the master kernel page directory at the recorded
+ * generation. Each CPU has its own pair of quicklists, only used by this CPU
+ * with preemption disabled, so no lock is needed.
+ */
+typedef struct paging_quicklist {
+    uint_t count;
+    struct {
+        paddr_t page;
+        uint_t generation;
+    } entries[PAGING_QUICKLIST_MAX];
+} paging_quicklist_t;
+
+static DEFINE_PER_CPU(paging_quicklist_t, pt_quicklist);
+static DEFINE_PER_CPU(paging_quicklist_t, pd_quicklist);
+
+// The kmap window is split between slots shared by all CPUs, used by
+// kmap(), and slots private to each CPU, used by kmap_atomic(): a private
+// slot is only accessed by its CPU and is invalidated without any IPI
+#define KMAP_SHARED_PAGES   (KMAP_PAGES - SMP_MAX_CPUS * KMAP_ATOMIC_SLOTS)
+
+static pte_t kmap_pt[KMAP_PAGES] _align(PAGE_SIZE);
+static DECLARE_SPINLOCK(kmap_lock);
+static uint_t kmap_next = 0;
+static DEFINE_PER_CPU(uint_t, kmap_atomic_depth);
+
+// Page directory loaded on each CPU, see paging_shootdown()
+static DEFINE_PER_CPU(paddr_t, loaded_pd);
+
 extern const char _rodata_start, _rodata_end;
 extern const char _data_start, _data_end;
 extern const char _text_start, _text_end;
 extern const char _init_start, _init_end;
 extern const char _bss_start, _bss_end;
+extern const char _end;
 
-_init void paging_map_page_helper(
-    const vaddr_t vaddr,
-    const paddr_t paddr,
-    const int access,
-    const int flags)
+/**
+ * @brief Invalidate a modified range in the TLB of the other CPUs that may
+ * have cached it. Kernel addresses are shared by all page directories, but
+ * user addresses are only cached by the CPUs that loaded the modified page
+ * directory: a CPU that loads it after the entries were modified flushes
+ * its user entries while loading it. Preemption must be disabled.
+ * 
+ * @param pd The physical address of the modified page directory
+ * @param start The first modified address
+ * @param end The end of the modified range, excluded
+ */
+static void paging_shootdown(
+    const paddr_t pd,
+    const vaddr_t start,
+    const vaddr_t end)
+{
+    if (start >= KERNEL_BASE) {
+        smp_flush_tlb(start, end);
+        return;
+    }
+
+    // Order the modified entries before reading the loaded page directories
+    uint32_t cpus = 0;
+    memory_barrier();
+    for (uint_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        if (*per_cpu_ptr(loaded_pd, cpu) == pd)
+            cpus |= 1u << cpu;
+    smp_flush_tlb_cpus(cpus, start, end);
+}
+
+_init pte_t *paging_pte_helper(const vaddr_t vaddr)
 {
     pde_t *const pde = &kernel_pd[pd_offset(vaddr)];   
     if (!pde->present) {
@@ -54,15 +121,24 @@ _init void paging_map_page_helper(
         memzero(pt, PAGE_SIZE);
     }
 
-    pte_t *const pte = (pte_t *const) (
+    return (pte_t *) (
         pde_get_address(pde) +
         pt_offset(vaddr) *
         sizeof(pte_t));   
+}
 
+_init void paging_map_page_helper(
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags)
+{
+    pte_t *const pte = paging_pte_helper(vaddr);
     if(pte->present)
         panic("Mapping page at 0x%08x: already mapped", vaddr);
     pte_set_address(pte, paddr);
     pte->write = !!(access & PAGING_WRITE);
+    pte->global = !!(flags & PAGING_GLOBAL);
     pte->present = 1;
 }
 
@@ -82,6 +158,45 @@ _init void paging_map_interval_helper(
     }
 }
 
+/**
+ * @brief Map the low physical memory at DIRECT_MAP_BASE with large pages. The
+ * page tables that cover the kernel image use 4 KiB pages to enforce the 
+ * access rights of each section: the rest of these page tables is mapped
+ * read-write. The kernel sections must already be mapped.
+ */
+_init void paging_map_direct(void)
+{
+    const vaddr_t image_end = align((vaddr_t) &_end, PAGING_LARGE_SIZE);
+    const vaddr_t end = phys_to_virt(
+        min(page_memory_end(), (paddr_t) DIRECT_MAP_SIZE));
+
+    for (vaddr_t vaddr = DIRECT_MAP_BASE;
+        vaddr < end;
+        vaddr += PAGING_LARGE_SIZE) {
+        if (vaddr < image_end) {
+            for (vaddr_t page = vaddr;
+                page < vaddr + PAGING_LARGE_SIZE;
+                page += PAGE_SIZE) {
+                if (paging_pte_helper(page)->present)
+                    continue;
+                paging_map_page_helper(
+                    page,
+                    virt_to_phys(page),
+                    PAGING_READ | PAGING_WRITE,
+                    PAGING_PRESENT | PAGING_GLOBAL);
+            }
+            continue;
+        }
+
+        pde_t *const pde = &kernel_pd[pd_offset(vaddr)];
+        pde_set_address(pde, virt_to_phys(vaddr));
+        pde->write = 1;
+        pde->large = 1;
+        pde->global = 1;
+        pde->present = 1;
+    }
+}
+
 _init void paging_remap_kernel(void)
 {
     memzero(kernel_pd, PAGE_SIZE);
@@ -112,7 +227,7 @@ _init void paging_remap_kernel(void)
         text_start - KERNEL_BASE,
         text_length,
         PAGING_EXECUTE,
-        PAGING_PRESENT);
+        PAGING_PRESENT | PAGING_GLOBAL);
        
     // Map the .rodata segment
     paging_map_interval_helper(
@@ -120,7 +235,7 @@ _init void paging_remap_kernel(void)
         rodata_start - KERNEL_BASE,
         rodata_length,
         PAGING_READ,
-        PAGING_PRESENT);
+        PAGING_PRESENT | PAGING_GLOBAL);
 
     // Map the .data segment
     paging_map_interval_helper(
@@ -128,7 +243,7 @@ _init void paging_remap_kernel(void)
         data_start - KERNEL_BASE,
         data_length,
         PAGING_READ | PAGING_WRITE,
-        PAGING_PRESENT);
+        PAGING_PRESENT | PAGING_GLOBAL);
 
      // Map the .init segment
     paging_map_interval_helper(
@@ -136,7 +251,7 @@ _init void paging_remap_kernel(void)
         init_start - KERNEL_BASE,
         init_length,
         PAGING_EXECUTE | PAGING_READ | PAGING_WRITE,
-        PAGING_PRESENT);
+        PAGING_PRESENT | PAGING_GLOBAL);
 
     // Map the .bss segment
    paging_map_interval_helper(
@@ -144,28 +259,25 @@ _init void paging_remap_kernel(void)
         bss_start - KERNEL_BASE,
         bss_length,
         PAGING_READ | PAGING_WRITE,
-        PAGING_PRESENT);
+        PAGING_PRESENT | PAGING_GLOBAL);
 
-    // Mirroring
-    const paddr_t kernel_pd_paddr = (paddr_t) kernel_pd - KERNEL_BASE;
-    pde_set_address(&kernel_pd[PAGING_MIRRORING_INDEX], kernel_pd_paddr);
-    kernel_pd[PAGING_MIRRORING_INDEX].present = 1;
-    kernel_pd[PAGING_MIRRORING_INDEX].write = 1;
+    paging_map_direct();
 
-    // Set CR3 to the new page directory
-    set_cr3(kernel_pd_paddr);
+    // Page table of the temporary mappings window
+    pde_set_address(&kernel_pd[KMAP_INDEX], virt_to_phys(kmap_pt));
+    kernel_pd[KMAP_INDEX].present = 1;
+    kernel_pd[KMAP_INDEX].write = 1;
+    const paddr_t kernel_pd_paddr = virt_to_phys(kernel_pd);
 
-    // Preallocate all kernel page directory entries
-    for (uint_t i = pd_offset(KERNEL_BASE); i < 1023; i++) {
-        if(kernel_pd[i].present)
-            continue;
+    // Set CR3 to the new page directory. Other kernel page tables are
+    // allocated on demand, see paging_alloc_pte()
+    set_cr3(kernel_pd_paddr);
 
-        const paddr_t page = page_alloc(PAGE_CLEAR);
-        pde_set_address(&kernel_pd[i], page);
-        kernel_pd[i].present = 1;
-        kernel_pd[i].write = 1;
-    }
-    flush_tlb();
+    // Kernel pages are mapped in every address space: mark them as global
+    // so that they are not flushed from the TLB at each CR3 reload.
+    if (cpuid_edx(CPUID_GET_FEATURE) & CPUID_EDX_FEATURE_PGE)
+        set_cr4(get_cr4() | CR4_PGE);
+    flush_tlb_global();
 }
 
 _init void paging_clear_userspace(void)
@@ -176,35 +288,86 @@ _init void paging_clear_userspace(void)
 
 /**
  * @brief Get the page direction entry for a given address in the current 
- * address space
+ * address space. Page directories are always allocated in low memory, so
+ * they are reachable through the direct map.
  * 
  * @param addr Address to get the page directory entry for
  * @return pde_t* The page directory entry for the given address
  */
-pde_t *paging_get_pde(const vaddr_t addr) 
+_export pde_t *paging_get_pde(const vaddr_t addr)
+{
+    pde_t *const pd = (pde_t *) phys_to_virt(PAGE_ALIGN(get_cr3()));
+    return &pd[pd_offset(addr)];
+}
+
+/**
+ * @brief Synchronize a kernel page directory entry of the current address
+ * space with the master kernel page directory. Kernel page tables are
+ * allocated on demand and only installed in the master page directory and
+ * in the current one: other page directories are synchronized lazily, when
+ * they are loaded (see paging_sync_kernel_pd()) or when a page fault occurs
+ * on a kernel address.
+ * 
+ * @param addr Kernel address to synchronize the page directory entry for
+ * @return true if the entry was missing and has been synchronized, false
+ * otherwise
+ */
+_export bool paging_sync_kernel_pde(const vaddr_t addr)
+{
+    if (addr < KERNEL_BASE)
+        return false;
+    pde_t *const pde = paging_get_pde(addr);
+    const pde_t *const master = &kernel_pd[pd_offset(addr)];
+    if (pde->present || !master->present)
+        return false;
+    pde_copy(pde, master);
+    return true;
+}
+
+/**
+ * @brief Copy all kernel page directory entries of the master kernel page
+ * directory into a page directory.
+ * 
+ * @param pd The virtual address of the page directory to synchronize
+ */
+_export void paging_sync_kernel_pd(const vaddr_t pd)
 {
-    // Magic
-    return (pde_t *) (PAGING_MIRRORING_BASE 
-        + (pd_offset(PAGING_MIRRORING_BASE) << PAGE_SHIFT)
-        + (pd_offset(addr) << 2));
+    pde_t *const dst = (pde_t *) pd;
+    for (uint_t i = pd_offset(KERNEL_BASE); i < 1024; i++)
+        pde_copy(&dst[i], &kernel_pd[i]);
+}
+
+/**
+ * @brief Get the generation of the master kernel page directory. The
+ * generation is incremented each time a kernel page table is allocated: a
+ * page directory synchronized with an older generation may miss some kernel
+ * page directory entries.
+ * 
+ * @return uint_t The current generation
+ */
+_export uint_t paging_kernel_generation(void)
+{
+    return kernel_pd_generation;
 }
 
 /**
  * @brief Get the page table entry for a given address in the current
- * address space
+ * address space. Page tables are always allocated in low memory, so they
+ * are reachable through the direct map.
  * 
  * @param addr Address to get the page table entry for
  * @return pte_t* The page table entry for the given address, or NULL
- * if the entry is not present.
+ * if the entry is not present or if the address is mapped by a large page.
  */
 pte_t *paging_get_pte(const vaddr_t addr)
 {
-    // More magic
-    if (!paging_get_pde(addr)->present)
+    const pde_t *const pde = paging_get_pde(addr);
+    if (!pde->present && !paging_sync_kernel_pde(addr))
         return NULL;
-    return (pte_t *) (PAGING_MIRRORING_BASE 
-        + (pd_offset(addr) << PAGE_SHIFT)
-        + (pt_offset(addr) << 2));
+    if (pde->large)
+        return NULL;
+    pte_t *const pt = (pte_t *) phys_to_virt(pde_get_address(pde));
+    return &pt[pt_offset(addr)];
 }
 
 /**
@@ -218,6 +381,10 @@ pte_t *paging_get_pte(const vaddr_t addr)
  */
 paddr_t paging_get_paddr(const vaddr_t vaddr)
 {
+	const pde_t *pde = paging_get_pde(vaddr);
+	if (pde->present && pde->large)
+		return pde_get_address(pde) + (vaddr & ~PAGING_LARGE_MASK);
+
 	const pte_t *pte = paging_get_pte(vaddr);
 	if (pte == NULL || !pte->present)
 		return 0;
@@ -227,7 +394,8 @@ paddr_t paging_get_paddr(const vaddr_t vaddr)
 /**
  * @brief Create a copy of a page directory. The page directory entries are
  * copied, but the page tables are not: There are marked as not present and
- * as not writable: this allow to do Copy-on-Write
+ * as not writable: this allow to do Copy-on-Write. Large pages are shared
+ * the same way, and are split on the first write fault (see mm_fault_cow())
  * 
  * @param src The virtual address of the source page directory. Must be aligned
  * on a page boundary
@@ -236,53 +404,297 @@ paddr_t paging_get_paddr(const vaddr_t vaddr)
  */
 void paging_clone_pd(const vaddr_t src, const vaddr_t dst)
 {
-    paging_creat_pd(dst);
     pde_t *const s = (pde_t *) src;
     pde_t *const d = (pde_t *) dst;
     for (uint_t i = 0; i < pd_offset(KERNEL_BASE); i++) {
-        page_reference(pde_get_address(&s[i]));
+        if (!s[i].present)
+            continue;
+        if (s[i].large) {
+            // Each page of a large page has its own reference counter
+            const paddr_t large = pde_get_address(&s[i]);
+            for (uint_t j = 0; j < PAGING_LARGE_SIZE / PAGE_SIZE; j++)
+                page_reference(large + (j << PAGE_SHIFT));
+        } else {
+            page_reference(pde_get_address(&s[i]));
+        }
         s[i].present = 1;
         s[i].write = 0;
         pde_copy(&d[i], &s[i]);
-        flush_tlb((paddr_t) s[i]); 
     }
+
+    // Other threads of the process may run on other CPUs
+    preempt_disable();
+    flush_tlb();
+    paging_shootdown(virt_to_phys(src), 0, KERNEL_BASE);
+    preempt_enable();
 }
 
-void paging_destroy_userspace(void)
+/**
+ * @brief Release all the user mappings of an address space. The user part
+ * of the page directory is cleared, and the page tables that were not shared
+ * are cleared and released in the page table quicklist. The page directory
+ * must not be loaded on the CPU: it is accessed through the direct map, and
+ * no TLB invalidation is done.
+ * 
+ * @param pd The virtual address of the page directory
+ */
+void paging_destroy_userspace(const vaddr_t pd)
 {
+    assert(virt_to_phys(pd) != PAGE_ALIGN(get_cr3()));
     for (uint_t i = 0; i < pd_offset(KERNEL_BASE); i++) {
-        const pde_t *pde = paging_get_pde(i << 22);
+        pde_t *const pde = &((pde_t *) pd)[i];
         const paddr_t pt_paddr = pde_get_address(pde);
         if (!pde->present)
             continue;
+        if (pde->large) {
+            page_free_range(pt_paddr, PAGING_LARGE_SIZE / PAGE_SIZE);
+            pde_clear(pde);
+            continue;
+        }
 
         // If the page table is referenced several times, we do
         // not release the pages it contains because it is still 
-        // used by other processes
+        // used by other processes. The counter is checked and
+        // decremented under the page lock, so that only one of
+        // the address spaces sharing it ever releases its pages
         page_lock(pt_paddr);
-        if (page_counter(pt_paddr) == 1) {
+        const bool last = page_counter(pt_paddr) == 1;
+        if (last) {
+            pte_t *const pt = (pte_t *) phys_to_virt(pt_paddr);
             for (int j = 0; j < 1024; j++) {
-                const pte_t *pte = paging_get_pte(i << 22 | j << 12);
-                if (pte->present)
+                pte_t *const pte = &pt[j];
+                if (pte_is_swap(pte))
+                    zram_free(pte_get_swap(pte));
+                else if (pte->present)
+                    page_free(pte_get_address(pte));
+                else
                     continue;
-                page_free(pte_get_address(pte));
+                page_pt_dec(pt_paddr);
+                pte_clear(pte);
             }
+        } else {
+            page_dereference(pt_paddr);
         }
         page_unlock(pt_paddr);
-        page_free(pt_paddr);
+        pde_clear(pde);
+        if (last)
+            paging_release_pt(pt_paddr, true);
+    }
+}
+
+/**
+ * @brief Take a page from a quicklist of the current CPU. Preemption must
+ * be disabled.
+ * 
+ * @param list The quicklist of the current CPU
+ * @param generation If not NULL, where to store the generation recorded with
+ * the page
+ * @return paddr_t The page, or 0 if the quicklist is empty
+ */
+static paddr_t paging_quicklist_pop(
+    paging_quicklist_t *list,
+    uint_t *generation)
+{
+    if (list->count == 0)
+        return 0;
+    list->count--;
+    if (generation != NULL)
+        *generation = list->entries[list->count].generation;
+    return list->entries[list->count].page;
+}
+
+/**
+ * @brief Put a page in a quicklist of the current CPU. Preemption must be
+ * disabled.
+ * 
+ * @param list The quicklist of the current CPU
+ * @param page The page to put in the quicklist
+ * @param generation The generation to record with the page
+ * @return true if the page was added, false if the quicklist is full
+ */
+static bool paging_quicklist_push(
+    paging_quicklist_t *list,
+    const paddr_t page,
+    const uint_t generation)
+{
+    if (list->count == PAGING_QUICKLIST_MAX)
+        return false;
+    list->entries[list->count].page = page;
+    list->entries[list->count].generation = generation;
+    list->count++;
+    return true;
+}
+
+/**
+ * @brief Allocate a zeroed page table, from the quicklist if possible.
+ * 
+ * @return paddr_t The page table, or 0 if there is no memory left
+ */
+static paddr_t paging_alloc_pt(void)
+{
+    preempt_disable();
+    const paddr_t pt = paging_quicklist_pop(this_cpu_ptr(pt_quicklist), NULL);
+    preempt_enable();
+    if (pt != 0)
+        return pt;
+    return page_alloc(PAGE_CLEAR);
+}
+
+/**
+ * @brief Release a page table. No TLB entry may refer to it anymore. A
+ * zeroed page table that is not shared is kept in the quicklist if there is
+ * room left, otherwise the reference of the caller is simply dropped: the
+ * entries of a page table that is not zeroed are never cached.
+ * 
+ * @param pt The page table to release
+ * @param zeroed True if the caller cleared all the entries of the page table
+ */
+_export void paging_release_pt(const paddr_t pt, const bool zeroed)
+{
+    bool cached = false;
+    if (zeroed) {
+        page_lock(pt);
+        const bool last = page_counter(pt) == 1;
+        page_unlock(pt);
+        preempt_disable();
+        cached = last &&
+                 paging_quicklist_push(this_cpu_ptr(pt_quicklist), pt, 0);
+        preempt_enable();
     }
+    if (!cached)
+        page_free(pt);
 }
 
-void paging_creat_pd(const vaddr_t dst)
+/**
+ * @brief Give the current address space its own copy of a page table
+ * shared by paging_clone_pd(), so that its entries can be modified. The
+ * pages and the compressed pages mapped by the page table are shared with
+ * the copy, and all their entries are made read-only in both page tables:
+ * they are copied on write, see mm_fault_cow(). If the page table is not
+ * shared anymore, it is simply made writable again.
+ * 
+ * @param vaddr An user address mapped by the page table
+ * @return int 0 on success or if the page table is not shared, or
+ *  -ENOMEM if there is no memory left to allocate the copy
+ */
+int paging_unshare_pt(const vaddr_t vaddr)
 {
-    pde_t *pd = (pde_t *) dst;
-    memcpy(pd, kernel_pd, PAGE_SIZE);
-    pd_set_mirroring(pd);
+    assert(vaddr < KERNEL_BASE);
+    pde_t *const pde = paging_get_pde(vaddr);
+    if (!pde->present || pde->large || pde->write)
+        return 0;
+
+    const paddr_t old = pde_get_address(pde);
+    if (page_counter(old) == 1) {
+        pde->write = 1;
+        return 0;
+    }
+
+    const paddr_t pt = paging_alloc_pt();
+    if (pt == 0)
+        return -ENOMEM;
+
+    // The counter is checked again under the page lock: another address
+    // space sharing the page table may have copied it meanwhile, and left
+    // it to this one
+    page_lock(old);
+    if (page_counter(old) == 1) {
+        page_unlock(old);
+        pde->write = 1;
+        paging_release_pt(pt, true);
+        return 0;
+    }
+
+    pte_t *const src = (pte_t *) phys_to_virt(old);
+    pte_t *const dst = (pte_t *) phys_to_virt(pt);
+    for (uint_t i = 0; i < 1024; i++) {
+        if (pte_is_swap(&src[i])) {
+            zram_dup(pte_get_swap(&src[i]));
+        } else if (src[i].present) {
+            src[i].write = 0;
+            page_reference(pte_get_address(&src[i]));
+        } else {
+            continue;
+        }
+        pte_copy(&dst[i], &src[i]);
+        page_pt_inc(pt);
+    }
+    page_dereference(old);
+    page_unlock(old);
+
+    pde_set_address(pde, pt);
+    pde->write = 1;
+
+    // Other threads of the process may run on other CPUs. The entries of
+    // the shared page table were already read-only through its page
+    // directory entry, so the other address spaces are not affected
+    const vaddr_t base = vaddr & PAGING_LARGE_MASK;
+    preempt_disable();
+    flush_tlb();
+    paging_shootdown(get_cr3(), base, base + PAGING_LARGE_SIZE);
+    preempt_enable();
+    return 0;
 }
 
+/**
+ * @brief Allocate a page directory, from the quicklist if possible. The user
+ * part of the page directory is empty and the kernel part is a copy of the
+ * master kernel page directory.
+ * 
+ * @return vaddr_t The virtual address of the page directory in the direct
+ * map, or 0 if there is no memory left
+ */
+_export vaddr_t paging_alloc_pd(void)
+{
+    uint_t generation;
+    preempt_disable();
+    paddr_t pd = paging_quicklist_pop(this_cpu_ptr(pd_quicklist), &generation);
+    preempt_enable();
+    if (pd != 0) {
+        if (generation != kernel_pd_generation)
+            paging_sync_kernel_pd(phys_to_virt(pd));
+        return phys_to_virt(pd);
+    }
+
+    pd = page_alloc(PAGE_NONE);
+    if (pd == 0)
+        return 0;
+    memcpy(phys_to_virt(pd), kernel_pd, PAGE_SIZE);
+    return phys_to_virt(pd);
+}
+
+/**
+ * @brief Release a page directory. Its user part must be empty (see
+ * paging_destroy_userspace()) and it must not be loaded.
+ * 
+ * @param pd The virtual address of the page directory
+ * @param generation The kernel generation the page directory was last
+ * synchronized with
+ */
+_export void paging_release_pd(const vaddr_t pd, const uint_t generation)
+{
+    const paddr_t paddr = virt_to_phys(pd);
+    preempt_disable();
+    const bool cached = paging_quicklist_push(
+        this_cpu_ptr(pd_quicklist),
+        paddr,
+        generation);
+    preempt_enable();
+    if (!cached)
+        page_free(paddr);
+}
+
+/**
+ * @brief Load a page directory. The page directory must be in low memory
+ * and accessed through the direct map.
+ * 
+ * @param pd Virtual address of the page directory to load
+ */
 void paging_set_pd(const vaddr_t pd)
 {
-    set_cr3(paging_get_paddr(pd));
+    assert(direct_mapped(pd));
+    percpu_write(loaded_pd, virt_to_phys(pd));
+    set_cr3(virt_to_phys(pd));
 }
 
 
@@ -298,12 +710,184 @@ void paging_use_kernel_pd(void)
 }
 
 /**
- * @brief Map a physical address to a virtual address in the current address
- * space
+ * @brief Get the page table entry for a given address in the current address
+ * space, and allocate the page table if it does not exist yet. No TLB
+ * invalidation is needed when a page directory entry becomes present: the
+ * TLB never caches entries that are not present.
+ * 
+ * @param vaddr Address to get the page table entry for
+ * @return pte_t* The page table entry, or NULL if the page table cannot be
+ * allocated
+ */
+static pte_t *paging_alloc_pte(const vaddr_t vaddr)
+{
+    pde_t *const pde = paging_get_pde(vaddr);
+    if (pde->present)
+        return paging_get_pte(vaddr);
+
+    if (vaddr < KERNEL_BASE) {
+        const paddr_t pt = paging_alloc_pt();
+        if (pt == 0)
+            return NULL;
+        pde_set_address(pde, pt);
+        pde->user = 1;
+        pde->write = 1;
+        pde->present = 1;
+        return paging_get_pte(vaddr);
+    }
+
+    // Kernel page tables are shared by all address spaces: install them
+    // in the master kernel page directory, other page directories will
+    // pick them up lazily
+    spin_acquire(&kernel_pd_lock) {
+        pde_t *const master = &kernel_pd[pd_offset(vaddr)];
+        if (!master->present) {
+            const paddr_t pt = paging_alloc_pt();
+            if (pt == 0)
+                return NULL;
+            pde_set_address(master, pt);
+            master->write = 1;
+            master->present = 1;
+            kernel_pd_generation++;
+        }
+        pde_copy(pde, master);
+    }
+    return paging_get_pte(vaddr);
+}
+
+/**
+ * @brief Account for a cleared entry in a user page table, and release the
+ * page table if it does not contain any used entry anymore. The caller must
+ * invalidate the TLB entry of vaddr (which also flushes the paging structure
+ * caches) before the returned page table is freed.
  * 
- * TODO: Reduce invlpg count (invlpg is expensive and called multiple times
- * when calling paging_set_rights() and paging_set_acess()) and verify if we
- * use invlpg correctly
+ * @param vaddr The user address whose entry has been cleared
+ * @return paddr_t The physical address of the page table to free, or 0 if
+ * the page table is still in use
+ */
+static paddr_t paging_put_pte(const vaddr_t vaddr)
+{
+    pde_t *const pde = paging_get_pde(vaddr);
+    const paddr_t pt = pde_get_address(pde);
+    if (vaddr >= KERNEL_BASE || page_pt_dec(pt) != 0)
+        return 0;
+
+    pde_clear(pde);
+    return pt;
+}
+
+/**
+ * @brief Build a page table entry and write it with a single store, so the
+ * entry is never seen in an intermediate state.
+ * 
+ * @param pte The page table entry to write
+ * @param paddr Physical address to map
+ * @param access Access rights of the mapping
+ * @param flags Flags of the mapping
+ */
+static void paging_write_pte(
+    pte_t *const pte,
+    const paddr_t paddr,
+    const int access,
+    const int flags)
+{
+    pte_t entry = {.value = 0};
+    pte_set_address(&entry, paddr);
+    entry.write = !!(access & PAGING_WRITE);
+    entry.user = !!(access & PAGING_USER);
+    entry.global = !!(flags & PAGING_GLOBAL);
+    entry.present = !!(flags & PAGING_PRESENT);
+    entry.cache_disable = !!(flags & PAGING_NOCACHE);
+    pte_copy(pte, &entry);
+}
+
+/**
+ * @brief Map a page without any TLB invalidation. The entry must not be
+ * present, so there is nothing to invalidate. Kernel mappings are shared by
+ * all address spaces and are therefore always mapped as global pages.
+ * 
+ * @return 0 on success, or -1 if the page table cannot be allocated
+ */
+static int __paging_map_page(
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags)
+{
+    assert(!direct_mapped(vaddr) && !kmapped(vaddr));
+    assert(!null(vaddr));
+    assert(!null(paddr));
+
+    pte_t *const pte = paging_alloc_pte(vaddr);
+    if (pte == NULL)
+        return -1;
+    if (pte->present)
+        panic("Mapping page at 0x%08x: already mapped", vaddr);
+
+    if (vaddr >= KERNEL_BASE) {
+        paging_write_pte(pte, paddr, access, flags | PAGING_GLOBAL);
+        return 0;
+    }
+    if (flags & PAGING_PRESENT)
+        page_pt_inc(pde_get_address(paging_get_pde(vaddr)));
+    paging_write_pte(pte, paddr, access, flags);
+    return 0;
+}
+
+/**
+ * @brief Invalidate a modified page in the TLB of the current CPU and of
+ * the other CPUs which may have cached the old entry.
+ * 
+ * @param vaddr The modified address
+ */
+static void paging_invalidate(const vaddr_t vaddr)
+{
+    preempt_disable();
+    invlpg(vaddr);
+    paging_shootdown(get_cr3(), vaddr, vaddr + PAGE_SIZE);
+    preempt_enable();
+}
+
+/**
+ * @brief Add a modified address to the range that will be invalidated when
+ * the batch is committed.
+ * 
+ * @param batch The paging batch
+ * @param vaddr The modified address
+ */
+static void paging_batch_add(paging_batch_t *batch, const vaddr_t vaddr)
+{
+    const vaddr_t page = PAGE_ALIGN(vaddr);
+    if (batch->end == 0) {
+        batch->start = page;
+        batch->end = page + PAGE_SIZE;
+    } else {
+        batch->start = min(batch->start, page);
+        batch->end = max(batch->end, page + PAGE_SIZE);
+    }
+    if (page >= KERNEL_BASE)
+        batch->global = true;
+}
+
+/**
+ * @brief Add a page to free when the batch is committed. When the batch
+ * cannot hold more pages to release, it is committed automatically.
+ * 
+ * @param batch The paging batch
+ * @param paddr The physical page to free after the TLB invalidation
+ */
+static void paging_batch_release(paging_batch_t *batch, const paddr_t paddr)
+{
+    batch->pages[batch->nr_pages++] = paddr;
+    if (batch->nr_pages == PAGING_BATCH_MAX_PAGES)
+        paging_batch_commit(batch);
+}
+
+/**
+ * @brief Map a physical address to a virtual address in the current address
+ * space. The entry must not be already mapped, so no TLB invalidation is
+ * needed. Kernel mappings are shared by all address spaces and are therefore
+ * always mapped as global pages.
  * 
  * @param vaddr Where to map the physical address
  * @param paddr Physical address to map
@@ -317,30 +901,42 @@ _export int paging_map_page(
     const int access,
     const int flags)
 {
-    assert(!mirroring(vaddr));
-    assert(!null(vaddr));
+    return __paging_map_page(vaddr, paddr, access, flags);
+}
+
+/**
+ * @brief Replace the physical page mapped at an address in the current
+ * address space. The address must be mapped with a normal page, and the
+ * new mapping must be present.
+ * 
+ * @param vaddr The address to remap
+ * @param paddr The new physical address to map
+ * @param access Access rights of the new mapping
+ * @param flags Flags of the new mapping
+ * @return paddr_t The physical page previously mapped, or 0 if the address
+ * is not mapped
+ */
+_export paddr_t paging_remap_page(
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags)
+{
+    assert(!direct_mapped(vaddr) && !kmapped(vaddr));
+    assert(flags & PAGING_PRESENT);
     assert(!null(paddr));
-    pde_t *const pde = paging_get_pde(vaddr);   
-    const bool user = (vaddr < KERNEL_BASE);
-    if (!pde->present) {
-        const paddr_t pt = page_alloc(PAGE_CLEAR);
-        if (pt == 0)
-            return -1;
-        pde_set_address(pde, pt);
-        pde->present = 1;
-        pde->user = user;
-        pde->write = 1;
-        invlpg((vaddr_t) paging_get_pte(vaddr));
-    }
 
-    pte_t *const pte = paging_get_pte(vaddr);   
-    if(pte->present)
-        panic("Mapping page at 0x%08x: already mapped", vaddr);
-    paging_set_rights(vaddr, access);
-    paging_set_flags(vaddr, flags);
-    pte_set_address(pte, paddr);
-    invlpg(vaddr);
-    return 0;
+    pte_t *const pte = paging_get_pte(vaddr);
+    if (pte == NULL || !pte->present)
+        return 0;
+
+    const paddr_t old = pte_get_address(pte);
+    if (vaddr >= KERNEL_BASE)
+        paging_write_pte(pte, paddr, access, flags | PAGING_GLOBAL);
+    else
+        paging_write_pte(pte, paddr, access, flags);
+    paging_invalidate(vaddr);
+    return old;
 }
 
 /**
@@ -360,7 +956,7 @@ _export int paging_set_rights(const vaddr_t vaddr, const int access)
         pte->write = 1;
     if (access & PAGING_USER)
         pte->user = 1;
-    invlpg(vaddr);
+    paging_invalidate(vaddr);
     return 0;
 }
 
@@ -381,7 +977,7 @@ _export int paging_set_flags(const vaddr_t vaddr, const int flags)
         pte->present = 1;
     if (flags & PAGING_GLOBAL)
         pte->global = 1;
-    invlpg(vaddr);
+    paging_invalidate(vaddr);
     return 0;
 }
 
@@ -423,9 +1019,27 @@ _export int paging_flags(const vaddr_t vaddr)
         flags |= PAGING_PRESENT;
     if (pte->global)
         flags |= PAGING_GLOBAL;
+    if (pte->cache_disable)
+        flags |= PAGING_NOCACHE;
     return flags;
 }
 
+/**
+ * @brief Clear a swap entry and release the swapped page. Swap entries are
+ * not present, so there is nothing to invalidate.
+ * 
+ * @param pte The swap entry
+ * @param vaddr The address mapped by the entry
+ * @return paddr_t The page table if it became empty and must be released
+ * (see paging_put_pte()), or 0
+ */
+static paddr_t paging_drop_swap(pte_t *pte, const vaddr_t vaddr)
+{
+    zram_free(pte_get_swap(pte));
+    pte_clear(pte);
+    return paging_put_pte(vaddr);
+}
+
 /**
  * @brief Unmap a virtual address in the current address space
  * 
@@ -435,18 +1049,429 @@ _export int paging_flags(const vaddr_t vaddr)
  */
 _export int paging_unmap_page(const vaddr_t vaddr)
 {
-    assert(!mirroring(vaddr));
+    assert(!direct_mapped(vaddr) && !kmapped(vaddr));
     assert(!null(vaddr));
 
     // Unmap the page at the given address
     pte_t *const pte = paging_get_pte(vaddr);
-    if (pte == NULL || !pte->present)
+    if (pte == NULL)
+        return 0;
+    if (pte_is_swap(pte)) {
+        paging_drop_swap(pte, vaddr);
+        return 0;
+    }
+    if (!pte->present)
         return 0;
 
-    // Allocated page tables are never freed by simplicity
-    // Is it useful to do so ?
+    // User page tables are released when they become empty, kernel page
+    // tables are shared by all address spaces and are never released
     const paddr_t page_addr = pte_get_address(pte);
     pte_clear(pte);
-    invlpg(vaddr);
+    const paddr_t pt = paging_put_pte(vaddr);
+    paging_invalidate(vaddr);
+    if (pt != 0)
+        paging_release_pt(pt, true);
     return page_addr;
 }
+
+/**
+ * @brief Initialize a paging batch. A batch gathers modifications of page
+ * table entries in the current address space and invalidates the TLB only
+ * once, when the batch is committed. Pages released through the batch are
+ * freed only after the invalidation, so a stale TLB entry can never point
+ * to a page that was reused.
+ * 
+ * Usage:
+ *  paging_batch_t batch;
+ *  paging_batch_init(&batch);
+ *  ...     // paging_batch_map(), paging_batch_unmap()...
+ *  paging_batch_commit(&batch);
+ * 
+ * @param batch The batch to initialize
+ */
+_export void paging_batch_init(paging_batch_t *batch)
+{
+    batch->start = 0;
+    batch->end = 0;
+    batch->global = false;
+    batch->nr_pages = 0;
+}
+
+/**
+ * @brief Map a page inside a batch. The entry must not be mapped, so this
+ * does not add anything to invalidate.
+ * 
+ * @param batch The paging batch
+ * @param vaddr Where to map the physical address
+ * @param paddr Physical address to map
+ * @param access Access rights of the mapping
+ * @param flags Flags for the mapping
+ * @return 0 on success, or -1 if there are not enought memory 
+ */
+_export int paging_batch_map(
+    paging_batch_t *batch,
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags)
+{
+    return __paging_map_page(vaddr, paddr, access, flags);
+}
+
+/**
+ * @brief Unmap a page inside a batch. If release is set, the physical page
+ * is freed when the batch is committed, as well as the page table if it
+ * becomes empty.
+ * 
+ * @param batch The paging batch
+ * @param vaddr Address to unmap
+ * @param release Free the physical page after the TLB invalidation
+ * @return paddr_t Physical address of the page that was unmapped, or 0 if
+ * the address is not mapped
+ */
+_export paddr_t paging_batch_unmap(
+    paging_batch_t *batch,
+    const vaddr_t vaddr,
+    const bool release)
+{
+    assert(!direct_mapped(vaddr) && !kmapped(vaddr));
+    assert(!null(vaddr));
+
+    pte_t *const pte = paging_get_pte(vaddr);
+    if (pte == NULL)
+        return 0;
+    if (pte_is_swap(pte)) {
+        const paddr_t pt = paging_drop_swap(pte, vaddr);
+        if (pt != 0)
+            paging_batch_release(batch, pt | PAGING_BATCH_TABLE);
+        return 0;
+    }
+    if (!pte->present)
+        return 0;
+
+    const paddr_t paddr = pte_get_address(pte);
+    pte_clear(pte);
+    paging_batch_add(batch, vaddr);
+    const paddr_t pt = paging_put_pte(vaddr);
+    if (release)
+        paging_batch_release(batch, paddr);
+    if (pt != 0)
+        paging_batch_release(batch, pt | PAGING_BATCH_TABLE);
+    return paddr;
+}
+
+/**
+ * @brief Change the access rights of a page inside a batch.
+ * 
+ * @param batch The paging batch
+ * @param vaddr Address to set the access rights for
+ * @param access Access rights to set
+ * @return 0 on success, or -1 if the address is not mapped
+ */
+_export int paging_batch_set_rights(
+    paging_batch_t *batch,
+    const vaddr_t vaddr,
+    const int access)
+{
+    pte_t *const pte = paging_get_pte(vaddr);
+    if (pte == NULL)
+        return -1;
+
+    pte_t entry = {.value = pte->value};
+    entry.write = !!(access & PAGING_WRITE);
+    entry.user = !!(access & PAGING_USER);
+    pte_copy(pte, &entry);
+    if (entry.present)
+        paging_batch_add(batch, vaddr);
+    return 0;
+}
+
+/**
+ * @brief Commit a batch: invalidate the TLB for all modified entries with a
+ * single ranged invalidation (or a full flush if the range is too large),
+ * then release the pages unmapped in the batch. The batch is reinitialized
+ * and can be reused.
+ * 
+ * @param batch The batch to commit
+ */
+_export void paging_batch_commit(paging_batch_t *batch)
+{
+    if (batch->end != 0) {
+        preempt_disable();
+        const uint_t count = (batch->end - batch->start) >> PAGE_SHIFT;
+        if (count <= PAGING_BATCH_INVLPG_MAX) {
+            for (vaddr_t addr = batch->start;
+                addr < batch->end;
+                addr += PAGE_SIZE)
+                invlpg(addr);
+        } else if (batch->global) {
+            flush_tlb_global();
+        } else {
+            flush_tlb();
+        }
+        paging_shootdown(get_cr3(), batch->start, batch->end);
+        preempt_enable();
+    }
+
+    for (uint_t i = 0; i < batch->nr_pages; i++) {
+        const paddr_t page = PAGE_ALIGN(batch->pages[i]);
+        if (batch->pages[i] & PAGING_BATCH_TABLE)
+            paging_release_pt(page, true);
+        else
+            page_free(page);
+    }
+    paging_batch_init(batch);
+}
+
+/**
+ * @brief Map 4 MiB of physically contiguous memory with a single large page
+ * directory entry in the current address space. Kernel large pages are
+ * installed in the master kernel page directory and are global. As for
+ * paging_map_page(), no TLB invalidation is needed.
+ * 
+ * @param vaddr Where to map the memory, must be aligned on 4 MiB
+ * @param paddr Physical address to map, must be aligned on 4 MiB
+ * @param access Access rights of the mapping
+ * @param flags Flags for the mapping
+ * @return 0 on success, or -1 if the page directory entry is already used
+ * (by a page table or by another large page)
+ */
+_export int paging_map_large(
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags)
+{
+    assert(!direct_mapped(vaddr) && !kmapped(vaddr));
+    assert(!(vaddr & ~PAGING_LARGE_MASK));
+    assert(!(paddr & ~PAGING_LARGE_MASK));
+    assert(!null(vaddr));
+
+    pde_t entry = {.value = 0};
+    pde_set_address(&entry, paddr);
+    entry.write = !!(access & PAGING_WRITE);
+    entry.user = !!(access & PAGING_USER);
+    entry.present = !!(flags & PAGING_PRESENT);
+    entry.large = 1;
+
+    pde_t *const pde = paging_get_pde(vaddr);
+    if (vaddr < KERNEL_BASE) {
+        if (pde->present)
+            return -1;
+        pde_copy(pde, &entry);
+        return 0;
+    }
+
+    entry.global = 1;
+    spin_acquire(&kernel_pd_lock) {
+        pde_t *const master = &kernel_pd[pd_offset(vaddr)];
+        if (master->present)
+            return -1;
+        pde_copy(master, &entry);
+        pde_copy(pde, &entry);
+        kernel_pd_generation++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy a kernel page directory entry of the master kernel page
+ * directory into the page directory loaded on the CPU, and invalidate the
+ * TLB entry of the large page it mapped. Called on each CPU when a kernel
+ * large page is unmapped: the entry is present in the loaded page directory,
+ * so it would never be synchronized by paging_sync_kernel_pde(). Interrupts
+ * or preemption must be disabled.
+ * 
+ * @param data The kernel address whose entry changed
+ */
+static void paging_reload_kernel_pde(void *data)
+{
+    const vaddr_t vaddr = (vaddr_t) data;
+    pde_copy(paging_get_pde(vaddr), &kernel_pd[pd_offset(vaddr)]);
+    invlpg(vaddr);
+}
+
+/**
+ * @brief Unmap a large page in the current address space. A kernel large
+ * page is removed from the master kernel page directory and from the page
+ * directories loaded on all CPUs. Other page directories are synchronized
+ * with the master kernel page directory when they are loaded, because the
+ * generation changed, see mm_context_set().
+ * 
+ * @param vaddr Address of the large page, must be aligned on 4 MiB
+ * @return paddr_t The physical address of the large page, or 0 if the
+ * address is not mapped by a large page
+ */
+_export paddr_t paging_unmap_large(const vaddr_t vaddr)
+{
+    assert(!(vaddr & ~PAGING_LARGE_MASK));
+    pde_t *const pde = paging_get_pde(vaddr);
+    if (!pde->present || !pde->large)
+        return 0;
+
+    const paddr_t paddr = pde_get_address(pde);
+    preempt_disable();
+    if (vaddr >= KERNEL_BASE) {
+        spin_acquire(&kernel_pd_lock) {
+            pde_clear(&kernel_pd[pd_offset(vaddr)]);
+            kernel_pd_generation++;
+        }
+        paging_reload_kernel_pde((void *) vaddr);
+        smp_call_others(paging_reload_kernel_pde, (void *) vaddr);
+    } else {
+        pde_clear(pde);
+        invlpg(vaddr);
+        paging_shootdown(get_cr3(), vaddr, vaddr + PAGING_LARGE_SIZE);
+    }
+    preempt_enable();
+    return paddr;
+}
+
+/**
+ * @brief Split a user large page into a page table of normal pages, so that
+ * a part of it can be unmapped. Each page of a large page has its own 
+ * reference counter, so the physical pages are simply reused.
+ * 
+ * @param vaddr An address inside the large page
+ * @return int 0 on success or if the address is not mapped by a large page,
+ * or -1 if the page table cannot be allocated
+ */
+_export int paging_split_large(const vaddr_t vaddr)
+{
+    assert(vaddr < KERNEL_BASE);
+    pde_t *const pde = paging_get_pde(vaddr);
+    if (!pde->present || !pde->large)
+        return 0;
+
+    const paddr_t pt = paging_alloc_pt();
+    if (pt == 0)
+        return -1;
+
+    pte_t *const ptes = (pte_t *) phys_to_virt(pt);
+    const paddr_t large = pde_get_address(pde);
+    const int access = PAGING_READ | PAGING_USER |
+        ((pde->write) ? PAGING_WRITE : PAGING_NONE);
+    for (uint_t i = 0; i < PAGING_LARGE_SIZE / PAGE_SIZE; i++) {
+        paging_write_pte(
+            &ptes[i],
+            large + (i << PAGE_SHIFT),
+            access,
+            PAGING_PRESENT);
+        page_pt_inc(pt);
+    }
+
+    pde_t entry = {.value = 0};
+    pde_set_address(&entry, pt);
+    entry.present = 1;
+    entry.write = 1;
+    entry.user = 1;
+    pde_copy(pde, &entry);
+    paging_invalidate(vaddr & PAGING_LARGE_MASK);
+    return 0;
+}
+
+/**
+ * @brief Get a kernel address to access a physical page. Low memory pages
+ * are always mapped by the direct map, and no mapping is needed. High memory
+ * pages are temporarily mapped in the kmap window, until kunmap() is called.
+ * 
+ * @param paddr Physical address to access
+ * @return vaddr_t The kernel address of the physical address
+ */
+_export vaddr_t kmap(const paddr_t paddr)
+{
+    if (!highmem(paddr))
+        return phys_to_virt(paddr);
+
+    spin_acquire(&kmap_lock) {
+        for (uint_t i = 0; i < KMAP_SHARED_PAGES; i++) {
+            const uint_t slot = (kmap_next + i) % KMAP_SHARED_PAGES;
+            if (kmap_pt[slot].present)
+                continue;
+
+            // The slot was invalidated when it was released
+            kmap_next = (slot + 1) % KMAP_SHARED_PAGES;
+            paging_write_pte(
+                &kmap_pt[slot],
+                PAGE_ALIGN(paddr),
+                PAGING_READ | PAGING_WRITE,
+                PAGING_PRESENT | PAGING_GLOBAL);
+            return KMAP_BASE + (slot << PAGE_SHIFT) + pg_offset(paddr);
+        }
+    }
+    panic("No free slot in the kmap window");
+}
+
+/**
+ * @brief Release an address returned by kmap(). The slot may be cached by
+ * any CPU, so it is invalidated on all CPUs.
+ * 
+ * @param vaddr The address returned by kmap()
+ */
+_export void kunmap(const vaddr_t vaddr)
+{
+    if (!kmapped(vaddr))
+        return;
+    spin_acquire(&kmap_lock) {
+        pte_clear(&kmap_pt[pt_offset(vaddr)]);
+        invlpg(PAGE_ALIGN(vaddr));
+    }
+    smp_flush_tlb(PAGE_ALIGN(vaddr), PAGE_ALIGN(vaddr) + PAGE_SIZE);
+}
+
+/**
+ * @brief Get a kernel address to access a physical page for a short time,
+ * like kmap(). High memory pages are mapped in a slot private to the
+ * current CPU, so preemption is disabled until kunmap_atomic() is called,
+ * and releasing the slot only invalidates the local TLB. The slots are used
+ * as a stack: the addresses must be released in the reverse order.
+ * 
+ * @param paddr Physical address to access
+ * @return vaddr_t The kernel address of the physical address
+ */
+_export vaddr_t kmap_atomic(const paddr_t paddr)
+{
+    preempt_disable();
+    if (!highmem(paddr))
+        return phys_to_virt(paddr);
+
+    // An interrupt handler may use the next slots meanwhile, but releases
+    // them before returning
+    const uint_t depth = percpu_read(kmap_atomic_depth);
+    if (depth >= KMAP_ATOMIC_SLOTS)
+        panic("No free slot in the kmap_atomic window");
+    percpu_inc(kmap_atomic_depth);
+
+    // The slot was invalidated when it was released
+    const uint_t slot = KMAP_SHARED_PAGES +
+                        smp_cpu_id() * KMAP_ATOMIC_SLOTS + depth;
+    paging_write_pte(
+        &kmap_pt[slot],
+        PAGE_ALIGN(paddr),
+        PAGING_READ | PAGING_WRITE,
+        PAGING_PRESENT);
+    return KMAP_BASE + (slot << PAGE_SHIFT) + pg_offset(paddr);
+}
+
+/**
+ * @brief Release an address returned by kmap_atomic(), and enable
+ * preemption again.
+ * 
+ * @param vaddr The address returned by kmap_atomic()
+ */
+_export void kunmap_atomic(const vaddr_t vaddr)
+{
+    if (kmapped(vaddr)) {
+        const uint_t slot = pt_offset(vaddr);
+        const uint_t depth = percpu_read(kmap_atomic_depth) - 1;
+        assert(slot == KMAP_SHARED_PAGES +
+                       smp_cpu_id() * KMAP_ATOMIC_SLOTS + depth);
+
+        // Invalidated before being released, so that an interrupt handler
+        // never reuses a stale translation of the slot
+        pte_clear(&kmap_pt[slot]);
+        invlpg(PAGE_ALIGN(vaddr));
+        percpu_dec(kmap_atomic_depth);
+    }
+    preempt_enable();
+}
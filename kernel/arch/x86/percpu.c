@@ -0,0 +1,49 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/memory.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/percpu.h>
+
+extern char _percpu_start[];
+extern char _percpu_end[];
+
+// Copies of the per-CPU section. The base of the GS segment of each CPU
+// is the offset of its copy, see gdt_install()
+static uint8_t areas[SMP_MAX_CPUS][PERCPU_AREA_SIZE] _align(PAGE_SIZE);
+uintptr_t percpu_offsets[SMP_MAX_CPUS];
+
+DEFINE_PER_CPU(uintptr_t, this_cpu_off);
+DEFINE_PER_CPU(uint_t, cpu_number);
+
+/**
+ * @brief Copy the per-CPU section for each possible CPU. Must be called
+ * before the GDT of any CPU is installed, and before any per-CPU variable
+ * is used.
+ */
+_init void percpu_setup(void)
+{
+    const size_t size = _percpu_end - _percpu_start;
+    for (uint_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        memcpy(areas[cpu], _percpu_start, size);
+        percpu_offsets[cpu] = (uintptr_t) areas[cpu] -
+                              (uintptr_t) _percpu_start;
+        *per_cpu_ptr(this_cpu_off, cpu) = percpu_offsets[cpu];
+        *per_cpu_ptr(cpu_number, cpu) = cpu;
+    }
+}
@@ -68,3 +68,36 @@ time_t pit_nano_offset(void)
 	const uint32_t count = count_low | (count_high) << 8;
     return (time_t) ((PIT_KERN_LATCH - (PIT_KERN_LATCH - count)) * PIT_TICK_NS);
 }
+
+/**
+ * @brief Read the current count of the channel 0 of the PIT.
+ */
+static uint32_t pit_read_count(void)
+{
+    outb(PIT_IO_CMD, PIT_CHANNEL0 | PIT_ACCESS_LATCH);
+    const uint32_t count_low = inb(PIT_IO_TIMER0);
+    const uint32_t count_high = inb(PIT_IO_TIMER0);
+    return count_low | count_high << 8;
+}
+
+/**
+ * @brief Busy wait for at least the given time, by polling the count of the
+ * channel 0 of the PIT. Works with interrupts disabled, and is therefore
+ * used during the initialization of the hardware.
+ * 
+ * @param us The time to wait, in microseconds (at most a few seconds)
+ */
+void pit_udelay(const uint_t us)
+{
+    uint32_t remaining = us * (PIT_INTERN_FREQ / 1000) / 1000 + 1;
+    uint32_t last = pit_read_count();
+    while (remaining > 0) {
+        // The count goes down from PIT_KERN_LATCH and is reloaded at 0
+        const uint32_t count = pit_read_count();
+        const uint32_t elapsed = (count <= last) ?
+            last - count :
+            last + PIT_KERN_LATCH - count;
+        remaining = (elapsed >= remaining) ? 0 : remaining - elapsed;
+        last = count;
+    }
+}
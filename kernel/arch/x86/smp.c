@@ -0,0 +1,447 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <mm/page.h>
+#include <mm/malloc.h>
+#include <lib/memory.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/gdt.h>
+#include <arch/x86/idt.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/pit.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/tss.h>
+#include <arch/x86/acpi.h>
+#include <arch/x86/apic.h>
+#include <process/process.h>
+#include <process/schedule.h>
+
+/**
+ * @file Bring-up of the application processors (APs) and interprocessor
+ * interrupts. The CPUs are listed by the MADT of ACPI, and each AP is
+ * started with the INIT-SIPI-SIPI sequence on a trampoline copied in low
+ * memory (see smp.asm). The trampoline switches to protected mode and
+ * paging, and calls smp_ap_main() on the stack of the idle thread of the
+ * AP, which sets up its own GDT, TSS and local APIC before running its
+ * idle thread.
+ * 
+ * CPUs are identified by an index, from 0 for the bootstrap processor. The
+ * per-CPU data of the kernel are declared with DEFINE_PER_CPU in a section
+ * copied once for each CPU, and the GS segment base of a CPU points to its
+ * own copy (see percpu.h).
+ */
+
+// Data written in the trampoline by the BSP, see smp.asm
+typedef struct smp_trampoline {
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint32_t entry32;           // Physical address of smp_trampoline_32
+    uint16_t code_selector;
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+} _packed smp_trampoline_t;
+
+extern char smp_trampoline_start[];
+extern char smp_trampoline_32[];
+extern char smp_trampoline_gdt[];
+extern char smp_trampoline_data[];
+extern char smp_trampoline_end[];
+
+static uint_t nr_cpus = 1;                  // CPUs found in the MADT
+static uint8_t apic_ids[SMP_MAX_CPUS];      // Local APIC ID of each CPU
+static volatile uint32_t online = 0x1;      // Bitmap of the online CPUs
+static volatile uint_t nr_online = 1;
+static volatile uint_t booting = 0;         // Index of the starting AP,
+                                            // SMP_MAX_CPUS if none
+
+// Function called on the other CPUs, see smp_call_others()
+static DECLARE_SPINLOCK(call_lock);
+static smp_call_t call_func = NULL;
+static void *call_data = NULL;
+static volatile uint32_t call_pending = 0;  // CPUs that did not run it yet
+
+/**
+ * @brief Run the function requested by smp_call_others() if the current
+ * CPU did not run it yet. Must be called with interrupts disabled.
+ */
+static void smp_call_poll(void)
+{
+    const uint32_t mask = 1u << smp_cpu_id();
+    if (call_pending & mask) {
+        call_func(call_data);
+        __sync_fetch_and_and(&call_pending, ~mask);
+    }
+}
+
+static void smp_call_interrupt(cpu_state_t *state)
+{
+    smp_call_poll();
+}
+
+/**
+ * @brief The current thread is rescheduled when the interrupt returns: its
+ * reschedule flag was set by the sender.
+ */
+static void smp_reschedule_interrupt(cpu_state_t *state)
+{
+}
+
+static void smp_timer_interrupt(cpu_state_t *state)
+{
+    schedule_tick();
+}
+
+/**
+ * @brief The entry of the application processors, called by the trampoline
+ * on the stack of their idle thread, just below its initial state. Not in
+ * the init section, because the boot may be completed before it returns.
+ * The AP claims its index first: if the BSP already gave up on it, it stops
+ * there and waits to be parked by an INIT (see smp_start_ap()).
+ */
+_noreturn
+static void smp_ap_main(void)
+{
+    const uint_t cpu = booting;
+    if (cpu == SMP_MAX_CPUS ||
+        !__sync_bool_compare_and_swap(&booting, cpu, SMP_MAX_CPUS))
+        cpu_stop();
+    gdt_install(cpu);
+    tss_install(cpu);
+    idt_flush();
+    fpu_setup();
+    paging_use_kernel_pd();
+    apic_enable();
+    apic_timer_start();
+
+    __sync_fetch_and_add(&nr_online, 1);
+    __sync_fetch_and_or(&online, 1u << cpu);
+    scheduler_start();
+}
+
+/**
+ * @brief Wait until an AP is online, or until the given time elapsed.
+ */
+_init bool smp_wait_online(const uint_t cpu, const uint_t us)
+{
+    for (uint_t i = 0; i < us; i += 100) {
+        if (smp_cpu_online(cpu))
+            return true;
+        pit_udelay(100);
+    }
+    return smp_cpu_online(cpu);
+}
+
+/**
+ * @brief Start an AP with the INIT-SIPI-SIPI sequence: the second startup
+ * interrupt is only sent if the AP did not start after the first one. If
+ * the AP does not come online in time and did not claim its index yet, it
+ * is given up and parked with an INIT, so that it never runs the trampoline
+ * once its data are rewritten for the next AP.
+ * 
+ * @param cpu The index of the AP
+ * @param trampoline The physical address of the copy of the trampoline
+ * @return bool true if the AP is online
+ */
+_init bool smp_start_ap(const uint_t cpu, const paddr_t trampoline)
+{
+    booting = cpu;
+    apic_send_init(apic_ids[cpu]);
+    pit_udelay(SMP_INIT_DELAY);
+
+    apic_send_startup(apic_ids[cpu], trampoline);
+    if (smp_wait_online(cpu, SMP_STARTUP_DELAY))
+        return true;
+    apic_send_startup(apic_ids[cpu], trampoline);
+    if (smp_wait_online(cpu, SMP_ONLINE_TIMEOUT))
+        return true;
+
+    // An AP that claimed its index is only late: let it finish
+    if (!__sync_bool_compare_and_swap(&booting, cpu, SMP_MAX_CPUS))
+        return smp_wait_online(cpu, SMP_ONLINE_TIMEOUT);
+    apic_send_init(apic_ids[cpu]);
+    pit_udelay(SMP_INIT_DELAY);
+    return false;
+}
+
+/**
+ * @brief Start all the APs found in the MADT, one at a time. The trampoline
+ * is copied in a page below 1 MiB, and runs with a temporary page directory
+ * that maps the first 4 MiB at their physical address, so that paging can
+ * be enabled while running the trampoline.
+ */
+_init void smp_start_aps(void)
+{
+    // The idle threads are created first: their stack must be mapped in
+    // the kernel part of the temporary page directory
+    for (uint_t cpu = 1; cpu < nr_cpus; cpu++)
+        if (process_creat_idle(cpu) == NULL)
+            panic("Failed to create the idle thread of CPU %u", cpu);
+
+    const paddr_t page = page_alloc(PAGE_BIOS);
+    if (page == 0 || page >= 0x100000) {
+        warn("No memory below 1 MiB to start the other CPUs");
+        if (page != 0)
+            page_free(page);
+        return;
+    }
+
+    const uint_t generation = paging_kernel_generation();
+    const vaddr_t pd = paging_alloc_pd();
+    if (pd == 0)
+        panic("Failed to allocate the page directory of the other CPUs");
+    pde_t *const identity = (pde_t *) pd;
+    pde_set_address(identity, 0);
+    identity->present = 1;
+    identity->write = 1;
+    identity->large = 1;
+
+    char *const trampoline = (char *) phys_to_virt(page);
+    memcpy(trampoline, smp_trampoline_start,
+        smp_trampoline_end - smp_trampoline_start);
+    smp_trampoline_t *const data = (smp_trampoline_t *)
+        (trampoline + (smp_trampoline_data - smp_trampoline_start));
+    data->gdt_base = page + (smp_trampoline_gdt - smp_trampoline_start);
+    data->entry32 = page + (smp_trampoline_32 - smp_trampoline_start);
+    data->cr0 = get_cr0();
+    data->cr3 = virt_to_phys(pd);
+    data->cr4 = get_cr4();
+    data->entry = (uint32_t) smp_ap_main;
+
+    bool failed = false;
+    for (uint_t cpu = 1; cpu < nr_cpus; cpu++) {
+        data->stack = (uint32_t) scheduler_get_idle(cpu)->cpu_state;
+        if (!smp_start_ap(cpu, page)) {
+            warn("CPU %u (APIC %u) did not start", cpu, apic_ids[cpu]);
+            failed = true;
+        }
+    }
+
+    // An AP that did not start may still be running the trampoline if the
+    // INIT did not park it: its page and page directory are never released
+    if (failed)
+        return;
+    pde_clear(identity);
+    paging_release_pd(pd, generation);
+    page_free(page);
+}
+
+/**
+ * @brief Read the local APICs of the MADT: each enabled local APIC is a CPU.
+ * CPUs above SMP_MAX_CPUS are ignored.
+ */
+_init void smp_parse_madt(const struct acpi_madt *madt)
+{
+    const uint8_t *entry = madt->entries;
+    const uint8_t *const end = (const uint8_t *) madt + madt->header.length;
+    while (entry + sizeof(struct acpi_madt_entry) <= end) {
+        const struct acpi_madt_entry *header = (void *) entry;
+        if (header->length < sizeof(struct acpi_madt_entry))
+            break;
+
+        const struct acpi_madt_lapic *lapic = (void *) entry;
+        if (header->type == ACPI_MADT_LAPIC &&
+            lapic->flags & ACPI_MADT_LAPIC_ENABLED &&
+            lapic->apic_id != apic_ids[0]) {
+            if (nr_cpus < SMP_MAX_CPUS)
+                apic_ids[nr_cpus++] = lapic->apic_id;
+            else
+                warn("CPU with APIC %u ignored", lapic->apic_id);
+        }
+        entry += header->length;
+    }
+}
+
+/**
+ * @brief Find the other CPUs and start them. Must be called after the
+ * scheduler is initialized, and before the init sections are released. If
+ * there is no local APIC or no MADT, only the bootstrap processor is used.
+ */
+_init void smp_setup(void)
+{
+#ifdef CONFIG_SMP
+    if (!(cpuid_edx(CPUID_GET_FEATURE) & CPUID_EDX_FEATURE_APIC))
+        return;
+    struct acpi_madt *madt = (void *) acpi_find_table(ACPI_MADT_SIGNATURE);
+    if (madt == NULL) {
+        info("No MADT found, only one CPU is used");
+        return;
+    }
+
+    apic_setup(madt->lapic);
+    apic_enable();
+    apic_ids[0] = apic_id();
+    smp_parse_madt(madt);
+    free(madt);
+
+    apic_request(APIC_TIMER_VECTOR, smp_timer_interrupt);
+    apic_request(APIC_RESCHEDULE_VECTOR, smp_reschedule_interrupt);
+    apic_request(APIC_CALL_VECTOR, smp_call_interrupt);
+    if (nr_cpus > 1) {
+        apic_timer_calibrate();
+        smp_start_aps();
+    }
+    info("%u CPUs online", smp_cpu_count());
+#endif
+}
+
+/**
+ * @brief Get the number of online CPUs.
+ */
+_export uint_t smp_cpu_count(void)
+{
+    return nr_online;
+}
+
+/**
+ * @brief Check if a CPU is online.
+ * 
+ * @param cpu The index of the CPU
+ */
+bool smp_cpu_online(const uint_t cpu)
+{
+    return cpu < SMP_MAX_CPUS && online & (1u << cpu);
+}
+
+/**
+ * @brief Make another CPU reschedule its current thread, whose reschedule
+ * flag must be already set. Nothing is done for the current CPU.
+ * 
+ * @param cpu The index of the CPU
+ */
+void smp_send_reschedule(const uint_t cpu)
+{
+    assert(smp_cpu_online(cpu));
+    if (cpu != smp_cpu_id())
+        apic_send_ipi(apic_ids[cpu], APIC_RESCHEDULE_VECTOR);
+}
+
+/**
+ * @brief Run a function on a set of online CPUs other than the current one,
+ * in interrupt context, and wait until they all ran it. A CPU waiting to
+ * send its own request runs the pending request meanwhile, so two CPUs can
+ * send requests at the same time, even with interrupts disabled.
+ * 
+ * @param cpus The mask of the target CPUs, bit n for the CPU n. Offline
+ * CPUs and the current CPU are ignored.
+ * @param func The function to run, must not sleep
+ * @param data The data given to the function
+ */
+void smp_call_cpus(const uint32_t cpus, const smp_call_t func, void *data)
+{
+    if (smp_cpu_count() == 1 || cpus == 0)
+        return;
+    while (!spin_trylock(&call_lock)) {
+        irq_acquire() {
+            smp_call_poll();
+        }
+        cpu_relax();
+    }
+
+    // The lock disables preemption: the thread stays on the CPU
+    const uint32_t targets = cpus & online & ~(1u << smp_cpu_id());
+    if (targets == 0) {
+        spin_unlock(&call_lock);
+        return;
+    }
+    call_func = func;
+    call_data = data;
+    __sync_synchronize();
+    call_pending = targets;
+    for (uint_t cpu = 0; cpu < nr_cpus; cpu++)
+        if (targets & (1u << cpu))
+            apic_send_ipi(apic_ids[cpu], APIC_CALL_VECTOR);
+    while (call_pending != 0)
+        cpu_relax();
+    spin_unlock(&call_lock);
+}
+
+/**
+ * @brief Run a function on all the other online CPUs, see smp_call_cpus().
+ * 
+ * @param func The function to run, must not sleep
+ * @param data The data given to the function
+ */
+void smp_call_others(const smp_call_t func, void *data)
+{
+    smp_call_cpus(SMP_ALL_CPUS, func, data);
+}
+
+typedef struct smp_flush_range {
+    vaddr_t start;
+    vaddr_t end;
+} smp_flush_range_t;
+
+static void smp_flush_range(void *data)
+{
+    const struct smp_flush_range *range = data;
+    const uint_t count = (range->end - range->start) >> PAGE_SHIFT;
+    if (count > PAGING_BATCH_INVLPG_MAX) {
+        flush_tlb_global();
+        return;
+    }
+    for (vaddr_t addr = range->start; addr < range->end; addr += PAGE_SIZE)
+        invlpg(addr);
+}
+
+static void smp_flush_all(void *data)
+{
+    flush_tlb_global();
+}
+
+/**
+ * @brief Invalidate a range of addresses in the TLB of the other CPUs
+ * (TLB shootdown). The caller invalidates its own TLB. A large range is
+ * invalidated with a full flush, like in paging_batch_commit().
+ * 
+ * @param start The first address of the range
+ * @param end The end of the range, excluded
+ */
+void smp_flush_tlb(const vaddr_t start, const vaddr_t end)
+{
+    smp_flush_tlb_cpus(SMP_ALL_CPUS, start, end);
+}
+
+/**
+ * @brief Same as smp_flush_tlb(), but only on a set of CPUs.
+ * 
+ * @param cpus The mask of the target CPUs, see smp_call_cpus()
+ * @param start The first address of the range
+ * @param end The end of the range, excluded
+ */
+void smp_flush_tlb_cpus(
+    const uint32_t cpus,
+    const vaddr_t start,
+    const vaddr_t end)
+{
+    struct smp_flush_range range = {
+        .start = PAGE_ALIGN(start),
+        .end = end,
+    };
+    smp_call_cpus(cpus, smp_flush_range, &range);
+}
+
+/**
+ * @brief Flush the whole TLB of the other CPUs, including global entries.
+ */
+void smp_flush_tlb_all(void)
+{
+    smp_call_others(smp_flush_all, NULL);
+}
@@ -19,25 +19,39 @@
 #include <lib/memory.h>
 #include <arch/x86/gdt.h>
 #include <arch/x86/tss.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/percpu.h>
 
-static struct tss tss;
+static DEFINE_PER_CPU(struct tss, tss);
 
+/**
+ * @brief Install the TSS of a CPU in its GDT and load it.
+ * 
+ * @param cpu The index of the CPU
+ */
 _init
-void tss_install(void)
+void tss_install(const uint_t cpu)
 {
-    memzero(&tss, sizeof(tss));
-    gdt_install_desc(TSS_GDT_ENTRY, (uint32_t) &tss, sizeof(tss_t),
+    assert(cpu < SMP_MAX_CPUS);
+    tss_t *const t = per_cpu_ptr(tss, cpu);
+    memzero(t, sizeof(tss_t));
+    gdt_install_desc(cpu, TSS_GDT_ENTRY, (uint32_t) t,
+        sizeof(tss_t),
         GDT_SEGMENT_PRESENT | GDT_ACCESSED | GDT_IS_CODE_SEGMENT,
         GDT_SEGMENT_32BITS,
         true);
 
-    tss.ss0 = GDT_KDATA_SELECTOR;
-    tss.iomap = sizeof(tss);
+    t->ss0 = GDT_KDATA_SELECTOR;
+    t->iomap = sizeof(tss_t);
     
     asm volatile("ltr ax" :: "a"(TSS_GDT_SELECTOR) : "memory");
 }
 
+/**
+ * @brief Get the TSS of the current CPU. Must be called with preemption
+ * disabled, so that the thread stays on the CPU.
+ */
 tss_t *tss_get_current(void)
 {
-    return &tss;
+    return this_cpu_ptr(tss);
 }
@@ -0,0 +1,174 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/maths.h>
+#include <arch/x86/uaccess.h>
+
+/**
+ * @brief The functions in this file access user memory without checking that
+ * it is mapped first. Each instruction that may fault on an user address is
+ * recorded with a fixup address in the exception table (the .ex_table
+ * section): when such an instruction faults and the page fault handler
+ * cannot resolve the fault, the execution resumes at the fixup code, which
+ * makes the function return -EFAULT.
+ * 
+ * The page fault handler may need to lock the memory context of the current
+ * process, so these functions must not be called with this lock held.
+ */
+
+extern const exception_entry_t _ex_table_start[];
+extern const exception_entry_t _ex_table_end[];
+
+// Record the instruction at label insn in the exception table, with the
+// fixup code at label fixup
+#define EX_TABLE(insn, fixup)                   \
+    "   .pushsection .ex_table, \"a\"   \n"     \
+    "   .balign 4                       \n"     \
+    "   .long " #insn ", " #fixup "     \n"     \
+    "   .popsection                     \n"
+
+/**
+ * @brief Copy memory with rep movsd followed by rep movsb, as in
+ * _aligned_memcpy(). Both copies may fault.
+ * 
+ * @return int 0 on success, or
+ *  -EFAULT if the copy faulted
+ */
+static int uaccess_copy(void *dst, const void *src, const size_t len)
+{
+    int d0, d1, d2;
+    int ret = 0;
+    asm volatile("   cld                     \n"
+                 "1: rep movsd               \n"
+                 "   mov ecx, %7             \n"
+                 "2: rep movsb               \n"
+                 "3:                         \n"
+                 "   .pushsection .fixup, \"ax\" \n"
+                 "4: mov %3, %8              \n"
+                 "   jmp 3b                  \n"
+                 "   .popsection             \n"
+                 EX_TABLE(1b, 4b)
+                 EX_TABLE(2b, 4b)
+                 : "=&D"(d0), "=&S"(d1), "=&c"(d2), "+r"(ret)
+                 : "0"(dst), "1"(src), "2"(len >> 2), "g"(len & 3),
+                   "i"(-EFAULT)
+                 : "memory", "cc");
+    return ret;
+}
+
+/**
+ * @brief Copy a block of memory from the user address space.
+ * 
+ * @param dst The destination, in the kernel address space
+ * @param src The source, in the user address space
+ * @param len The number of bytes to copy
+ * @return int 0 on success, or
+ *  -EFAULT if the source is not a valid user range. The destination may
+ *  have been partially written.
+ */
+_export int copy_from_user(void *dst, const void *src, const size_t len)
+{
+    if (!user_range(src, len))
+        return -EFAULT;
+    return uaccess_copy(dst, src, len);
+}
+
+/**
+ * @brief Copy a block of memory to the user address space.
+ * 
+ * @param dst The destination, in the user address space
+ * @param src The source, in the kernel address space
+ * @param len The number of bytes to copy
+ * @return int 0 on success, or
+ *  -EFAULT if the destination is not a valid user range. The destination
+ *  may have been partially written.
+ */
+_export int copy_to_user(void *dst, const void *src, const size_t len)
+{
+    if (!user_range(dst, len))
+        return -EFAULT;
+    return uaccess_copy(dst, src, len);
+}
+
+/**
+ * @brief Copy a null-terminated string from the user address space. At most
+ * len bytes are copied: if the string is longer, the destination is not
+ * null-terminated.
+ * 
+ * @param dst The destination buffer, in the kernel address space
+ * @param src The string to copy, in the user address space
+ * @param len The size of the destination buffer
+ * @return int The length of the string copied, without the null character,
+ *  len if the string was truncated, or
+ *  -EFAULT if the string is not in a valid user range
+ */
+_export int strncpy_from_user(char *dst, const char *src, const size_t len)
+{
+    // The string may end before the end of the user address space
+    if ((uintptr_t) src >= KERNEL_BASE)
+        return -EFAULT;
+    const size_t max = min(len, KERNEL_BASE - (uintptr_t) src);
+
+    int d0, d1, d2;
+    size_t left;
+    int ret = 0;
+    asm volatile("   cld                     \n"
+                 "   test ecx, ecx           \n"
+                 "   jz 2f                   \n"
+                 "1: lodsb                   \n"
+                 "   stosb                   \n"
+                 "   test al, al             \n"
+                 "   jz 2f                   \n"
+                 "   dec ecx                 \n"
+                 "   jnz 1b                  \n"
+                 "2:                         \n"
+                 "   .pushsection .fixup, \"ax\" \n"
+                 "3: mov %4, %8              \n"
+                 "   jmp 2b                  \n"
+                 "   .popsection             \n"
+                 EX_TABLE(1b, 3b)
+                 : "=&D"(d0), "=&S"(d1), "=&c"(left), "=&a"(d2), "+r"(ret)
+                 : "0"(dst), "1"(src), "2"(max), "i"(-EFAULT)
+                 : "memory", "cc");
+    if (ret < 0)
+        return ret;
+    if (left == 0 && max < len)
+        return -EFAULT;
+    return max - left;
+}
+
+/**
+ * @brief Search the exception table for the instruction that faulted and, if
+ * found, resume the execution at its fixup code.
+ * 
+ * @param cpu The saved state of the CPU
+ * @return true if the fault was fixed up, false if the faulting instruction
+ * is not in the exception table.
+ */
+bool exception_fixup(cpu_state_t *cpu)
+{
+    for (const exception_entry_t *entry = _ex_table_start;
+         entry < _ex_table_end;
+         entry++) {
+        if (entry->insn == cpu->eip) {
+            cpu->eip = entry->fixup;
+            return true;
+        }
+    }
+    return false;
+}
@@ -23,32 +23,46 @@
 #include <mm/vmalloc.h>
 #include <lib/string.h>
 #include <lib/memory.h>
-#include <lib/spinlock.h>
+#include <process/mutex.h>
 
 #define MODULE_INVALID_SYMBOL 0xFFFFFFFF
 
 static DECLARE_LIST(module_list);
-static DECLARE_SPINLOCK(lock);
+// The list is locked while a module is initialized or finalized, which may
+// take long, so it is protected by a mutex
+static DECLARE_MUTEX(lock);
 
 /**
- * @brief Get a module by its name
+ * @brief Get a module by its name. The lock must be held.
  * 
  * @param name Name of the module
  * @return module_t* Module if found, NULL otherwise
  */
-static module_t *module_get(const char *name)
+static module_t *__module_get(const char *name)
 {
-    spin_acquire(&lock) {
-        list_foreach (&module_list, entry) {
-            module_t *module = list_entry(entry, module_t, node);
-            if (strcmp(module->name, name) == 0) {
-                return module;
-            }
+    list_foreach (&module_list, entry) {
+        module_t *module = list_entry(entry, module_t, node);
+        if (strcmp(module->name, name) == 0) {
+            return module;
         }
     }
     return NULL;
 }
 
+/**
+ * @brief Get a module by its name
+ * 
+ * @param name Name of the module
+ * @return module_t* Module if found, NULL otherwise
+ */
+static module_t *module_get(const char *name)
+{
+    mutex_acquire(&lock) {
+        return __module_get(name);
+    }
+    _unreachable();
+}
+
 /**
  * @brief Get a symbol from a symbol table.
  * 
@@ -396,8 +410,12 @@ int module_load(char *data, const size_t length)
         return -EFAULT;
     }
 
+    // The lock is held until the module is in the list, so that the same
+    // module cannot be loaded twice concurrently
     module->name = *(const char **) mod_name;
-    if (module_exist(module->name)) {
+    mutex_lock(&lock);
+    if (__module_get(module->name) != NULL) {
+        mutex_unlock(&lock);
         error("Module %s already loaded", module->name);
         free(module->elf);
         free(module);
@@ -431,9 +449,8 @@ int module_load(char *data, const size_t length)
     if(module->init != NULL)
         module->init();
 
-    spin_acquire(&lock) {
-        list_add(&module_list, &module->node);
-    }
+    list_add(&module_list, &module->node);
+    mutex_unlock(&lock);
     return 0;
 }
 
@@ -448,20 +465,24 @@ int module_load(char *data, const size_t length)
  */
 int module_unload(const char *name)
 {
-    module_t *module = module_get(name);
-    if (module == NULL)
+    mutex_lock(&lock);
+    module_t *module = __module_get(name);
+    if (module == NULL) {
+        mutex_unlock(&lock);
         return -ENOENT;
-    if (module->usage > 1)
+    }
+    if (module->usage > 1) {
+        mutex_unlock(&lock);
         return -EBUSY;
+    }
 
     trace("Unloading lodule %s", module->name);
-    spin_acquire(&lock) {
-        list_remove(&module->node);
-    }
+    list_remove(&module->node);
 
     // TODO: Remove module's symbols from the symbol table
     if(module->finit != NULL)
         module->finit();
+    mutex_unlock(&lock);
     free(module->elf);
     free(module);
     return 0;
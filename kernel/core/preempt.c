@@ -17,9 +17,11 @@
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <core/preempt.h>
+#include <arch/x86/percpu.h>
 
-// TODO: Make this variable per-cpu
-static unsigned int preemt_count = 0;
+// Each access is a single instruction on the counter of the current CPU, so
+// the thread cannot be moved to another CPU in the middle of an access
+static DEFINE_PER_CPU(unsigned int, preempt_count);
 
 /**
  * @brief Enable preemption on the current CPU. This function use
@@ -28,10 +30,10 @@ static unsigned int preemt_count = 0;
  * assume that the preemption is enabled right after the call to this
  * function.
  */
-void preempt_enable(void)
+_export void preempt_enable(void)
 {
-    assert(preemt_count);
-    preemt_count--;
+    assert(percpu_read(preempt_count));
+    percpu_dec(preempt_count);
 }
 
 /**
@@ -40,9 +42,9 @@ void preempt_enable(void)
  * to call this function several times : The preemption remains disabled until
  * the counter is equal to 0.
  */
-void preempt_disable(void)
+_export void preempt_disable(void)
 {
-    preemt_count++;
+    percpu_inc(preempt_count);
 }
 
 /**
@@ -53,5 +55,5 @@ void preempt_disable(void)
  */
 bool preempt_enabled(void)
 {
-    return !preemt_count;
+    return !percpu_read(preempt_count);
 }
@@ -17,12 +17,16 @@
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <kernel.h>
+#include <mm/lru.h>
 #include <mm/page.h>
-#include <mm/malloc.h>
+#include <mm/huge.h>
+#include <mm/vmalloc.h>
 #include <core/date.h>
 #include <core/ustar.h>
 #include <core/module.h>
 #include <arch/x86/cpu.h>
+#include <arch/x86/smp.h>
+#include <process/reaper.h>
 #include <process/process.h>
 
 extern const char _init_start;
@@ -37,12 +41,29 @@ _init void load_module(char *initrd, char *name)
         warn("Failed to load module %s", name);
 }
 
+/**
+ * @brief Load the modules of the initrd. Modules are loaded once the
+ * scheduler and the other CPUs are set up, so that they can create kernel
+ * threads: those threads start running with process_start(), and their
+ * module must not be unloaded.
+ */
 _init void load_modules(char *initrd)
 {
     // TODO: Use a config file to load modules and to configure the kernel 
     load_module(initrd, "test.kmd");
     module_unload("test");
-    free(initrd);
+#ifdef CONFIG_SELFTESTS
+    load_module(initrd, "hugecow.kmd");
+    module_unload("hugecow");
+#endif
+#ifdef CONFIG_BENCHMARKS
+    load_module(initrd, "cswitch.kmd");
+    module_unload("cswitch");
+    load_module(initrd, "rtlat.kmd");
+    load_module(initrd, "lockbench.kmd");
+#endif
+    if (initrd != NULL)
+        vmfreep(initrd);
 }
 
 _init void free_init_sections(void)
@@ -52,8 +73,8 @@ _init void free_init_sections(void)
     // complicate the code of this function. So for a short time the
     // kernel will use pages marked as free. This is why we must take
     // precautions: the other processors must not allocate pages before
-    // this function is completely finished.
-    // On a uniprocessor computer this should not be a problem
+    // this function is completely finished. This is why they only run their
+    // idle thread until process_start() enables the load balancing.
     for (vaddr_t addr = (vaddr_t) &_init_start;
         addr < (vaddr_t) &_init_end;
         addr += PAGE_SIZE) {
@@ -66,8 +87,12 @@ _init void free_init_sections(void)
 _init _noreturn void startup(char *initrd)
 {
     date_setup();
-    load_modules(initrd);
     process_init();
+    smp_setup();
+    reaper_setup();
+    kswapd_setup();
+    mm_huge_setup();
+    load_modules(initrd);
 
     free_init_sections();
     process_start();
@@ -18,34 +18,72 @@
  */
 #include <core/timer.h>
 #include <lib/spinlock.h>
+#include <arch/x86/cpu.h>
 #include <arch/x86/time.h>
 
 static DECLARE_SPINLOCK(lock);
 static DECLARE_LIST(timers);
 
+/**
+ * @brief Lock the list of timers with interrupts disabled: the list is used
+ * by timer_tick() in interrupt context, possibly on another CPU.
+ * 
+ * @return uint32_t The flags to give to timer_unlock()
+ */
+static uint32_t timer_lock(void)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&lock);
+    return eflags;
+}
+
+static void timer_unlock(const uint32_t eflags)
+{
+    spin_unlock(&lock);
+    set_eflags(eflags);
+}
+
 /**
  * @brief This function is called every hardware tick to check if any timer
- * has expired.
+ * has expired. Expired timers are moved to a list of expired timers, and
+ * their callbacks are run one by one after the lock is released, so a
+ * callback can safely add the timer again.
+ * 
+ * The list of expired timers is only modified with the lock held, so that
+ * timer_remove() can remove a timer from it on another CPU. A timer is
+ * marked as running while its callback runs: timer_remove() waits for the
+ * callback to return, so that the timer can be freed once it returns.
  * 
- * This function has some problems: At each call, it will check all the
- * list of timers to check if the timer is expired: The performance of
- * this function could be improved if the list was sorted by expiration
- * time.
- * The second problem is that we look the timer list, potentially for
- * a long time because we doen't now how long the callbacks will take to run.
- * It should be improved too.
+ * At each call, it will check all the list of timers to check if the timer
+ * is expired: The performance of this function could be improved if the list
+ * was sorted by expiration time.
  */
 void timer_tick(void)
 {
-    spin_acquire(&lock) {
-        list_foreach(&timers, entry) {
-            timer_t *timer = container_of(entry, timer_t, node);
-            if (timer_expired(timer)) {
-                timer_remove(timer);
-                timer->callback(timer->data);
-            }
+    DECLARE_LIST(expired);
+    uint32_t eflags = timer_lock();
+    list_foreach_safe(&timers, entry) {
+        timer_t *timer = container_of(entry, timer_t, node);
+        if (timer_expired(timer)) {
+            list_remove(&timer->node);
+            list_add_tail(&expired, &timer->node);
         }
     }
+
+    while (!list_empty(&expired)) {
+        timer_t *timer = container_of(expired.next, timer_t, node);
+        list_remove(&timer->node);
+        timer->active = false;
+        timer->running = true;
+        timer_unlock(eflags);
+
+        timer->callback(timer->data);
+
+        eflags = timer_lock();
+        timer->running = false;
+    }
+    timer_unlock(eflags);
 }
 
 /**
@@ -60,6 +98,7 @@ void timer_init(timer_t *timer)
     assume(!null(timer));
     list_init(&timer->node);
     timer->active = false;
+    timer->running = false;
 }
 
 /**
@@ -74,22 +113,25 @@ void timer_init(timer_t *timer)
 int timer_add(timer_t *timer)
 {
     assume(!null(timer));
-    if (list_empty(&timer->node))
+    if (!list_empty(&timer->node))
         return -EEXIST;
-    if (timer_expired(timer)) {
+    if (timer->expire <= time_startup_ms()) {
         timer->callback(timer->data);
         return -EAGAIN;
     }
 
-    timer->active = 1;
-    spin_acquire(&lock) {
-        list_add(&timers, &timer->node);
-    }
+    const uint32_t eflags = timer_lock();
+    timer->active = true;
+    list_add(&timers, &timer->node);
+    timer_unlock(eflags);
     return 0;
 }
 
 /**
- * @brief Remove a timer from the list of active timers.
+ * @brief Remove a timer from the list of active timers. If its callback is
+ * running on another CPU, wait for it to return, so that the timer can be
+ * freed once this function returns. Must not be called by the callback of
+ * the timer itself.
  * 
  * @param timer The timer to remove.
  * @return int 0 if the timer was removed or
@@ -98,14 +140,20 @@ int timer_add(timer_t *timer)
 int timer_remove(timer_t *timer)
 {
     assume(!null(timer));
-    if (list_empty(&timer->node))
-        return -ENOENT;
-
-    spin_acquire(&lock) {
-        list_add(&timers, &timer->node);
+    int ret = -ENOENT;
+    uint32_t eflags = timer_lock();
+    if (!list_empty(&timer->node)) {
+        list_remove(&timer->node);
+        timer->active = false;
+        ret = 0;
     }
-    timer->active = 0;
-    return 0;
+    while (timer->running) {
+        timer_unlock(eflags);
+        __builtin_ia32_pause();
+        eflags = timer_lock();
+    }
+    timer_unlock(eflags);
+    return ret;
 }
 
 /**
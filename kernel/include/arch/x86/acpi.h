@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+#define ACPI_RSDP_SIGNATURE     "RSD PTR "
+#define ACPI_MADT_SIGNATURE     "APIC"
+
+// The RSDP is in the first KiB of the EBDA, or in the BIOS area
+#define ACPI_EBDA_POINTER       0x40E
+#define ACPI_BIOS_START         0xE0000
+#define ACPI_BIOS_END           0x100000
+#define ACPI_RSDP_ALIGN         16
+
+// Entries of the MADT
+#define ACPI_MADT_LAPIC         0
+#define ACPI_MADT_LAPIC_ENABLED 0x01
+#define ACPI_MADT_LAPIC_CAPABLE 0x02    // Can be enabled
+
+typedef struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} _packed acpi_rsdp_t;
+
+typedef struct acpi_header {
+    char signature[4];
+    uint32_t length;            // Including the header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} _packed acpi_header_t;
+
+typedef struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic;             // Physical address of the local APICs
+    uint32_t flags;
+    uint8_t entries[];
+} _packed acpi_madt_t;
+
+typedef struct acpi_madt_entry {
+    uint8_t type;
+    uint8_t length;
+} _packed acpi_madt_entry_t;
+
+typedef struct acpi_madt_lapic {
+    struct acpi_madt_entry header;
+    uint8_t processor;
+    uint8_t apic_id;
+    uint32_t flags;
+} _packed acpi_madt_lapic_t;
+
+_init struct acpi_header *acpi_find_table(const char *signature);
@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/paging.h>
+
+// Registers of the local APIC, as offsets from its base address
+#define APIC_REG_ID             0x020
+#define APIC_REG_VERSION        0x030
+#define APIC_REG_TPR            0x080   // Task priority
+#define APIC_REG_EOI            0x0B0
+#define APIC_REG_SVR            0x0F0   // Spurious interrupt vector
+#define APIC_REG_ESR            0x280   // Error status
+#define APIC_REG_ICR_LOW        0x300   // Interrupt command
+#define APIC_REG_ICR_HIGH       0x310
+#define APIC_REG_LVT_TIMER      0x320
+#define APIC_REG_TIMER_INIT     0x380
+#define APIC_REG_TIMER_COUNT    0x390
+#define APIC_REG_TIMER_DIVIDE   0x3E0
+
+#define APIC_SVR_ENABLE         0x100
+#define APIC_LVT_MASKED         0x10000
+#define APIC_TIMER_PERIODIC     0x20000
+#define APIC_TIMER_DIVIDE_16    0x03
+
+// Interrupt command register
+#define APIC_ICR_FIXED          0x000
+#define APIC_ICR_INIT           0x500
+#define APIC_ICR_STARTUP        0x600
+#define APIC_ICR_PENDING        0x1000
+#define APIC_ICR_ASSERT         0x4000
+#define APIC_ICR_LEVEL          0x8000
+
+// Interrupt vectors handled by the local APIC, above the PIC vectors
+#define APIC_TIMER_VECTOR       0x40
+#define APIC_RESCHEDULE_VECTOR  0x41
+#define APIC_CALL_VECTOR        0x42
+#define APIC_SPURIOUS_VECTOR    0xFF
+#define APIC_VECTOR_BASE        APIC_TIMER_VECTOR
+#define APIC_VECTORS            3       // Vectors with a handler
+
+typedef void (*apic_handler_t)(cpu_state_t *);
+
+_init void apic_setup(const paddr_t base);
+_init void apic_enable(void);
+_init void apic_timer_calibrate(void);
+_init void apic_timer_start(void);
+_init void apic_send_init(const uint_t apic_id);
+_init void apic_send_startup(const uint_t apic_id, const paddr_t entry);
+
+int apic_request(const uint_t vector, const apic_handler_t handler);
+void apic_send_ipi(const uint_t apic_id, const uint_t vector);
+uint_t apic_id(void);
+void apic_eoi(void);
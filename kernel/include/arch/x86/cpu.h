@@ -41,9 +41,17 @@
 #define disable_interruption() cli()
 
 #define CPUID_GET_FEATURE 1
+#define CPUID_GET_XSTATE 0x0D
 #define CPUID_GET_CAPABILITIES 0x80000007
 
 #define CPUID_EDX_FEATURE_FPU 0x00000001
+
+#define CPUID_ECX_FEATURE_XSAVE 0x04000000
+#define CPUID_ECX_FEATURE_OSXSAVE 0x08000000
+#define CPUID_ECX_FEATURE_AVX 0x10000000
+
+#define CPUID_XSTATE_XSAVEOPT 0x00000001
+#define CPUID_XSTATE_XSAVEC 0x00000002
 #define CPUID_EDX_FEATURE_VME 0x00000002
 #define CPUID_EDX_FEATURE_DE 0x00000004
 #define CPUID_EDX_FEATURE_PSE 0x00000008
@@ -158,6 +166,30 @@ static inline void set_task_switched(void)
                      : "eax");
 }
 
+static inline uint32_t get_cr0(void)
+{
+    uint32_t cr0;
+    asm volatile("mov %0, cr0"
+                 : "=r"(cr0));
+    return cr0;
+}
+
+static inline uint32_t get_cr4(void)
+{
+    uint32_t cr4;
+    asm volatile("mov %0, cr4"
+                 : "=r"(cr4));
+    return cr4;
+}
+
+static inline void set_cr4(const uint32_t cr4)
+{
+    asm volatile("mov cr4, %0"
+                 :
+                 : "r"(cr4)
+                 : "memory");
+}
+
 static inline void cpuid_count(const uint32_t code, const uint32_t count,
                                uint32_t *const eax, uint32_t *const ebx,
                                uint32_t *const ecx, uint32_t *const edx)
@@ -262,5 +294,8 @@ static inline void set_gs(const uint32_t gs)
                  : "r"(gs));
 }
 
-_asmlinkage void switch_to(cpu_state_t *state);
-_asmlinkage void save_switch_to(cpu_state_t **location, cpu_state_t *state);
\ No newline at end of file
+_asmlinkage void switch_to(cpu_state_t *state, volatile int *done);
+_asmlinkage void save_switch_to(
+    cpu_state_t **location,
+    cpu_state_t *state,
+    volatile int *done);
\ No newline at end of file
@@ -42,4 +42,11 @@
 #define EXCEPTION_MACHINE_CHECK 18
 #define EXCEPTION_SIMD_ERROR 19
 
+// Page fault error code
+#define PAGE_FAULT_PRESENT 0x01
+#define PAGE_FAULT_WRITE 0x02
+#define PAGE_FAULT_USER 0x04
+#define PAGE_FAULT_RESERVED 0x08
+#define PAGE_FAULT_FETCH 0x10
+
 void exception_install(void);
\ No newline at end of file
@@ -19,12 +19,59 @@
 #pragma once
 #include <kernel.h>
 
+// A thread that used the FPU during more consecutive time slices has its
+// FPU state restored when it is scheduled, instead of trapping on its first
+// FPU instruction
+#define FPU_EAGER_THRESHOLD 5
+
+#define FPU_MXCSR_DEFAULT   0x1F80  // All SSE exceptions masked
+
+// Instruction used to save the FPU state, the best supported one is chosen
+#define FPU_MODE_FXSAVE     0
+#define FPU_MODE_XSAVE      1
+#define FPU_MODE_XSAVEC     2   // Compacted format, skips components in
+                                // their initial state
+#define FPU_MODE_XSAVEOPT   3   // Also skips components not modified since
+                                // the last restore
+
+// State components enabled in XCR0
+#define XSTATE_X87          0x01
+#define XSTATE_SSE          0x02
+#define XSTATE_AVX          0x04
+
+#define FPU_LEGACY_SIZE     512
+#define FPU_XSAVE_ALIGN     64
+#define FPU_XSAVE_MIN_SIZE  576     // Legacy area and XSAVE header
+
+struct thread;
+
+/**
+ * @brief FPU state of a thread. Only the legacy area is used with FXSAVE.
+ * With XSAVE, the extended area is sized at boot from CPUID depending on
+ * the state components enabled, so this structure must be allocated with
+ * fpu_alloc_state().
+ */
 typedef struct fpu_state {
-    char data[512];
-} fpu_state_t;
+    char legacy[FPU_LEGACY_SIZE];
+    uint64_t xstate_bv;         // Components saved in the area
+    uint64_t xcomp_bv;          // Compacted format, set by XSAVEC
+    uint64_t reserved[6];
+    char extended[];
+} _align(FPU_XSAVE_ALIGN) fpu_state_t;
 
 _init void fpu_setup(void);
+_init void fpu_state_setup(void);
+
+/* FPU state areas */
+size_t fpu_state_size(void);
+fpu_state_t *fpu_alloc_state(void);
+void fpu_free_state(fpu_state_t *state);
 
 void fpu_init(void);
 void fpu_save(fpu_state_t *state);
-void fpu_restore(fpu_state_t *state);
\ No newline at end of file
+void fpu_restore(fpu_state_t *state);
+
+/* Lazy FPU switching */
+void fpu_trap(void);
+void fpu_flush(const struct thread *thread);
+void fpu_switch(struct thread *prev, struct thread *next);
\ No newline at end of file
@@ -19,7 +19,7 @@
 #pragma once
 #include <kernel.h>
 
-#define GDT_MAX_ENTRY 10
+#define GDT_MAX_ENTRY 8
 
 #define GDT_KCODE_SELECTOR 0x08
 #define GDT_KDATA_SELECTOR 0x10
@@ -29,6 +29,11 @@
 #define GDT_UDATA_SELECTOR 0x18
 #define GDT_USTACK_SELECTOR 0x18
 
+// Per-CPU data of the CPU, see percpu.h. Each CPU has its own GDT, so the
+// selector is the same on all CPUs
+#define GDT_PERCPU_ENTRY 5
+#define GDT_PERCPU_SELECTOR 0x28
+
 #define GDT_UCODE_SELECTOR_R3 (GDT_UCODE_SELECTOR + 3)
 #define GDT_UDATA_SELECTOR_R3 (GDT_UDATA_SELECTOR + 3)
 #define GDT_USTACK_SELECTOR_R3 (GDT_USTACK_SELECTOR + 3)
@@ -65,8 +70,9 @@ typedef struct gdt_entry
     uint8_t base24_31;
 } _packed gdt_entry_t;
 
-_init void gdt_install(void);
+_init void gdt_install(const uint_t cpu);
 void gdt_install_desc(
+    const uint_t cpu,
     const uint32_t index,
     const uint32_t base,
     const uint32_t limit,
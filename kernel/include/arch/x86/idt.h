@@ -54,6 +54,7 @@ typedef struct idt_register {
 } _packed idt_register_t;
 
 _init void idt_install(void);
+_init void idt_flush(void);
 void idt_install_handler(
     const uint32_t offset,
     const uint32_t handler,
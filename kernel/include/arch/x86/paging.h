@@ -18,25 +18,33 @@
  */
 #pragma once
 #include <kernel.h>
+#include <arch/x86/cpu.h>
 #include <arch/x86/memory.h>
 
 #define KERNEL_BASE_PAGE        (KERNEL_BASE >> PAGE_SHIFT)
 #define KERNEL_BASE_PAGE_INDEX  (KERNEL_BASE_PAGE >> 10)
 
-// Mirroring
-#define PAGING_MIRRORING_INDEX      1023
-#define PAGING_MIRRORING_BASE       0xFFC00000
-#define PAGING_MIRRORING_PD_MASK    0xFFC00000
-#define PAGING_MIRRORING_PT_MASK    0X003FF000
-
-#define mirroring(addr) (((uintptr_t)(addr) > PAGING_MIRRORING_BASE))
-#define pd_set_mirroring(pd) ({             \
-    pde_set_address(                        \
-        &pd[PAGING_MIRRORING_INDEX],        \
-        paging_get_paddr((vaddr_t) pd));    \
-    pd[PAGING_MIRRORING_INDEX].present = 1; \
-    pd[PAGING_MIRRORING_INDEX].write = 1;   \
-})
+#define PAGING_LARGE_SIZE   0x400000
+#define PAGING_LARGE_MASK   ~(PAGING_LARGE_SIZE - 1)
+
+// Direct map of the low physical memory, mapped with large pages
+#define DIRECT_MAP_BASE     KERNEL_BASE
+#define DIRECT_MAP_SIZE     0x10000000          // Up to VMALLOC_START
+#define DIRECT_MAP_END      (DIRECT_MAP_BASE + DIRECT_MAP_SIZE)
+
+// Temporary mappings of high physical memory (above the direct map)
+#define KMAP_INDEX          1023
+#define KMAP_BASE           0xFFC00000
+#define KMAP_PAGES          1024
+#define KMAP_ATOMIC_SLOTS   16      // Per-CPU slots, at the end of the window
+
+#define phys_to_virt(paddr) ((vaddr_t) (paddr) + DIRECT_MAP_BASE)
+#define virt_to_phys(vaddr) ((paddr_t) (vaddr) - DIRECT_MAP_BASE)
+#define highmem(paddr)      ((paddr_t) (paddr) >= DIRECT_MAP_SIZE)
+#define direct_mapped(addr)                        \
+    ((uintptr_t) (addr) >= DIRECT_MAP_BASE &&      \
+     (uintptr_t) (addr) < DIRECT_MAP_END)
+#define kmapped(addr)       ((uintptr_t) (addr) >= KMAP_BASE)
 
 #define PAGING_NONE     0x00
 
@@ -49,6 +57,15 @@
 // Mapping flags
 #define PAGING_PRESENT  0x01
 #define PAGING_GLOBAL   0x02
+#define PAGING_NOCACHE  0x04    // Memory mapped registers
+
+// Paging batches
+#define PAGING_BATCH_MAX_PAGES  32  // Pages released per commit
+#define PAGING_BATCH_INVLPG_MAX 32  // Above this, the whole TLB is flushed
+#define PAGING_BATCH_TABLE      0x1 // Tag of released page tables
+
+// Page tables and page directories kept for reuse
+#define PAGING_QUICKLIST_MAX    16
 
 #define pd_offset(vaddr) (((vaddr) & 0xFFC00000) >> 22)
 #define pt_offset(vaddr) (((vaddr) & 0x003FF000) >> 12)
@@ -69,6 +86,15 @@
 #define pte_copy(dst, src)          ((dst)->value = (src)->value)
 #define pte_clear(pte)              ((pte)->value = 0)
 
+// Swap entries are user page table entries that are not present and hold
+// the index of a swapped page. They count as used entries of the page table
+#define PTE_SWAP                    0x1     // Tag in the available bits
+#define pte_is_swap(pte)            \
+    (!(pte)->present && (pte)->available & PTE_SWAP)
+#define pte_get_swap(pte)           ((pte)->value >> 12)
+#define pte_set_swap(pte, index)    \
+    ((pte)->value = (index) << 12 | PTE_SWAP << 9)
+
 typedef uint32_t vaddr_t;
 typedef uint32_t paddr_t;
 
@@ -83,7 +109,8 @@ typedef struct pde {
             int accessed : 1;
             int reserved : 1;
             int large : 1;
-            int available : 4;
+            int global : 1;     // Only for large pages
+            int available : 3;
             int address : 20;
         } _packed;
         uint32_t value;
@@ -109,6 +136,14 @@ typedef struct pte {
     };
 } _packed pte_t;
 
+typedef struct paging_batch {
+    vaddr_t start;              // Start of the range to invalidate
+    vaddr_t end;                // End of the range, 0 if empty
+    bool global;                // The range contains kernel pages
+    uint_t nr_pages;
+    paddr_t pages[PAGING_BATCH_MAX_PAGES];
+} paging_batch_t;
+
 #define set_cr3(cr3)    asm volatile("mov cr3, %0" :: "r"(cr3) : "memory")
 #define invlpg(vaddr)   asm volatile("invlpg [%0]" :: "r"(vaddr) : "memory")
 
@@ -116,23 +151,62 @@ typedef struct pte {
     asm volatile("mov eax, cr3 \n"    \
                  "mov cr3, eax \n" :: \
                      : "eax", "memory")
+/**
+ * @brief Flush the whole TLB, including global entries. Reloading CR3 does
+ * not invalidate global pages, so the CR4.PGE bit is toggled instead when
+ * global pages are enabled.
+ */
+static inline void flush_tlb_global(void)
+{
+    const uint32_t cr4 = get_cr4();
+    if (cr4 & CR4_PGE) {
+        set_cr4(cr4 & ~CR4_PGE);
+        set_cr4(cr4);
+    } else {
+        flush_tlb();
+    }
+}
+
+#define get_cr3() ({           \
+    paddr_t __x;               \
+    asm volatile("mov %0, cr3" \
+                 : "=r"(__x)); \
+    __x;                       \
+})
+
 #define get_cr2() ({           \
     vaddr_t __x;               \
     asm volatile("mov %0, cr2" \
                  : "=r"(__x)); \
-    __x                        \
+    __x;                       \
 })
 
 _init void paging_remap_kernel(void);
 _init void paging_clear_userspace(void);
 
+_export pde_t *paging_get_pde(const vaddr_t addr);
+pte_t *paging_get_pte(const vaddr_t addr);
 paddr_t paging_get_paddr(const vaddr_t vaddr);
 void paging_clone_pd(const vaddr_t src, const vaddr_t dst);
-void paging_creat_pd(const vaddr_t dst);
+int paging_unshare_pt(const vaddr_t vaddr);
+_export vaddr_t paging_alloc_pd(void);
+_export void paging_release_pd(const vaddr_t pd, const uint_t generation);
+_export void paging_release_pt(const paddr_t pt, const bool zeroed);
 void paging_set_pd(const vaddr_t pd);
-void paging_destroy_userspace(void);
+void paging_destroy_userspace(const vaddr_t pd);
 void paging_use_kernel_pd(void);
 
+/* Temporary mappings */
+_export vaddr_t kmap(const paddr_t paddr);
+_export void kunmap(const vaddr_t vaddr);
+_export vaddr_t kmap_atomic(const paddr_t paddr);
+_export void kunmap_atomic(const vaddr_t vaddr);
+
+/* Kernel page directory synchronization */
+_export bool paging_sync_kernel_pde(const vaddr_t addr);
+_export void paging_sync_kernel_pd(const vaddr_t pd);
+_export uint_t paging_kernel_generation(void);
+
 /* Paging interface */
 _export int paging_set_rights(const vaddr_t vaddr, const int access);
 _export int paging_set_flags(const vaddr_t vaddr, const int flags);
@@ -144,3 +218,35 @@ _export int paging_map_page(
     const paddr_t paddr,
     const int access,
     const int flags);
+_export paddr_t paging_remap_page(
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags);
+
+/* Large pages */
+_export paddr_t paging_unmap_large(const vaddr_t vaddr);
+_export int paging_split_large(const vaddr_t vaddr);
+_export int paging_map_large(
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags);
+
+/* Batched interface */
+_export void paging_batch_init(paging_batch_t *batch);
+_export void paging_batch_commit(paging_batch_t *batch);
+_export paddr_t paging_batch_unmap(
+    paging_batch_t *batch,
+    const vaddr_t vaddr,
+    const bool release);
+_export int paging_batch_set_rights(
+    paging_batch_t *batch,
+    const vaddr_t vaddr,
+    const int access);
+_export int paging_batch_map(
+    paging_batch_t *batch,
+    const vaddr_t vaddr,
+    const paddr_t paddr,
+    const int access,
+    const int flags);
@@ -0,0 +1,82 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <assert.h>
+#include <arch/x86/memory.h>
+
+/**
+ * Per-CPU variables are defined in the .data.percpu section, which is only
+ * a template: at boot, it is copied once for each CPU (see percpu_setup())
+ * and the variables are never accessed at their link address. The base of
+ * the GS segment of each CPU is the offset between its copy and the
+ * template, so the copy of a variable for the current CPU is reached with
+ * a single GS-relative access at the link address of the variable.
+ */
+#define PERCPU_AREA_SIZE    PAGE_SIZE   // Checked in link.ld
+
+#define DEFINE_PER_CPU(type, name) \
+    __typeof__(type) name _section(".data.percpu")
+#define DECLARE_PER_CPU(type, name) \
+    extern __typeof__(type) name
+
+// Only 32 bits variables can be read or written with a single instruction
+#define __percpu_check(var) \
+    static_assert(sizeof(var) == 4, "per-CPU variable must be 32 bits")
+
+/**
+ * Accessors of the variables of the current CPU. Each access is a single
+ * instruction, so it cannot be split by an interrupt: no lock is needed,
+ * but the thread may be moved to another CPU between two accesses unless
+ * preemption or interrupts are disabled.
+ */
+#define percpu_read(var) ({                                 \
+    __percpu_check(var);                                    \
+    __typeof__(var) __v;                                    \
+    asm volatile("mov %0, gs:%1" : "=r"(__v) : "m"(var));   \
+    __v;                                                    \
+})
+
+#define percpu_write(var, value) ({                         \
+    __percpu_check(var);                                    \
+    const __typeof__(var) __v = (value);                    \
+    asm volatile("mov gs:%0, %1" : "=m"(var) : "ri"(__v));  \
+})
+
+#define percpu_inc(var) ({                                  \
+    __percpu_check(var);                                    \
+    asm volatile("add gs:%0, 1" : "+m"(var));               \
+})
+
+#define percpu_dec(var) ({                                  \
+    __percpu_check(var);                                    \
+    asm volatile("sub gs:%0, 1" : "+m"(var));               \
+})
+
+// Pointers to the copy of a variable, for the current CPU or a given CPU
+#define this_cpu_ptr(var) \
+    ((__typeof__(var) *) ((uintptr_t) &(var) + percpu_read(this_cpu_off)))
+#define per_cpu_ptr(var, cpu) \
+    ((__typeof__(var) *) ((uintptr_t) &(var) + percpu_offsets[cpu]))
+
+extern uintptr_t percpu_offsets[];
+DECLARE_PER_CPU(uintptr_t, this_cpu_off);
+DECLARE_PER_CPU(uint_t, cpu_number);
+
+_init void percpu_setup(void);
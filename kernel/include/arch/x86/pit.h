@@ -53,3 +53,4 @@
 _init void pit_configure(void);
 time_t pit_startup_tick(void);
 time_t pit_nano_offset(void);
+void pit_udelay(const uint_t us);
@@ -0,0 +1,65 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/percpu.h>
+
+#ifdef CONFIG_SMP
+#define SMP_MAX_CPUS        8
+#else
+#define SMP_MAX_CPUS        1
+#endif
+
+#define SMP_ALL_CPUS        0xFFFFFFFF  // Mask of all CPUs
+
+// Delays of the startup sequence of the application processors, in us
+#define SMP_INIT_DELAY      10000
+#define SMP_STARTUP_DELAY   200
+#define SMP_ONLINE_TIMEOUT  100000
+
+typedef void (*smp_call_t)(void *data);
+
+/**
+ * @brief Get the index of the current CPU, from 0 (the bootstrap processor)
+ * to SMP_MAX_CPUS - 1, stored in the per-CPU data of the CPU. A thread can
+ * be moved to another CPU when it is preempted: the index is only stable
+ * while preemption or interrupts are disabled.
+ * 
+ * @return uint_t The index of the current CPU
+ */
+static inline uint_t smp_cpu_id(void)
+{
+    return percpu_read(cpu_number);
+}
+
+_init void smp_setup(void);
+
+_export uint_t smp_cpu_count(void);
+bool smp_cpu_online(const uint_t cpu);
+void smp_send_reschedule(const uint_t cpu);
+void smp_call_cpus(const uint32_t cpus, const smp_call_t func, void *data);
+void smp_call_others(const smp_call_t func, void *data);
+void smp_flush_tlb(const vaddr_t start, const vaddr_t end);
+void smp_flush_tlb_cpus(
+    const uint32_t cpus,
+    const vaddr_t start,
+    const vaddr_t end);
+void smp_flush_tlb_all(void);
@@ -19,8 +19,9 @@
 #pragma once
 #include <kernel.h>
 
-#define TSS_GDT_ENTRY       5
-#define TSS_GDT_SELECTOR    (TSS_GDT_ENTRY * 8)
+// Each CPU loads its own GDT, with its own TSS at the same index
+#define TSS_GDT_ENTRY               6
+#define TSS_GDT_SELECTOR            0x30
 
 typedef struct tss {
     uint16_t __link, link;
@@ -53,5 +54,5 @@ typedef struct tss {
     uint32_t debug, iomap;
 } tss_t;
 
-_init void tss_install(void);
+_init void tss_install(const uint_t cpu);
 tss_t *tss_get_current(void);
\ No newline at end of file
@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/memory.h>
+
+/**
+ * @brief Check that a range lies entirely in the user address space. This
+ * does not check that the range is mapped: faults are handled when the
+ * memory is accessed, see exception_fixup().
+ */
+#define user_range(addr, len)                                       \
+    ((uintptr_t) (addr) <= KERNEL_BASE &&                           \
+     (size_t) (len) <= KERNEL_BASE - (uintptr_t) (addr))
+
+// An entry of the exception table: if the instruction at address insn
+// faults, the execution resumes at the address fixup
+typedef struct exception_entry {
+    uintptr_t insn;
+    uintptr_t fixup;
+} exception_entry_t;
+
+bool exception_fixup(cpu_state_t *cpu);
+
+_export int copy_from_user(void *dst, const void *src, const size_t len);
+_export int copy_to_user(void *dst, const void *src, const size_t len);
+_export int strncpy_from_user(char *dst, const char *src, const size_t len);
@@ -41,7 +41,10 @@
 #include <core/symbol.h>
 #include <core/ustar.h>
 
+#include <mm/area.h>
 #include <mm/context.h>
+#include <mm/fault.h>
+#include <mm/huge.h>
 #include <mm/malloc.h>
 #include <mm/page.h>
 #include <mm/paging.h>
@@ -23,9 +23,13 @@
 // Disable some checks in kernel: assume kernel & modules are bug-free
 // TODO: Make sure the kernel can handle this flags without breaking
 //#define CONFIG_DISABLE_CHECKS
-//#define CONFIG_SMP                  // Enable SMP (unsupported now)
+#define CONFIG_SMP                  // Enable SMP
+//#define CONFIG_SPINLOCK_TICKET    // Ticket instead of queued spinlocks
+//#define CONFIG_SCHED_ROBIN          // Round robin instead of fair scheduling
 
 #define CONFIG_EXTRA_CHECKS         // Enable extra checks to improve security
 #define CONFIG_VSNPRINTF_64BITS     // Enable parsing 64 bits numbers
 #define CONFIG_LOG                  // Enable logging (bochs only)
 #define CONFIG_DEBUG_PANIC          // Enable panic with debug information
+#define CONFIG_SELFTESTS            // Run the self-test modules at boot
+//#define CONFIG_BENCHMARKS         // Run the benchmark modules at boot
@@ -19,6 +19,6 @@
 #pragma once
 #include <kernel.h>
 
-void preempt_enable(void);
-void preempt_disable(void); 
+_export void preempt_enable(void);
+_export void preempt_disable(void);
 bool preempt_enabled(void);
@@ -26,6 +26,7 @@ typedef struct timer {
     timer_callback_t callback;
     time_t expire;
     bool active;
+    bool running;               // The callback is being run by timer_tick()
     void *data;
     struct list_head node;
 } timer_t;
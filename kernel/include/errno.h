@@ -55,3 +55,5 @@
 
 #define ENOSYS      38
 #define ENOTEMPTY   39
+
+#define ETIMEDOUT   110
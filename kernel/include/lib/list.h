@@ -37,6 +37,11 @@ typedef struct list_head {
 		 (entry) != (list);                      \
 		 (entry) = (entry)->next)
 
+#define list_foreach_reverse(list, entry)        \
+	for (struct list_head *entry = (list)->prev; \
+		 (entry) != (list);                      \
+		 (entry) = (entry)->prev)
+
 #define list_foreach_d(list, entry) \
 	for ((entry) = (list)->next;    \
 		 (entry) != (list);         \
@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+#define DECLARE_RB_ROOT(name) struct rb_root name = { NULL }
+
+#define rb_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - (uint32_t)(&((type *)0)->member)))
+
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+} rb_node_t;
+
+typedef struct rb_root {
+    struct rb_node *node;
+} rb_root_t;
+
+void rb_link_node(
+    struct rb_node *node,
+    struct rb_node *parent,
+    struct rb_node **link);
+void rb_insert_color(struct rb_root *root, struct rb_node *node);
+void rb_erase(struct rb_root *root, struct rb_node *node);
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
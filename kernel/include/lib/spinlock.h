@@ -19,8 +19,9 @@
 #pragma once
 #include <kernel.h>
 
+#define SPINLOCK_INIT { .lock = 0 }
 #define DECLARE_SPINLOCK(name) \
-    spinlock_t name = {0}
+    spinlock_t name = SPINLOCK_INIT
 
 #define __spin_lock(spin) ({ \
     spin_lock(spin);         \
@@ -34,13 +35,38 @@
          __i == (spin);                                                     \
          __i++)
 
+// Queued spinlocks: the lock word holds the locked byte and the tail of
+// the queue of waiters, see lib/spinlock.c
+#define SPINLOCK_LOCKED         0x01
+#define SPINLOCK_LOCKED_MASK    0xFF
+#define SPINLOCK_TAIL_SHIFT     16
+#define SPINLOCK_NODES          4   // Nesting levels of waiters on a CPU
+
+/**
+ * @brief A spinlock. Without SMP, it only disables preemption. With SMP, it
+ * is a queued lock by default: waiters are served in order, and each one
+ * spins on its own cache line. With CONFIG_SPINLOCK_TICKET, it is a ticket
+ * lock: waiters are also served in order, but all spin on the lock word.
+ * Both are zero when unlocked.
+ */
 typedef struct spinlock {
-    atomic_t lock;
+    union {
+        volatile uint32_t lock;
+        struct {
+            volatile uint16_t owner;    // Ticket being served
+            volatile uint16_t next;     // Next ticket to hand out
+        } ticket;
+        struct {
+            volatile uint8_t locked;
+            uint8_t reserved;
+            volatile uint16_t tail;     // Last waiter, 0 if none
+        } queue;
+    };
 } spinlock_t;
 
 void spin_init(spinlock_t *const spin);
-void spin_lock(spinlock_t *const spin);
-void spin_unlock(spinlock_t *const spin);
+_export void spin_lock(spinlock_t *const spin);
+_export void spin_unlock(spinlock_t *const spin);
 int spin_trylock(spinlock_t *const spin);
 
 static inline void __spin_unlock(spinlock_t *const *const spin)
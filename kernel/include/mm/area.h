@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <lib/list.h>
+#include <mm/context.h>
+
+// Area flags
+#define MM_AREA_NONE        0x00
+#define MM_AREA_ANONYMOUS   0x01    // Zero-filled on first touch
+#define MM_AREA_GROWSDOWN   0x02    // Grows down automatically on fault
+#define MM_AREA_STACK       0x04
+#define MM_AREA_HEAP        0x08
+#define MM_AREA_FIXED       0x10    // Map exactly at the requested address
+#define MM_AREA_NOHUGE      0x20    // No large page on fault, see mm/huge.c
+
+// User address space layout
+#define MM_USER_START       0x00400000
+#define MM_HEAP_START       0x40000000
+#define MM_MMAP_TOP         0xB0000000
+#define MM_STACK_LIMIT      (8 * 1024 * 1024)
+
+#define mm_area_length(area) ((area)->end - (area)->start)
+
+/**
+ * @brief Describe a region of the user address space. Pages of a region are
+ * not mapped when the region is created: they are mapped on first touch by
+ * the page fault handler according to the region flags.
+ */
+typedef struct mm_area {
+    vaddr_t start;
+    vaddr_t end;
+    int access;
+    int flags;
+    struct list_head node;
+} mm_area_t;
+
+struct mm_area *mm_area_find(struct mm_context *context, const vaddr_t addr);
+struct mm_area *mm_area_grow(struct mm_context *context, const vaddr_t addr);
+
+int mm_area_insert(
+    struct mm_context *context,
+    const vaddr_t start,
+    const vaddr_t end,
+    const int access,
+    const int flags);
+int mm_area_stack(
+    struct mm_context *context,
+    const vaddr_t top,
+    const size_t size);
+int mm_area_clone(struct mm_context *dst, struct mm_context *src);
+void mm_area_release_all(struct mm_context *context);
+
+_export int mm_map(
+    struct mm_context *context,
+    vaddr_t *addr,
+    const size_t length,
+    const int access,
+    const int flags);
+int mm_unmap(struct mm_context *context, const vaddr_t addr, size_t length);
+int mm_brk(struct mm_context *context, const vaddr_t addr);
@@ -18,15 +18,28 @@
  */
 #pragma once
 #include <kernel.h>
+#include <lib/list.h>
+#include <lib/spinlock.h>
 
 typedef struct mm_context {
     atomic_t usage;
     vaddr_t pd;
+    uint_t kernel_generation;   // Kernel page directory generation of pd
+
+    vaddr_t brk_start;          // Start of the heap
+    vaddr_t brk;                // Current end of the heap
+    struct spinlock lock;       // Protect the area list
+    struct list_head areas;     // Sorted list of struct mm_area
+    struct list_head node;      // Node in the list of all contexts
 } mm_context_t;
 
-struct mm_context *mm_context_clone(struct mm_context *context);
-struct mm_context *mm_context_create(void);
+_export struct mm_context *mm_context_clone(struct mm_context *context);
+_export struct mm_context *mm_context_create(void);
 
 void mm_context_use(struct mm_context *context);
-void mm_context_set(struct mm_context *context);
-void mm_context_drop(struct mm_context *context);
+bool mm_context_tryuse(struct mm_context *context);
+_export void mm_context_set(struct mm_context *context);
+void mm_context_sync_kernel(void);
+_export void mm_context_drop(struct mm_context *context);
+bool mm_context_reap(void);
+void mm_context_foreach(void (*function)(struct mm_context *));
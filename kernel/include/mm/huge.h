@@ -0,0 +1,28 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <mm/area.h>
+#include <mm/context.h>
+
+#define MM_HUGE_SCAN_PERIOD 1000    // Milliseconds between two scans
+#define MM_HUGE_SCAN_MAX    4       // Regions collapsed at most per scan
+
+_init void mm_huge_setup(void);
+int mm_huge_fault(struct mm_area *area, const vaddr_t addr);
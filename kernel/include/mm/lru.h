@@ -0,0 +1,37 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <mm/page.h>
+
+#define LRU_BATCH           32      // Pages scanned per list per round
+#define LRU_SCAN_MAX        1024    // Pages scanned at most per reclaim
+#define LRU_RECLAIM_PAGES   32      // Pages reclaimed on allocation failure
+#define KSWAPD_PERIOD       1000    // Milliseconds between two checks
+
+_init void kswapd_setup(void);
+void kswapd_wakeup(void);
+
+void lru_add(
+    struct mm_context *context,
+    const paddr_t paddr,
+    const vaddr_t vaddr);
+void lru_del(struct page_info *page);
+void lru_forget(struct mm_context *context);
+_export uint_t lru_reclaim(const uint_t target, const uint_t zones);
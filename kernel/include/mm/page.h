@@ -23,11 +23,28 @@
 #include <lib/spinlock.h>
 #include <arch/x86/memory.h>
 
+struct mm_context;
+
 // Page alloc flags
 #define PAGE_NONE 0x00 // No flags
 #define PAGE_BIOS 0x01
 #define PAGE_ISA 0x02
 #define PAGE_CLEAR 0x04
+#define PAGE_HIGH 0x08  // The page may be above the direct map
+
+// Memory zones, from the lowest to the highest
+#define PAGE_ZONE_BIOS      0   // Below 1 MiB
+#define PAGE_ZONE_ISA       1   // Below 16 MiB, reachable by ISA DMA
+#define PAGE_ZONE_NORMAL    2   // In the direct map
+#define PAGE_ZONE_HIGH      3   // Above the direct map
+#define PAGE_ZONE_COUNT     4
+#define PAGE_ZONES_ALL      ((1 << PAGE_ZONE_COUNT) - 1)
+
+// Free memory watermarks of each zone, see page_zones_below()
+#define PAGE_WMARK_MIN  0   // Above, plus the reserve, fallbacks are allowed
+#define PAGE_WMARK_LOW  1   // Below, the reclaim thread is woken up
+#define PAGE_WMARK_HIGH 2   // Above, the reclaim thread stops
+#define PAGE_WMARK_RATIO    128 // Free memory at boot / min watermark
 
 #define page_index_to_address(index) ((index) << PAGE_SHIFT)
 #define page_address_to_index(address) ((address) >> PAGE_SHIFT)
@@ -49,6 +66,7 @@ typedef struct page_info {
     struct spinlock lock;
     atomic_t count;
     uint32_t index;         // Index of the page
+    uint16_t pt_count;      // Used entries, if the page is a page table
     union {
         uint32_t flags;
         struct {
@@ -56,11 +74,38 @@ typedef struct page_info {
             int cleared : 1;
             int bios : 1;
             int isa: 1;
-            int unused : 28;
+            int high : 1;
+            int lru : 1;    // In a LRU list, linked with entry
+            int active : 1; // In the active LRU list
+            int unused : 25;
         }_packed;
     };
+
+    // Reverse mapping of a page in a LRU list: the page is mapped once, in
+    // the page table rmap_pt of rmap_context at the address rmap_vaddr
+    struct mm_context *rmap_context;
+    paddr_t rmap_pt;
+    vaddr_t rmap_vaddr;
 } page_info_t;
 
+/**
+ * @brief State and counters of a memory zone. An allocation is served by
+ * the zone matching its flags, or falls back to a lower zone if the zone
+ * is empty: a fallback is only allowed while the lower zone keeps more free
+ * pages than its min watermark plus its reserve, so that the scarce low
+ * memory is kept for the allocations that really need it.
+ */
+typedef struct page_zone_stats {
+    const char *name;
+    uint_t present;             // Pages managed by the zone
+    uint_t free;                // Free pages
+    uint_t watermarks[3];       // Indexed by PAGE_WMARK_*
+    uint_t reserve;             // Free pages refused to fallbacks
+    uint_t allocs;              // Pages allocated from the zone
+    uint_t fallbacks;           // Allocated for a higher zone
+    uint_t failures;            // Failed allocations preferring the zone
+} page_zone_stats_t;
+
 typedef struct page_table_info {
     struct page_info *pages;
     size_t nb_pages;
@@ -68,11 +113,33 @@ typedef struct page_table_info {
 
 _init void page_map_table(void);
 _init void page_setup(struct mb_info *info);
+_init void page_zero_setup(void);
+
+struct page_info *page_get(const paddr_t paddr);
 
 /* Pages allocation interface */
 _export void page_reference(const paddr_t addr);
+_export void page_dereference(const paddr_t addr);
 _export int page_counter(const paddr_t addr);
 _export paddr_t page_alloc(const int flags);
 _export void page_free(const paddr_t addr);
+_export void page_free_range(const paddr_t addr, const uint_t count);
+_export paddr_t page_alloc_range(
+    const uint_t count,
+    const size_t alignment,
+    const int flags);
+_export void page_copy(const paddr_t dst, const paddr_t src);
+_export paddr_t page_memory_end(void);
+_export paddr_t page_zero(void);
+_export int page_zone(const paddr_t addr);
+_export uint_t page_zones_below(const int wmark);
+_export int page_get_zone_stats(
+    const int zone,
+    struct page_zone_stats *info);
 _export int page_unlock(const paddr_t addr);
 _export int page_lock(const paddr_t addr);
+
+/* Page table entries accounting */
+_export uint_t page_pt_count(const paddr_t addr);
+_export uint_t page_pt_inc(const paddr_t addr);
+_export uint_t page_pt_dec(const paddr_t addr);
@@ -25,6 +25,10 @@ _export int paging_change_rights_interval(
     const vaddr_t start,
     const vaddr_t end,
     const int access);
+_export int paging_map_interval_large(
+    const vaddr_t start,
+    const vaddr_t end,
+    const int access);
 _export int paging_map_interval(
     const vaddr_t start,
     const vaddr_t end,
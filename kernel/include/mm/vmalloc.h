@@ -34,7 +34,7 @@
 #define VMALLOC_VMAREA_ALIGN    16
 
 #define vmallocp(size, flags)   ((void *) vmalloc(size, flags))
-#define vmfreep(ptr)            vmfree((void *) ptr)
+#define vmfreep(ptr)            vmfree((vaddr_t) ptr)
 
 typedef struct vmarea {
     vaddr_t base;
@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <mm/area.h>
+#include <mm/context.h>
+
+#define ZRAM_MAX_SLOTS      8192    // Pages stored at most
+#define ZRAM_MAX_LENGTH     (PAGE_SIZE * 3 / 4)     // Worse ratio is rejected
+
+/**
+ * @brief Counters of the compressed store. The compression ratio is
+ * stored * PAGE_SIZE / compressed, and the average latencies are the cycle
+ * counters divided by swapouts and swapins.
+ */
+typedef struct zram_stats {
+    uint_t stored;              // Pages currently stored
+    uint_t zero;                // Stored pages that were filled with zeros
+    size_t compressed;          // Bytes used by the stored pages
+    uint_t swapouts;            // Pages compressed and stored
+    uint_t swapins;             // Faults served from the store
+    uint_t rejected;            // Pages that did not compress well enough
+    uint64_t swapout_cycles;    // Time spent compressing pages
+    uint64_t swapin_cycles;     // Time spent decompressing pages
+} zram_stats_t;
+
+_export void zram_get_stats(struct zram_stats *info);
+int zram_store(const paddr_t page);
+int zram_fault(
+    struct mm_context *context,
+    struct mm_area *area,
+    const vaddr_t addr);
+void zram_dup(const uint_t slot);
+void zram_free(const uint_t slot);
@@ -0,0 +1,121 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <lib/list.h>
+#include <lib/rbtree.h>
+#include <lib/spinlock.h>
+#include <process/thread.h>
+#include <process/schedule.h>
+
+#define RT_BITMAP_WORDS ((SCHEDULER_RT_PRIORITIES + 31) / 32)
+
+// Queue of the real-time class, see rt.c
+typedef struct rt_queue {
+    struct list_head lists[SCHEDULER_RT_PRIORITIES];
+    uint32_t bitmap[RT_BITMAP_WORDS];
+    struct scheduler_rt_stats stats;
+} rt_queue_t;
+
+// Queue of the fair class, see fair.c
+typedef struct fair_queue {
+    struct rb_root timeline;
+    struct rb_node *leftmost;
+    uint64_t min_vruntime;
+    uint_t load;                // Sum of the weights of the queued threads
+} fair_queue_t;
+
+// Queue of the round robin class, see robin.c
+typedef struct robin_queue {
+    struct list_head lists[SCHEDULER_PRIORITIES];
+    uint32_t bitmap;
+} robin_queue_t;
+
+/**
+ * @brief The run queue of a CPU: the ready threads of each class, the
+ * running thread and the idle thread of the CPU. A thread is in the run
+ * queue of the CPU it last ran on, until it is moved by the load balancing.
+ * The lock is always taken with interrupts disabled, because the run queue
+ * is used by the timer and the wakeups in interrupt context.
+ */
+typedef struct run_queue {
+    struct spinlock lock;
+    uint_t cpu;
+    uint_t nr_ready;            // Queued threads, in all classes
+    uint_t ticks;
+    thread_t *current;
+    thread_t *idle;
+    struct rt_queue rt;
+    struct fair_queue fair;
+    struct robin_queue robin;
+} run_queue_t;
+
+/**
+ * @brief A scheduling class: a policy with its own queue of ready threads in
+ * each run queue. Classes are ranked, and a ready thread of a class always
+ * runs before the threads of lower classes. All operations are called with
+ * the lock of the run queue held, and never on the idle thread.
+ */
+typedef struct scheduler_class {
+    const char *name;
+    int rank;                           // 0 is the highest rank
+
+    // Initialize the queue of the class
+    void (*init)(struct run_queue *rq);
+
+    // A thread joins the class, it is not queued yet
+    void (*setup)(struct run_queue *rq, thread_t *thread);
+
+    // Queue a ready thread, which was just woken up if wakeup is set
+    void (*enqueue)(
+        struct run_queue *rq,
+        thread_t *thread,
+        const bool wakeup);
+
+    // Remove a queued thread from the queue
+    void (*dequeue)(struct run_queue *rq, thread_t *thread);
+
+    // Remove and return the next thread to run, or NULL if the queue is empty
+    thread_t *(*pick)(struct run_queue *rq);
+
+    // Account a tick to the current thread: return true to reschedule it
+    bool (*tick)(struct run_queue *rq, thread_t *current);
+
+    // Check if a thread just woken up must preempt the current thread of
+    // the same class
+    bool (*preempt)(const thread_t *current, const thread_t *thread);
+
+    // Remove and return a queued thread that can be moved to another CPU,
+    // or NULL if there is none. Threads still running on their CPU (see
+    // thread_t.on_cpu) cannot be moved.
+    thread_t *(*steal)(struct run_queue *rq);
+
+    // A thread removed from the queue of src will be queued in dst: both
+    // locks are held. Optional.
+    void (*migrate)(
+        struct run_queue *src,
+        struct run_queue *dst,
+        thread_t *thread);
+} scheduler_class_t;
+
+extern const struct scheduler_class rt_class;
+extern const struct scheduler_class fair_class;
+extern const struct scheduler_class robin_class;
+
+uint_t fair_nice_weight(const int nice);
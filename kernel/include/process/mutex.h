@@ -0,0 +1,72 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <process/queue.h>
+#include <process/thread.h>
+
+// Attempts to take a mutex while its owner runs on another CPU, before
+// sleeping
+#define MUTEX_SPIN_MAX  1000
+
+/**
+ * @brief A sleeping lock for long critical sections: a thread that cannot
+ * take the mutex spins while the owner runs on another CPU, since the mutex
+ * is likely to be released soon, and sleeps otherwise. Unlike spinlocks,
+ * preemption stays enabled while a mutex is held.
+ */
+typedef struct mutex {
+    volatile int locked;
+    thread_t *volatile owner;
+    thread_queue_t queue;
+} mutex_t;
+
+#define DECLARE_MUTEX(name)                                 \
+    mutex_t name = {                                        \
+        .locked = 0,                                        \
+        .owner = NULL,                                      \
+        .queue = {                                          \
+            .thread = NULL,                                 \
+            .lock = SPINLOCK_INIT,                          \
+            .node = { &name.queue.node, &name.queue.node }  \
+        }                                                   \
+    }
+
+// Please use bracket when using this macro for better readability
+#define mutex_acquire(mutex)                                                \
+    for (mutex_t *__mutex _cleanup(__mutex_unlock) = (__mutex_lock(mutex)), \
+                         *__i = (mutex);                                    \
+         __i == (mutex);                                                    \
+         __i++)
+
+#define __mutex_lock(mutex) ({  \
+    mutex_lock(mutex);          \
+    mutex;                      \
+})
+
+void mutex_init(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+bool mutex_trylock(mutex_t *mutex);
+bool mutex_locked(const mutex_t *mutex);
+
+static inline void __mutex_unlock(mutex_t *const *const mutex)
+{
+    mutex_unlock(*mutex);
+}
@@ -46,11 +46,14 @@ typedef struct process {
 
 _noreturn void process_start(void);
 _init void process_init(void);
+_init thread_t *process_creat_idle(const uint_t cpu);
 
 process_t *process_allocate(void);
 int process_creat(process_t *process);
 int process_destroy(process_t *process);
 void process_add_system_thread(thread_t *thread);
+_export thread_t *process_creat_kthread(_noreturn void (*entry)(void));
+_export _noreturn void process_exit_kthread(void);
 int process_clone(process_t *process, process_t *parent);
 
 int process_abandoned(process_t *process);
@@ -22,6 +22,17 @@
 #include <lib/spinlock.h>
 #include <process/thread.h>
 
+#define DECLARE_THREAD_QUEUE(name)              \
+    thread_queue_t name = {                     \
+        .thread = NULL,                         \
+        .lock = SPINLOCK_INIT,                  \
+        .node = { &name.node, &name.node }      \
+    }
+
+/**
+ * @brief A thread queue is used both as the head of a queue and as the
+ * entries queued on it: an entry holds the thread waiting on the queue.
+ */
 typedef struct thread_queue {
     thread_t *thread;
     struct spinlock lock;
@@ -20,15 +20,68 @@
 #include <kernel.h>
 #include <process/thread.h>
 
+// Scheduling policies, from the highest ranked class to the lowest
+#define SCHEDULER_POLICY_FIFO       0   // Real-time, see rt.c
+#define SCHEDULER_POLICY_RR         1   // Real-time with a quantum
+#define SCHEDULER_POLICY_FAIR       2   // Weighted fair share, see fair.c
+#define SCHEDULER_POLICY_ROBIN      3   // Round robin with priorities
+#define SCHEDULER_POLICIES          4
+#define SCHEDULER_CLASSES           3   // Real-time policies share a class
+
+#ifdef CONFIG_SCHED_ROBIN
+#define SCHEDULER_DEFAULT_POLICY    SCHEDULER_POLICY_ROBIN
+#else
+#define SCHEDULER_DEFAULT_POLICY    SCHEDULER_POLICY_FAIR
+#endif
+
+// Round robin policy
 #define SCHEDULER_DEFAULT_QUANTUM   25
+#define SCHEDULER_PRIORITIES        32  // One bit each in the ready bitmap
+#define SCHEDULER_DEFAULT_PRIORITY  16
+
+// Real-time policies
+#define SCHEDULER_RT_PRIORITIES     100 // 0 is the highest priority
+#define SCHEDULER_RT_QUANTUM        10  // Ticks, RR policy only
 
-_init void scheduler_set_current(thread_t *thread);
+// Fair policy
+#define SCHEDULER_NICE_MIN          -20
+#define SCHEDULER_NICE_MAX          19
+#define SCHEDULER_NICE_0_WEIGHT     1024
+#define SCHEDULER_FAIR_LATENCY      6       // Ticks to run all ready threads
+#define SCHEDULER_FAIR_GRANULARITY  1       // Minimum slice, in ticks
+#define SCHEDULER_FAIR_WAKEUP_GRAN  1000    // Lead to preempt on wakeup, in us
+#define SCHEDULER_FAIR_SLEEPER_CREDIT   30000   // Credit of sleepers, in us
+
+// Load balancing between the run queues of the CPUs
+#define SCHEDULER_BALANCE_PERIOD    10  // Ticks between two balancings
+
+/**
+ * @brief Delay between the wakeup of real-time threads and the moment they
+ * are picked to run, in TSC cycles.
+ */
+typedef struct scheduler_rt_stats {
+    uint_t wakeups;
+    uint64_t max_latency;
+    uint64_t total_latency;
+} scheduler_rt_stats_t;
+
+_init void scheduler_set_idle(const uint_t cpu, thread_t *thread);
+thread_t *scheduler_get_idle(const uint_t cpu);
+void scheduler_balance_start(void);
+_noreturn void scheduler_start(void);
 
 _no_inline void schedule(cpu_state_t *state);
 
 void schedule_tick(void);
-void scheduler_run(thread_t *thread, const bool save);
 
 int scheduler_add_thread(thread_t *thread);
 int scheduler_remove_thread(thread_t *thread);
+
+_export void scheduler_sleep(const time_t ms);
+bool scheduler_wakeup(thread_t *thread);
+int scheduler_set_priority(thread_t *thread, const int priority);
+_export int scheduler_set_policy(thread_t *thread, const int policy);
+int scheduler_set_nice(thread_t *thread, const int nice);
+_export int scheduler_set_rt_priority(thread_t *thread, const int priority);
+_export void scheduler_get_rt_stats(struct scheduler_rt_stats *info);
 thread_t *scheduler_get_current_thread(void);
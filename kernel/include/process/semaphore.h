@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <process/queue.h>
+
+/**
+ * @brief A counting semaphore: semaphore_down() sleeps until the count is
+ * positive and decrements it, semaphore_up() increments it.
+ */
+typedef struct semaphore {
+    uint_t count;
+    thread_queue_t queue;
+} semaphore_t;
+
+/**
+ * @brief A read-write semaphore: any number of readers or a single writer
+ * hold it. Waiting writers block new readers, so that writers are not
+ * starved by a continuous flow of readers.
+ */
+typedef struct rw_semaphore {
+    uint_t readers;             // Readers holding the semaphore
+    uint_t writers;             // Waiting writers
+    bool writer;                // Held by a writer
+    thread_queue_t queue;
+} rw_semaphore_t;
+
+void semaphore_init(semaphore_t *sem, const uint_t count);
+void semaphore_down(semaphore_t *sem);
+int semaphore_down_timeout(semaphore_t *sem, const time_t ms);
+bool semaphore_trydown(semaphore_t *sem);
+void semaphore_up(semaphore_t *sem);
+
+void rw_semaphore_init(rw_semaphore_t *sem);
+void down_read(rw_semaphore_t *sem);
+void up_read(rw_semaphore_t *sem);
+void down_write(rw_semaphore_t *sem);
+void up_write(rw_semaphore_t *sem);
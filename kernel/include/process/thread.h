@@ -18,6 +18,7 @@
  */
 #pragma once
 #include <lib/list.h>
+#include <lib/rbtree.h>
 #include <mm/context.h>
 #include <arch/x86/cpu.h>
 #include <arch/x86/fpu.h>
@@ -50,15 +51,30 @@ typedef struct kstack {
 
 typedef struct thread {
     int exit_code;
-    int quantum;
     int state;
     int type;
 
     pid_t tid;
 
-    int fpu_used : 1;
-    int fpu_loaded : 1;
+    int fpu_used : 1;           // The FPU state was initialized
+    int fpu_loaded : 1;         // The FPU state is loaded on its CPU
+    int fpu_cpu;                // CPU where the FPU state was last loaded
+    uint8_t fpu_counter;        // Consecutive time slices using the FPU
     int reschedule : 1;
+    int queued : 1;             // In the queue of its scheduling class
+    volatile int on_cpu;        // Running, or its stack is still in use
+    uint_t cpu;                 // CPU of the run queue of the thread
+
+    int policy;
+    int quantum;                // Round robin and RR policies
+    int priority;               // Round robin policy
+    int rt_priority;            // Real-time policies
+    uint64_t wakeup_tsc;        // Real-time policies, to measure latency
+    int nice;                   // Fair policy
+    uint_t weight;
+    uint_t slice;               // Ticks run since the thread was picked
+    uint64_t vruntime;          // Weighted run time, in microseconds
+    struct rb_node fair_node;
 
     struct kstack kstack;
     struct process *process;
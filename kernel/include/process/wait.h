@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <kernel.h>
+#include <core/timer.h>
+#include <process/queue.h>
+
+#define COMPLETION_ALL  0x80000000  // Done count set by complete_all()
+
+/**
+ * @brief A completion lets threads wait for an event signaled by another
+ * thread or by an interrupt handler. Each call to complete() lets one
+ * waiter through, and complete_all() lets all current and future waiters
+ * through.
+ */
+typedef struct completion {
+    uint_t done;
+    thread_queue_t queue;
+} completion_t;
+
+#define DECLARE_COMPLETION(name)                            \
+    completion_t name = {                                   \
+        .done = 0,                                          \
+        .queue = {                                          \
+            .thread = NULL,                                 \
+            .lock = SPINLOCK_INIT,                          \
+            .node = { &name.queue.node, &name.queue.node }  \
+        }                                                   \
+    }
+
+/**
+ * @brief Sleep on a thread queue until a condition becomes true. The
+ * current thread is queued and marked as sleeping before the condition is
+ * checked, so a wakeup that happens between the check and the call to the
+ * scheduler is not lost: the thread is simply not removed from its run
+ * queue. The condition is checked with interrupts disabled, so it must be
+ * short and must not sleep. Must not be called with preemption disabled.
+ */
+#define wait_event(queue, condition) ({                             \
+    thread_queue_t __wait;                                          \
+    uint32_t __eflags;                                              \
+    wait_init(&__wait);                                             \
+    for (;;) {                                                      \
+        __eflags = wait_prepare((queue), &__wait);                  \
+        if (condition)                                              \
+            break;                                                  \
+        wait_sleep(__eflags);                                       \
+    }                                                               \
+    wait_finish((queue), &__wait, __eflags);                        \
+})
+
+/**
+ * @brief Same as wait_event(), but give up after a timeout. The condition
+ * is checked a last time when the timeout expires.
+ * 
+ * @return int 0 if the condition became true, or
+ *  -ETIMEDOUT if the timeout expired before
+ */
+#define wait_event_timeout(queue, condition, ms) ({                 \
+    thread_queue_t __wait;                                          \
+    timer_t __timer;                                                \
+    uint32_t __eflags;                                              \
+    int __ret = 0;                                                  \
+    wait_init(&__wait);                                             \
+    wait_timeout_start(&__timer, (ms));                             \
+    for (;;) {                                                      \
+        __eflags = wait_prepare((queue), &__wait);                  \
+        if (condition)                                              \
+            break;                                                  \
+        if (wait_timed_out(&__timer)) {                             \
+            __ret = -ETIMEDOUT;                                     \
+            break;                                                  \
+        }                                                           \
+        wait_sleep(__eflags);                                       \
+    }                                                               \
+    wait_finish((queue), &__wait, __eflags);                        \
+    wait_timeout_end(&__timer);                                     \
+    __ret;                                                          \
+})
+
+/* Wait queues, see wait_event() */
+void wait_init(thread_queue_t *entry);
+uint32_t wait_prepare(thread_queue_t *queue, thread_queue_t *entry);
+void wait_sleep(const uint32_t eflags);
+void wait_finish(
+    thread_queue_t *queue,
+    thread_queue_t *entry,
+    const uint32_t eflags);
+void wait_timeout_start(timer_t *timer, const time_t ms);
+bool wait_timed_out(const timer_t *timer);
+void wait_timeout_end(timer_t *timer);
+
+void wake_up_one(thread_queue_t *queue);
+void wake_up_all(thread_queue_t *queue);
+
+/* Completions */
+void completion_init(completion_t *completion);
+void complete(completion_t *completion);
+void complete_all(completion_t *completion);
+bool completion_try(completion_t *completion);
+void wait_for_completion(completion_t *completion);
+int wait_for_completion_timeout(completion_t *completion, const time_t ms);
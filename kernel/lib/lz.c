@@ -0,0 +1,219 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/lz.h>
+#include <lib/maths.h>
+#include <lib/memory.h>
+
+/**
+ * @file A small and fast LZ77 codec, using the LZ4 block format: the output
+ * is a list of sequences, each made of a token, a run of literals and a
+ * match. The high nibble of the token is the number of literals, the low
+ * nibble the length of the match minus LZ_MIN_MATCH; a nibble of 15 is
+ * followed by extension bytes that are added to it, until a byte different
+ * from 255. The match is encoded as a 16 bits little-endian offset backward
+ * from the current position. The last sequence only contains literals.
+ * 
+ * The compressor finds matches with a single hash table of recent positions
+ * and never looks back further: it trades compression ratio for speed.
+ */
+
+static inline uint32_t lz_read32(const uint8_t *ptr)
+{
+    return ptr[0] | ptr[1] << 8 | ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
+
+static inline uint32_t lz_hash(const uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Write the extension bytes of a length.
+ */
+static size_t lz_write_length(uint8_t *out, size_t op, size_t length)
+{
+    while (length >= 255) {
+        out[op++] = 255;
+        length -= 255;
+    }
+    out[op++] = length;
+    return op;
+}
+
+/**
+ * @brief Write a sequence. If the match length is 0, the sequence is the
+ * last one and only contains literals.
+ * 
+ * @return size_t The new output position, or 0 if the output is too small
+ */
+static size_t lz_write_sequence(
+    uint8_t *out,
+    size_t op,
+    const size_t capacity,
+    const uint8_t *literals,
+    const size_t count,
+    const size_t offset,
+    const size_t length)
+{
+    const size_t match = length ? length - LZ_MIN_MATCH : 0;
+    const size_t needed = 1 + count / 255 + 1 + count + 2 + match / 255 + 1;
+    if (needed > capacity - op)
+        return 0;
+
+    uint8_t *const token = &out[op++];
+    *token = min(count, (size_t) 15) << 4 | min(match, (size_t) 15);
+    if (count >= 15)
+        op = lz_write_length(out, op, count - 15);
+    memcpy(&out[op], literals, count);
+    op += count;
+    if (length == 0)
+        return op;
+
+    out[op++] = offset & 0xFF;
+    out[op++] = offset >> 8;
+    if (match >= 15)
+        op = lz_write_length(out, op, match - 15);
+    return op;
+}
+
+/**
+ * @brief Compress a buffer.
+ * 
+ * @param src The data to compress
+ * @param len The length of the data, at most LZ_MAX_INPUT bytes
+ * @param dst The output buffer
+ * @param capacity The size of the output buffer
+ * @param table A work table of LZ_HASH_SIZE entries, its content is ignored
+ * @return size_t The length of the compressed data, or 0 if the output
+ * buffer is too small
+ */
+size_t lz_compress(
+    const void *src,
+    const size_t len,
+    void *dst,
+    const size_t capacity,
+    uint16_t *table)
+{
+    assert(len <= LZ_MAX_INPUT);
+    const uint8_t *const in = src;
+    uint8_t *const out = dst;
+    size_t anchor = 0;
+    size_t op = 0;
+    size_t ip = 0;
+
+    memzero(table, LZ_HASH_SIZE * sizeof(uint16_t));
+    while (ip + LZ_MIN_MATCH <= len) {
+        const uint32_t sequence = lz_read32(&in[ip]);
+        const uint32_t hash = lz_hash(sequence);
+        const size_t ref = table[hash];
+        table[hash] = ip;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+            lz_read32(&in[ref]) != sequence) {
+            ip++;
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < len && in[ref + length] == in[ip + length])
+            length++;
+        op = lz_write_sequence(out, op, capacity,
+            &in[anchor], ip - anchor, ip - ref, length);
+        if (op == 0)
+            return 0;
+        ip += length;
+        anchor = ip;
+    }
+    return lz_write_sequence(out, op, capacity,
+        &in[anchor], len - anchor, 0, 0);
+}
+
+/**
+ * @brief Read the extension bytes of a length.
+ * 
+ * @return int 0 on success, or -1 if the input is truncated
+ */
+static int lz_read_length(
+    const uint8_t *in,
+    size_t *ip,
+    const size_t len,
+    size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (*ip >= len)
+            return -1;
+        byte = in[(*ip)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * @brief Decompress a buffer compressed with lz_compress(). The input is
+ * fully checked, so a corrupted input cannot write outside of the output
+ * buffer.
+ * 
+ * @param src The compressed data
+ * @param len The length of the compressed data
+ * @param dst The output buffer
+ * @param capacity The size of the output buffer
+ * @return int The length of the decompressed data, or
+ *  -EINVAL if the input is corrupted or the output buffer is too small
+ */
+int lz_decompress(
+    const void *src,
+    const size_t len,
+    void *dst,
+    const size_t capacity)
+{
+    const uint8_t *const in = src;
+    uint8_t *const out = dst;
+    size_t op = 0;
+    size_t ip = 0;
+
+    while (ip < len) {
+        const uint8_t token = in[ip++];
+        size_t count = token >> 4;
+        if (count == 15 && lz_read_length(in, &ip, len, &count) < 0)
+            return -EINVAL;
+        if (count > len - ip || count > capacity - op)
+            return -EINVAL;
+        memcpy(&out[op], &in[ip], count);
+        ip += count;
+        op += count;
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -EINVAL;
+        const size_t offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        size_t length = token & 0x0F;
+        if (length == 15 && lz_read_length(in, &ip, len, &length) < 0)
+            return -EINVAL;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || length > capacity - op)
+            return -EINVAL;
+
+        // The match may overlap the output, copy byte per byte
+        for (size_t i = 0; i < length; i++, op++)
+            out[op] = out[op - offset];
+    }
+    return op;
+}
@@ -0,0 +1,303 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/rbtree.h>
+
+/**
+ * @file A red-black tree. Like lists, nodes are embedded in the structures
+ * stored in the tree and the tree never allocates memory. The caller walks
+ * the tree to find where a new node must be linked, links it with
+ * rb_link_node() and rebalances the tree with rb_insert_color():
+ * 
+ *     struct rb_node **link = &root->node, *parent = NULL;
+ *     while (*link != NULL) {
+ *         parent = *link;
+ *         if (key < rb_entry(parent, struct foo, node)->key)
+ *             link = &parent->left;
+ *         else
+ *             link = &parent->right;
+ *     }
+ *     rb_link_node(&foo->node, parent, link);
+ *     rb_insert_color(root, &foo->node);
+ */
+
+static void rb_replace_child(
+    struct rb_root *root,
+    struct rb_node *old,
+    struct rb_node *new)
+{
+    if (old->parent == NULL)
+        root->node = new;
+    else if (old->parent->left == old)
+        old->parent->left = new;
+    else
+        old->parent->right = new;
+}
+
+static void rb_rotate_left(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *const right = node->right;
+    node->right = right->left;
+    if (right->left != NULL)
+        right->left->parent = node;
+    right->parent = node->parent;
+    rb_replace_child(root, node, right);
+    right->left = node;
+    node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *const left = node->left;
+    node->left = left->right;
+    if (left->right != NULL)
+        left->right->parent = node;
+    left->parent = node->parent;
+    rb_replace_child(root, node, left);
+    left->right = node;
+    node->parent = left;
+}
+
+static bool rb_is_black(const struct rb_node *node)
+{
+    return node == NULL || node->color == RB_BLACK;
+}
+
+/**
+ * @brief Link a new node in the tree, as a leaf. The tree must be rebalanced
+ * with rb_insert_color() after this function.
+ * 
+ * @param node The node to link
+ * @param parent The parent of the node, or NULL if the tree is empty
+ * @param link The child pointer of the parent (or the root pointer) where
+ * the node must be linked
+ */
+void rb_link_node(
+    struct rb_node *node,
+    struct rb_node *parent,
+    struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+/**
+ * @brief Rebalance the tree after a node was linked with rb_link_node().
+ * 
+ * @param root The tree
+ * @param node The node just linked
+ */
+void rb_insert_color(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *parent;
+    while ((parent = node->parent) != NULL && parent->color == RB_RED) {
+        // The parent is red, so it is not the root and has a parent
+        struct rb_node *const gparent = parent->parent;
+        if (parent == gparent->left) {
+            struct rb_node *const uncle = gparent->right;
+            if (!rb_is_black(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(root, gparent);
+        } else {
+            struct rb_node *const uncle = gparent->left;
+            if (!rb_is_black(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(root, gparent);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/**
+ * @brief Restore the properties of the tree after a black node was removed.
+ * 
+ * @param root The tree
+ * @param node The node that replaced the removed node, may be NULL
+ * @param parent The parent of this node
+ */
+static void rb_erase_color(
+    struct rb_root *root,
+    struct rb_node *node,
+    struct rb_node *parent)
+{
+    while (node != root->node && rb_is_black(node)) {
+        if (node == parent->left) {
+            struct rb_node *sibling = parent->right;
+            if (!rb_is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (rb_is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rb_rotate_left(root, parent);
+        } else {
+            struct rb_node *sibling = parent->left;
+            if (!rb_is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (rb_is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rb_rotate_right(root, parent);
+        }
+        node = root->node;
+        break;
+    }
+    if (node != NULL)
+        node->color = RB_BLACK;
+}
+
+/**
+ * @brief Remove a node from the tree and rebalance it.
+ * 
+ * @param root The tree
+ * @param node The node to remove
+ */
+void rb_erase(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *child;
+    struct rb_node *parent;
+    int color;
+
+    if (node->left == NULL || node->right == NULL) {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+        if (child != NULL)
+            child->parent = parent;
+        rb_replace_child(root, node, child);
+    } else {
+        // Replace the node by its successor, which has no left child
+        struct rb_node *next = node->right;
+        while (next->left != NULL)
+            next = next->left;
+
+        child = next->right;
+        parent = next->parent;
+        color = next->color;
+        if (parent == node) {
+            parent = next;
+        } else {
+            if (child != NULL)
+                child->parent = parent;
+            parent->left = child;
+            next->right = node->right;
+            node->right->parent = next;
+        }
+        next->left = node->left;
+        node->left->parent = next;
+        next->parent = node->parent;
+        next->color = node->color;
+        rb_replace_child(root, node, next);
+    }
+
+    if (color == RB_BLACK)
+        rb_erase_color(root, child, parent);
+}
+
+/**
+ * @brief Get the first node of the tree, in order.
+ * 
+ * @param root The tree
+ * @return struct rb_node* The leftmost node, or NULL if the tree is empty
+ */
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+    if (node == NULL)
+        return NULL;
+    while (node->left != NULL)
+        node = node->left;
+    return node;
+}
+
+/**
+ * @brief Get the node following a node, in order.
+ * 
+ * @param node The node
+ * @return struct rb_node* The next node, or NULL if it is the last one
+ */
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL)
+            node = node->left;
+        return (struct rb_node *) node;
+    }
+    while (node->parent != NULL && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
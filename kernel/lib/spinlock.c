@@ -18,29 +18,130 @@
  */
 #include <core/preempt.h>
 #include <lib/spinlock.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/percpu.h>
+
+#if defined(CONFIG_SMP) && !defined(CONFIG_SPINLOCK_TICKET)
+
+/**
+ * Queued spinlocks are MCS locks whose queue is reached through the lock
+ * word, like Linux qspinlocks. An uncontended lock is taken by setting its
+ * locked byte. Otherwise, the waiter appends a node of its CPU to the queue
+ * and spins on that node until the previous waiter hands it the head of the
+ * queue. Only the head spins on the lock word, waiting for the holder to
+ * release it. Waiters are served in order, and a release only invalidates
+ * the cache line of the head.
+ * 
+ * The nodes are only used while waiting, so the holder does not need one.
+ * A CPU waits on several locks at once only if an interrupt handler takes a
+ * lock while the interrupted code waits for another one, hence one node per
+ * nesting level.
+ */
+struct spin_node {
+    struct spin_node *volatile next;
+    volatile int head;          // Set by the previous waiter
+} _align(64);
+
+static DEFINE_PER_CPU(struct spin_node[SPINLOCK_NODES], spin_nodes);
+static DEFINE_PER_CPU(uint_t, spin_nesting);
+
+static uint16_t spin_encode_tail(const uint_t cpu, const uint_t index)
+{
+	return ((cpu + 1) << 2) | index;
+}
+
+static struct spin_node *spin_decode_tail(const uint16_t tail)
+{
+	const uint_t cpu = (tail >> 2) - 1;
+	return &(*per_cpu_ptr(spin_nodes, cpu))[tail & 3];
+}
+
+/**
+ * @brief Wait in the queue of a contended lock, then take it. Preemption
+ * must be disabled.
+ */
+static void spin_lock_queued(spinlock_t *const spin)
+{
+	const uint_t index = percpu_read(spin_nesting);
+	if (index >= SPINLOCK_NODES)
+		panic("Too many nested spinlocks waited on");
+	percpu_inc(spin_nesting);
+
+	struct spin_node *node = &(*this_cpu_ptr(spin_nodes))[index];
+	const uint16_t tail = spin_encode_tail(smp_cpu_id(), index);
+	node->next = NULL;
+	node->head = 0;
+
+	// Become the tail of the queue, keeping the locked byte
+	uint32_t old, new;
+	do {
+		old = spin->lock;
+		new = (old & SPINLOCK_LOCKED_MASK) |
+			  (uint32_t) tail << SPINLOCK_TAIL_SHIFT;
+	} while (!__sync_bool_compare_and_swap(&spin->lock, old, new));
+
+	// Wait on our own node for the previous waiter to get the lock
+	const uint16_t prev = old >> SPINLOCK_TAIL_SHIFT;
+	if (prev != 0) {
+		spin_decode_tail(prev)->next = node;
+		while (!node->head)
+			__builtin_ia32_pause();
+	}
+
+	// Head of the queue: wait for the holder to release the lock
+	while (spin->queue.locked)
+		__builtin_ia32_pause();
+
+	// Nobody else can set the locked byte now. If this node is the last
+	// one, the tail is cleared with the same write, otherwise the head of
+	// the queue is handed to the next waiter
+	for (;;) {
+		old = spin->lock;
+		if (old >> SPINLOCK_TAIL_SHIFT != tail) {
+			__sync_fetch_and_or(&spin->lock, SPINLOCK_LOCKED);
+			while (node->next == NULL)
+				__builtin_ia32_pause();
+			node->next->head = 1;
+			break;
+		}
+		if (__sync_bool_compare_and_swap(&spin->lock, old, SPINLOCK_LOCKED))
+			break;
+	}
+	percpu_dec(spin_nesting);
+}
+
+#endif
 
 void spin_init(spinlock_t *const spin)
 {
 	spin->lock = 0;
 }
 
-void spin_lock(spinlock_t *const spin)
+_export void spin_lock(spinlock_t *const spin)
 {
 	preempt_disable();
-#ifdef CONFIG_SMP
-	while (__sync_lock_test_and_set(&spin->lock, 1)) {
-		while (spin->lock)
-			__builtin_ia32_pause();
-	}
+#if defined(CONFIG_SMP) && defined(CONFIG_SPINLOCK_TICKET)
+	const uint16_t ticket = __sync_fetch_and_add(&spin->ticket.next, 1);
+	while (spin->ticket.owner != ticket)
+		__builtin_ia32_pause();
+	sw_barrier();
+#elif defined(CONFIG_SMP)
+	if (!__sync_bool_compare_and_swap(&spin->lock, 0, SPINLOCK_LOCKED))
+		spin_lock_queued(spin);
 #else
 	spin->lock = 1;
 #endif
 }
 
-void spin_unlock(spinlock_t *const spin)
+_export void spin_unlock(spinlock_t *const spin)
 {
-#ifdef CONFIG_SMP
-	__sync_lock_release(&spin->lock);
+#if defined(CONFIG_SMP) && defined(CONFIG_SPINLOCK_TICKET)
+	sw_barrier();
+	spin->ticket.owner++;
+#elif defined(CONFIG_SMP)
+	// Only the locked byte is written: waiters may update the tail
+	sw_barrier();
+	spin->queue.locked = 0;
 #else
 	spin->lock = 0;
 #endif
@@ -50,8 +151,15 @@ void spin_unlock(spinlock_t *const spin)
 int spin_trylock(spinlock_t *const spin)
 {
 	preempt_disable();
-#ifdef CONFIG_SMP
-	if (__sync_lock_test_and_set(&spin->lock, 1)) {
+#if defined(CONFIG_SMP) && defined(CONFIG_SPINLOCK_TICKET)
+	const uint32_t old = spin->lock;
+	if ((old & 0xFFFF) != old >> 16 ||
+		!__sync_bool_compare_and_swap(&spin->lock, old, old + 0x10000)) {
+		preempt_enable();
+		return 0;
+	}
+#elif defined(CONFIG_SMP)
+	if (!__sync_bool_compare_and_swap(&spin->lock, 0, SPINLOCK_LOCKED)) {
 		preempt_enable();
 		return 0;
 	}
@@ -60,7 +168,7 @@ int spin_trylock(spinlock_t *const spin)
 		preempt_enable();
 		return 0;
 	}
-	spin_lock(spin);
+	spin->lock = 1;
 #endif
 	return 1;
 }
@@ -0,0 +1,474 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/maths.h>
+#include <mm/area.h>
+#include <mm/malloc.h>
+#include <mm/paging.h>
+
+/**
+ * @file This file manages the areas of the user address space. Each memory
+ * context keeps a list of areas sorted by address: an area only describes a
+ * range of addresses and how it should be populated, pages are mapped lazily
+ * by the page fault handler (see mm/fault.c). This way, a process consumes
+ * only the memory it really touches.
+ * 
+ * The list is protected by the context lock. A list is largely enough for the
+ * few areas a process has for now, but a tree will be needed if processes
+ * start to use a lot of mappings.
+ */
+
+#define mm_area_overlap(area, s, e) ((area)->start < (e) && (s) < (area)->end)
+
+/**
+ * @brief Allocate a new area and initialize it.
+ * 
+ * @return struct mm_area* The new area, or NULL if there is no memory left
+ */
+static struct mm_area *mm_area_allocate(
+    const vaddr_t start,
+    const vaddr_t end,
+    const int access,
+    const int flags)
+{
+    struct mm_area *area = malloc(sizeof(struct mm_area));
+    if (area == NULL)
+        return NULL;
+
+    list_entry_init(&area->node);
+    area->access = access;
+    area->flags = flags;
+    area->start = start;
+    area->end = end;
+    return area;
+}
+
+/**
+ * @brief Check if a range of addresses is free in a memory context. The
+ * caller must hold the context lock.
+ * 
+ * @return true if no area overlaps the range, false otherwise
+ */
+static bool __mm_range_free(
+    struct mm_context *context,
+    const vaddr_t start,
+    const vaddr_t end)
+{
+    list_foreach (&context->areas, entry) {
+        const struct mm_area *area = list_entry(entry, struct mm_area, node);
+        if (area->start >= end)
+            break;
+        if (mm_area_overlap(area, start, end))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Insert an area in the sorted area list of a context. The caller
+ * must hold the context lock, and the area must not overlap another area.
+ */
+static void __mm_area_link(struct mm_context *context, struct mm_area *area)
+{
+    list_foreach (&context->areas, entry) {
+        const struct mm_area *a = list_entry(entry, struct mm_area, node);
+        if (a->start >= area->end) {
+            list_insert(entry->prev, entry, &area->node);
+            return;
+        }
+    }
+    list_add_tail(&context->areas, &area->node);
+}
+
+/**
+ * @brief Create an area and insert it into a context. The caller must hold
+ * the context lock.
+ * 
+ * @return int 0 on success, or
+ *  -EEXIST if the range overlaps an existing area
+ *  -ENOMEM if there is no memory left to allocate the area
+ */
+static int __mm_area_insert(
+    struct mm_context *context,
+    const vaddr_t start,
+    const vaddr_t end,
+    const int access,
+    const int flags)
+{
+    if (!__mm_range_free(context, start, end))
+        return -EEXIST;
+
+    struct mm_area *area = mm_area_allocate(start, end, access, flags);
+    if (area == NULL)
+        return -ENOMEM;
+    __mm_area_link(context, area);
+    return 0;
+}
+
+/**
+ * @brief Find a free range of addresses of the given length below
+ * MM_MMAP_TOP. The search is done top-down to keep the space above the
+ * heap free as long as possible. The caller must hold the context lock.
+ * 
+ * @return vaddr_t The start of the free range, or 0 if there is none
+ */
+static vaddr_t __mm_find_free(struct mm_context *context, const size_t length)
+{
+    vaddr_t top = MM_MMAP_TOP;
+    for (struct list_head *entry = context->areas.prev;
+        entry != &context->areas;
+        entry = entry->prev) {
+        const struct mm_area *area = list_entry(entry, struct mm_area, node);
+        if (area->end <= top && top - area->end >= length)
+            break;
+        if (area->start < top)
+            top = area->start;
+    }
+
+    if (top < length || top - length < MM_USER_START)
+        return 0;
+    return top - length;
+}
+
+/**
+ * @brief Remove a range of addresses from the areas of a context. Areas are
+ * shrunk or split if they partially overlap the range. The caller must hold
+ * the context lock.
+ * 
+ * @return int 0 on success, or
+ *  -ENOMEM if an area must be split and there is no memory left
+ */
+static int __mm_area_remove(
+    struct mm_context *context,
+    const vaddr_t start,
+    const vaddr_t end)
+{
+    list_foreach_safe (&context->areas, entry) {
+        struct mm_area *area = list_entry(entry, struct mm_area, node);
+        if (area->start >= end)
+            break;
+        if (!mm_area_overlap(area, start, end))
+            continue;
+
+        if (area->start >= start && area->end <= end) {
+            list_remove(&area->node);
+            free(area);
+        } else if (area->start < start && area->end > end) {
+            struct mm_area *tail = mm_area_allocate(
+                end, area->end,
+                area->access,
+                area->flags & ~MM_AREA_GROWSDOWN);
+            if (tail == NULL)
+                return -ENOMEM;
+            area->end = start;
+            list_insert(&area->node, area->node.next, &tail->node);
+            break;
+        } else if (area->start < start) {
+            area->end = start;
+        } else {
+            area->start = end;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the area containing an address. The caller must hold the
+ * context lock.
+ * 
+ * @param context The memory context to search in
+ * @param addr The address to search
+ * @return struct mm_area* The area containing the address, or NULL if the
+ * address is not inside an area
+ */
+struct mm_area *mm_area_find(struct mm_context *context, const vaddr_t addr)
+{
+    list_foreach (&context->areas, entry) {
+        struct mm_area *area = list_entry(entry, struct mm_area, node);
+        if (area->start > addr)
+            break;
+        if (addr < area->end)
+            return area;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Try to grow a stack area down to the given address. The area just
+ * above the address must be a MM_AREA_GROWSDOWN area, the new size of the area
+ * must not exceed MM_STACK_LIMIT and the area must not collide with the area
+ * below. The caller must hold the context lock.
+ * 
+ * @param context The memory context
+ * @param addr The faulting address below the stack
+ * @return struct mm_area* The grown area, or NULL if the address cannot
+ * be covered by a stack
+ */
+struct mm_area *mm_area_grow(struct mm_context *context, const vaddr_t addr)
+{
+    const vaddr_t start = PAGE_ALIGN(addr);
+    struct mm_area *prev = NULL;
+
+    list_foreach (&context->areas, entry) {
+        struct mm_area *area = list_entry(entry, struct mm_area, node);
+        if (area->start <= addr) {
+            prev = area;
+            continue;
+        }
+
+        if (!(area->flags & MM_AREA_GROWSDOWN))
+            return NULL;
+        if (area->end - start > MM_STACK_LIMIT)
+            return NULL;
+        if (prev != NULL && prev->end > start)
+            return NULL;
+        area->start = start;
+        return area;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Insert a new area in a memory context.
+ * 
+ * @param context The memory context
+ * @param start Start of the area, must be page aligned
+ * @param end End of the area, must be page aligned
+ * @param access Access rights of the pages of the area (PAGING_READ...)
+ * @param flags Flags of the area (MM_AREA_ANONYMOUS...)
+ * @return int 0 on success, or
+ *  -EINVAL if the range is invalid
+ *  -EEXIST if the range overlaps an existing area
+ *  -ENOMEM if there is no memory left to allocate the area
+ */
+int mm_area_insert(
+    struct mm_context *context,
+    const vaddr_t start,
+    const vaddr_t end,
+    const int access,
+    const int flags)
+{
+    if (!PAGE_ALIGNED(start) || !PAGE_ALIGNED(end) || start >= end)
+        return -EINVAL;
+    if (end > KERNEL_BASE)
+        return -EINVAL;
+
+    spin_acquire(&context->lock) {
+        return __mm_area_insert(context, start, end, access, flags);
+    }
+    _unreachable();
+}
+
+/**
+ * @brief Create the stack area of a memory context. Only the initial size
+ * is reserved, the stack will grow automatically down to MM_STACK_LIMIT.
+ * 
+ * @param context The memory context
+ * @param top The top of the stack, must be page aligned
+ * @param size The initial size of the stack
+ * @return int Same values as mm_area_insert()
+ */
+int mm_area_stack(
+    struct mm_context *context,
+    const vaddr_t top,
+    const size_t size)
+{
+    return mm_area_insert(
+        context,
+        top - align(size, PAGE_SIZE), top,
+        PAGING_READ | PAGING_WRITE,
+        MM_AREA_ANONYMOUS | MM_AREA_GROWSDOWN | MM_AREA_STACK);
+}
+
+/**
+ * @brief Copy all areas of a memory context into another one. The pages
+ * are not copied, only the description of the address space.
+ * 
+ * @param dst The destination context: it must not have any area
+ * @param src The context to copy
+ * @return int 0 on success, or
+ *  -ENOMEM if there is no memory left
+ */
+int mm_area_clone(struct mm_context *dst, struct mm_context *src)
+{
+    dst->brk_start = src->brk_start;
+    dst->brk = src->brk;
+    spin_acquire(&src->lock) {
+        list_foreach (&src->areas, entry) {
+            const struct mm_area *area =
+                list_entry(entry, struct mm_area, node);
+            struct mm_area *copy = mm_area_allocate(
+                area->start, area->end,
+                area->access,
+                area->flags);
+            if (copy == NULL) {
+                mm_area_release_all(dst);
+                return -ENOMEM;
+            }
+            list_add_tail(&dst->areas, &copy->node);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Free all areas of a memory context. The pages mapped inside the
+ * areas are not released, this is done when the page directory is destroyed.
+ * 
+ * @param context The memory context
+ */
+void mm_area_release_all(struct mm_context *context)
+{
+    spin_acquire(&context->lock) {
+        list_foreach_safe (&context->areas, entry) {
+            struct mm_area *area = list_entry(entry, struct mm_area, node);
+            list_remove(&area->node);
+            free(area);
+        }
+    }
+}
+
+/**
+ * @brief Reserve a new anonymous area in the user address space. The memory
+ * is not allocated: pages will be allocated and cleared on first touch.
+ * 
+ * @param context The memory context
+ * @param addr If MM_AREA_FIXED is set, the address where the area must be
+ * created. On success, it contains the start of the new area.
+ * @param length Length of the area
+ * @param access Access rights of the area
+ * @param flags Flags of the area, MM_AREA_ANONYMOUS is always set
+ * @return int 0 on success, or
+ *  -EINVAL if the length or the fixed address is invalid
+ *  -EEXIST if the fixed range overlaps an existing area
+ *  -ENOMEM if there is no space left in the address space or no memory left
+ */
+_export int mm_map(
+    struct mm_context *context,
+    vaddr_t *addr,
+    const size_t length,
+    const int access,
+    const int flags)
+{
+    const size_t size = align(length, PAGE_SIZE);
+    if (size == 0)
+        return -EINVAL;
+
+    spin_acquire(&context->lock) {
+        vaddr_t start = *addr;
+        if (flags & MM_AREA_FIXED) {
+            if (!PAGE_ALIGNED(start) || start < MM_USER_START)
+                return -EINVAL;
+            if (start + size > KERNEL_BASE || start + size < start)
+                return -EINVAL;
+        } else {
+            start = __mm_find_free(context, size);
+            if (start == 0)
+                return -ENOMEM;
+        }
+
+        const int ret = __mm_area_insert(
+            context,
+            start, start + size,
+            access,
+            (flags & ~MM_AREA_FIXED) | MM_AREA_ANONYMOUS);
+        if (ret < 0)
+            return ret;
+        *addr = start;
+    }
+    return 0;
+}
+
+/**
+ * @brief Remove a range of addresses from the user address space and
+ * release the pages that were mapped inside. The context must be the
+ * context currently loaded on the CPU.
+ * 
+ * @param context The memory context
+ * @param addr Start of the range, must be page aligned
+ * @param length Length of the range
+ * @return int 0 on success, or
+ *  -EINVAL if the range is invalid
+ *  -ENOMEM if an area must be split and there is no memory left
+ */
+int mm_unmap(struct mm_context *context, const vaddr_t addr, size_t length)
+{
+    length = align(length, PAGE_SIZE);
+    if (!PAGE_ALIGNED(addr) || length == 0)
+        return -EINVAL;
+    if (addr + length > KERNEL_BASE || addr + length < addr)
+        return -EINVAL;
+
+    spin_acquire(&context->lock) {
+        const int ret = __mm_area_remove(context, addr, addr + length);
+        if (ret < 0)
+            return ret;
+        paging_unmap_interval(addr, addr + length);
+    }
+    return 0;
+}
+
+/**
+ * @brief Change the end of the heap of a memory context. The heap is an
+ * anonymous area starting at brk_start: growing it only extends the area,
+ * and shrinking it releases the pages above the new end. The context must
+ * be the context currently loaded on the CPU.
+ * 
+ * @param context The memory context
+ * @param addr The new end of the heap
+ * @return int 0 on success, or
+ *  -EINVAL if the address is below the start of the heap
+ *  -ENOMEM if the heap would overlap another area or there is no memory left
+ */
+int mm_brk(struct mm_context *context, const vaddr_t addr)
+{
+    if (addr < context->brk_start || addr >= KERNEL_BASE)
+        return -EINVAL;
+
+    const vaddr_t new_end = align(addr, PAGE_SIZE);
+    const vaddr_t old_end = align(context->brk, PAGE_SIZE);
+
+    spin_acquire(&context->lock) {
+        if (new_end > old_end) {
+            if (!__mm_range_free(context, old_end, new_end))
+                return -ENOMEM;
+
+            struct mm_area *heap = NULL;
+            if (old_end > context->brk_start)
+                heap = mm_area_find(context, old_end - 1);
+            if (heap != NULL && heap->flags & MM_AREA_HEAP) {
+                heap->end = new_end;
+            } else {
+                const int ret = __mm_area_insert(
+                    context,
+                    old_end, new_end,
+                    PAGING_READ | PAGING_WRITE,
+                    MM_AREA_ANONYMOUS | MM_AREA_HEAP);
+                if (ret < 0)
+                    return -ENOMEM;
+            }
+        } else if (new_end < old_end) {
+            const int ret = __mm_area_remove(context, new_end, old_end);
+            if (ret < 0)
+                return ret;
+            paging_unmap_interval(new_end, old_end);
+        }
+        context->brk = addr;
+    }
+    return 0;
+}
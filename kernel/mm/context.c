@@ -16,10 +16,29 @@
  * You should have received a copy of the GNU General Public License
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <mm/area.h>
 #include <mm/paging.h>
 #include <mm/malloc.h>
-#include <mm/vmalloc.h>
+#include <mm/lru.h>
+#include <mm/page.h>
 #include <mm/context.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/percpu.h>
+#include <process/reaper.h>
+
+static DECLARE_SPINLOCK(contexts_lock);
+static DECLARE_LIST(contexts);
+
+// Contexts dropped but not destroyed yet, see mm_context_reap()
+static DECLARE_SPINLOCK(dead_lock);
+static DECLARE_LIST(dead_contexts);
+
+// The context loaded on each CPU, or NULL if the kernel page directory is
+// loaded. Kernel threads run on the context of the previous thread without
+// holding a reference to it, so it may belong to no running thread. Only
+// accessed by its CPU, with interrupts disabled.
+static DEFINE_PER_CPU(struct mm_context *, active);
 
 #define assert_context_is_valid(context) \
     assert(!null(context));              \
@@ -30,7 +49,8 @@
 
 /**
  * @brief Allocate a memory context, allocate a area to access
- * the page directory and initialize the usage counter to 1.
+ * the page directory and initialize the usage counter to 1. The
+ * context is created without any user area.
  * 
  * @return struct mm_context* The mm_context_t created
  * @return NULL If the allocation failed
@@ -40,12 +60,20 @@ static struct mm_context *mm_context_allocate(void)
     struct mm_context *context = malloc(sizeof(struct mm_context));
     if (context == NULL)
         return NULL;
-    context->pd = vmalloc(PAGE_SIZE, VMALLOC_MAP);
+    context->kernel_generation = paging_kernel_generation();
+    context->pd = paging_alloc_pd();
     if (context->pd == 0) {
         free(context);
         return NULL;
     }
+    context->brk_start = MM_HEAP_START;
+    context->brk = MM_HEAP_START;
+    spin_init(&context->lock);
+    list_init(&context->areas);
     context->usage = 1;
+    spin_acquire(&contexts_lock) {
+        list_add_tail(&contexts, &context->node);
+    }
     return context;
 }
 
@@ -56,13 +84,26 @@ static struct mm_context *mm_context_allocate(void)
  * @return struct mm_context* The mm_context_t cloned
  * @return NULL If the allocation failed
  */
-struct mm_context *mm_context_clone(struct mm_context *context)
+_export struct mm_context *mm_context_clone(struct mm_context *context)
 {
     assert_context_is_valid(context);
     struct mm_context *clone = mm_context_allocate();
     if (clone == NULL)
         return NULL;
-    paging_clone_pd(clone->pd, context->pd);
+    if (mm_area_clone(clone, context) < 0) {
+        spin_acquire(&contexts_lock) {
+            list_remove(&clone->node);
+        }
+        paging_release_pd(clone->pd, clone->kernel_generation);
+        free(clone);
+        return NULL;
+    }
+
+    // Other threads of the context may modify its page directory meanwhile,
+    // for example when a page table is unshared or released by a fault
+    spin_acquire(&context->lock) {
+        paging_clone_pd(context->pd, clone->pd);
+    }
     return clone;
 }
 
@@ -72,13 +113,9 @@ struct mm_context *mm_context_clone(struct mm_context *context)
  * @return struct mm_context* The memory context created
  * @return NULL If the allocation failed
  */
-struct mm_context *mm_context_create(void)
+_export struct mm_context *mm_context_create(void)
 {
-    struct mm_context *context = mm_context_allocate();
-    if (context == NULL)
-        return NULL;
-    paging_creat_pd(context->pd);
-    return context;
+    return mm_context_allocate();
 }
 
 /**
@@ -93,33 +130,163 @@ void mm_context_use(struct mm_context *context)
 }
 
 /**
- * @brief Set the current context on the CPU.
+ * @brief Increment the usage counter of a context, unless it is being
+ * dropped. Used to keep a context found with mm_context_foreach() once the
+ * list of contexts is unlocked.
+ * 
+ * @param context The context to use
+ * @return true if the usage counter was incremented, false if the context
+ * is being dropped
+ */
+bool mm_context_tryuse(struct mm_context *context)
+{
+    int usage = context->usage;
+    while (usage > 0) {
+        if (atomic_compare_exchange_weak(&context->usage, &usage, usage + 1))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Synchronize the kernel part of the page directory of a context if
+ * kernel page tables were allocated since it was last synchronized.
+ * 
+ * @param context The context to synchronize
+ */
+static void mm_context_sync(struct mm_context *context)
+{
+    const uint_t generation = paging_kernel_generation();
+    if (context->kernel_generation != generation) {
+        paging_sync_kernel_pd(context->pd);
+        context->kernel_generation = generation;
+    }
+}
+
+/**
+ * @brief Set the current context on the CPU. If kernel page tables were
+ * allocated since the page directory of the context was last synchronized,
+ * the kernel part of the page directory is synchronized first, even if the
+ * context is already loaded: the kernel stack of the next thread may live
+ * in one of those page tables, and a fault on the stack itself cannot be
+ * handled lazily. The page directory is not reloaded if the context is
+ * already loaded, so switching between threads of the same process does
+ * not flush the TLB.
+ * 
+ * The usage counter of the context is not modified: the context must be
+ * owned by the thread that will run on it.
  * 
  * @param context The context to set.
  */
-void mm_context_set(struct mm_context *context)
+_export void mm_context_set(struct mm_context *context)
 {
     assert_context_is_valid(context);
-    set_cr3(paging_get_paddr(context->pd));
+    mm_context_sync(context);
+    if (context == percpu_read(active))
+        return;
+    paging_set_pd(context->pd);
+    percpu_write(active, context);
+}
+
+/**
+ * @brief Synchronize the kernel part of the page directory loaded on the
+ * current CPU with the master kernel page directory. Called before switching
+ * to a kernel thread: it keeps the context of the previous thread, which may
+ * miss the kernel page table of its stack. Interrupts must be disabled.
+ */
+void mm_context_sync_kernel(void)
+{
+    struct mm_context *context = percpu_read(active);
+    if (context != NULL)
+        mm_context_sync(context);
 }
 
 /**
- * @brief Drop a context. The context is destroyed only if it is not
- * used anymore, otherwise the usage counter is simply decremented.
+ * @brief Load the kernel page directory on the current CPU if the given
+ * context is loaded. Interrupts must be disabled.
  * 
- * This function MUST be called when the context is currently loaded
- * into the CPU : otherwise the contexte destroyed will be the current
- * context !
+ * @param data The context to unload
+ */
+static void mm_context_unload(void *data)
+{
+    if (percpu_read(active) == data) {
+        paging_use_kernel_pd();
+        percpu_write(active, NULL);
+    }
+}
+
+/**
+ * @brief Drop a context. When the context is not used anymore, it is queued
+ * to be destroyed later by the reaper thread, otherwise the usage counter is
+ * simply decremented. This function never releases the user pages itself,
+ * so it is cheap enough to be called from the exit path.
+ * 
+ * The context does not need to be loaded on the CPU. If it is still loaded,
+ * for example because a kernel thread borrowed it or because the exiting
+ * thread is running on it, the kernel page directory is loaded instead.
+ * Other CPUs are left alone: they unload it in mm_context_reap().
  * 
- * @param context The context to destroy
+ * @param context The context to drop
  */
-void mm_context_drop(struct mm_context *context)
+_export void mm_context_drop(struct mm_context *context)
 {
     assert_context_is_valid(context);
     if (--context->usage != 0)
         return;
-    paging_destroy_userspace();
-    paging_use_kernel_pd();
-    vmfree(context->pd);
+    spin_acquire(&contexts_lock) {
+        list_remove(&context->node);
+    }
+    irq_acquire() {
+        mm_context_unload(context);
+    }
+    spin_acquire(&dead_lock) {
+        list_add_tail(&dead_contexts, &context->node);
+    }
+    reaper_wakeup();
+}
+
+/**
+ * @brief Destroy the oldest context dropped with mm_context_drop(): release
+ * all its user pages, page tables, areas and its page directory. Called by
+ * the reaper thread.
+ * 
+ * @return true if a context was destroyed, false if there is no dead context.
+ */
+bool mm_context_reap(void)
+{
+    struct mm_context *context = NULL;
+    spin_acquire(&dead_lock) {
+        if (list_empty(&dead_contexts))
+            return false;
+        context = list_entry(dead_contexts.next, struct mm_context, node);
+        list_remove(&context->node);
+    }
+
+    // Kernel threads, including the reaper, may still run on the context
+    irq_acquire() {
+        mm_context_unload(context);
+    }
+    smp_call_others(mm_context_unload, context);
+    lru_forget(context);
+    paging_destroy_userspace(context->pd);
+    mm_area_release_all(context);
+    paging_release_pd(context->pd, context->kernel_generation);
     free(context);
+    return true;
+}
+
+/**
+ * @brief Call a function for each memory context of the system. The list of
+ * contexts is locked during the iteration, so the function must not create
+ * or drop a context, and the contexts cannot be destroyed while the function
+ * runs.
+ * 
+ * @param function The function to call for each context.
+ */
+void mm_context_foreach(void (*function)(struct mm_context *))
+{
+    spin_acquire(&contexts_lock) {
+        list_foreach(&contexts, entry)
+            function(list_entry(entry, struct mm_context, node));
+    }
 }
@@ -0,0 +1,209 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <mm/area.h>
+#include <mm/huge.h>
+#include <mm/fault.h>
+#include <mm/lru.h>
+#include <mm/page.h>
+#include <mm/zram.h>
+#include <mm/paging.h>
+#include <arch/x86/exception.h>
+
+/**
+ * @brief Map a zero-filled page at the faulting address of an anonymous area.
+ * 
+ * @param context The context of the area
+ * @param area The area containing the address
+ * @param addr The faulting address
+ * @return int 0 on success, or
+ *  -ENOMEM if there is no memory left to allocate the page or to unshare
+ *  the page table
+ */
+static int mm_fault_anonymous(
+    struct mm_context *context,
+    struct mm_area *area,
+    const vaddr_t addr)
+{
+    if (paging_unshare_pt(addr) < 0)
+        return -ENOMEM;
+
+    const paddr_t page = page_alloc(PAGE_CLEAR | PAGE_HIGH);
+    if (page == 0)
+        return -ENOMEM;
+
+    const int access = area->access | PAGING_USER;
+    if (paging_map_page(PAGE_ALIGN(addr), page, access, PAGING_PRESENT) < 0) {
+        page_free(page);
+        return -ENOMEM;
+    }
+    lru_add(context, page, addr);
+    return 0;
+}
+
+/**
+ * @brief Map the shared zero page read-only at the faulting address of an
+ * anonymous area. A real page will be allocated on the first write, see
+ * mm_fault_cow().
+ * 
+ * @param area The area containing the address
+ * @param addr The faulting address
+ * @return int 0 on success, or
+ *  -ENOMEM if there is no memory left to allocate or to unshare the page
+ *  table
+ */
+static int mm_fault_zero(struct mm_area *area, const vaddr_t addr)
+{
+    if (paging_unshare_pt(addr) < 0)
+        return -ENOMEM;
+
+    const paddr_t zero = page_zero();
+    const int access = (area->access & ~PAGING_WRITE) | PAGING_USER;
+
+    page_reference(zero);
+    if (paging_map_page(PAGE_ALIGN(addr), zero, access, PAGING_PRESENT) < 0) {
+        page_free(zero);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle a write fault on a present read-only page of a writable
+ * anonymous area. If the page is the zero page, it is replaced by a new
+ * zero-filled page. If the page is shared, it is replaced by a private copy.
+ * Otherwise, the page is simply made writable. A page table shared by a
+ * clone is unshared first, and a large page write-protected by a clone is
+ * split first, so that only the written page is copied.
+ * 
+ * @param context The context of the area
+ * @param area The area containing the address
+ * @param addr The faulting address
+ * @return int 0 on success, or
+ *  -EFAULT if the address is not mapped
+ *  -ENOMEM if there is no memory left to allocate the page, to split the
+ *  large page or to unshare the page table
+ */
+static int mm_fault_cow(
+    struct mm_context *context,
+    struct mm_area *area,
+    const vaddr_t addr)
+{
+    const vaddr_t vaddr = PAGE_ALIGN(addr);
+    if (paging_split_large(vaddr) < 0)
+        return -ENOMEM;
+    if (paging_unshare_pt(vaddr) < 0)
+        return -ENOMEM;
+    const pte_t *const pte = paging_get_pte(vaddr);
+    if (pte == NULL || !pte->present)
+        return -EFAULT;
+
+    const paddr_t old = pte_get_address(pte);
+    paddr_t page = old;
+    if (old == page_zero()) {
+        page = page_alloc(PAGE_CLEAR | PAGE_HIGH);
+        if (page == 0)
+            return -ENOMEM;
+    } else if (page_counter(old) > 1) {
+        page = page_alloc(PAGE_HIGH);
+        if (page == 0)
+            return -ENOMEM;
+        page_copy(page, old);
+    }
+
+    const int access = area->access | PAGING_USER;
+    paging_remap_page(vaddr, page, access, PAGING_PRESENT);
+    if (page != old) {
+        page_free(old);
+        lru_add(context, page, vaddr);
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle a page fault on an user address, see mm_page_fault(). The
+ * context lock is held while the fault is handled.
+ */
+static int __mm_page_fault(
+    struct mm_context *context,
+    const vaddr_t addr,
+    const int error)
+{
+
+    spin_acquire(&context->lock) {
+        struct mm_area *area = mm_area_find(context, addr);
+        if (area == NULL)
+            area = mm_area_grow(context, addr);
+        if (area == NULL)
+            return -EFAULT;
+
+        if (error & PAGE_FAULT_WRITE && !(area->access & PAGING_WRITE))
+            return -EFAULT;
+        if (!(area->flags & MM_AREA_ANONYMOUS))
+            return -EFAULT;
+
+        // Pages compressed by the reclaim are restored on any access
+        if (!(error & PAGE_FAULT_PRESENT)) {
+            const int ret = zram_fault(context, area, addr);
+            if (ret != -ENOENT)
+                return ret;
+        }
+
+        // Reads are served by the shared zero page: memory is allocated
+        // only when it is written for the first time
+        if (error & PAGE_FAULT_PRESENT) {
+            if (error & PAGE_FAULT_WRITE)
+                return mm_fault_cow(context, area, addr);
+            return -EFAULT;
+        }
+        if (!(error & PAGE_FAULT_WRITE))
+            return mm_fault_zero(area, addr);
+        if (mm_huge_fault(area, addr) == 0)
+            return 0;
+        return mm_fault_anonymous(context, area, addr);
+    }
+    return -EFAULT;
+}
+
+/**
+ * @brief Handle a page fault on an user address. If the address is inside an
+ * area (or just below a stack that can grow), the page is populated according
+ * to the area flags. If there is no memory left, cold pages are reclaimed
+ * to free some memory and the fault is retried once. The context must be the
+ * context currently loaded on the CPU, and its lock must not be held.
+ * 
+ * @param context The memory context where the fault occured
+ * @param addr The faulting address
+ * @param error The error code pushed by the CPU
+ * @return int 0 if the fault was handled, or
+ *  -EFAULT if the address is not valid or the access is not allowed
+ *  -ENOMEM if there is no memory left to handle the fault
+ */
+_export int mm_page_fault(
+    struct mm_context *context,
+    const vaddr_t addr,
+    const int error)
+{
+    if (addr >= KERNEL_BASE || context == NULL)
+        return -EFAULT;
+
+    int ret = __mm_page_fault(context, addr, error);
+    if (ret == -ENOMEM && lru_reclaim(LRU_RECLAIM_PAGES, PAGE_ZONES_ALL) > 0)
+        ret = __mm_page_fault(context, addr, error);
+    return ret;
+}
@@ -0,0 +1,291 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/maths.h>
+#include <mm/page.h>
+#include <mm/huge.h>
+#include <mm/paging.h>
+#include <arch/x86/smp.h>
+#include <process/process.h>
+#include <process/schedule.h>
+
+/**
+ * @file Transparent large pages for anonymous user memory. A 4 MiB aligned
+ * region that lies entirely inside an anonymous area is mapped with a single
+ * large page when it is first touched, if physically contiguous memory is
+ * available. Regions that were populated with normal pages are promoted in
+ * the background by the collapser thread once all of their pages are mapped.
+ * 
+ * Searching contiguous memory scans the whole page table under the lock of
+ * the page allocator, so the fault handler stops trying in an area after a
+ * failure: the area is flagged with MM_AREA_NOHUGE until the collapser
+ * succeeds in promoting one of its regions.
+ */
+
+/**
+ * @brief A region found by the collapser, collapsed once the list of
+ * contexts is unlocked. The context is referenced until then.
+ */
+typedef struct mm_huge_candidate {
+    struct mm_context *context;
+    vaddr_t base;
+} mm_huge_candidate_t;
+
+static struct mm_huge_candidate candidates[MM_HUGE_SCAN_MAX];
+static uint_t nr_candidates = 0;
+
+// Pages of the region being collapsed, there is a single collapser thread
+static paddr_t sources[PAGING_LARGE_SIZE / PAGE_SIZE];
+
+/**
+ * @brief Map a large page at a faulting address of an anonymous area. The
+ * context of the area must be the context currently loaded on the CPU, and
+ * its lock must be held.
+ * 
+ * @param area The area containing the faulting address
+ * @param addr The faulting address
+ * @return int 0 on success, or
+ *  -EINVAL if the large page would not be entirely inside the area
+ *  -EEXIST if a part of the region is already mapped
+ *  -ENOMEM if there is no contiguous memory available, now or when it was
+ *  last tried in the area
+ * In case of error, the caller should fall back to a normal page.
+ */
+int mm_huge_fault(struct mm_area *area, const vaddr_t addr)
+{
+    const uint_t count = PAGING_LARGE_SIZE / PAGE_SIZE;
+    const vaddr_t base = addr & PAGING_LARGE_MASK;
+    if (base < area->start || base + PAGING_LARGE_SIZE > area->end)
+        return -EINVAL;
+    if (paging_get_pde(base)->present)
+        return -EEXIST;
+    if (area->flags & MM_AREA_NOHUGE)
+        return -ENOMEM;
+
+    const paddr_t large = page_alloc_range(
+        count,
+        PAGING_LARGE_SIZE,
+        PAGE_CLEAR | PAGE_HIGH);
+    if (large == 0) {
+        area->flags |= MM_AREA_NOHUGE;
+        return -ENOMEM;
+    }
+
+    const int access = area->access | PAGING_USER;
+    if (paging_map_large(base, large, access, PAGING_PRESENT) < 0) {
+        page_free_range(large, count);
+        return -EEXIST;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check if a region of a context is a fully populated page table of
+ * pages that are not shared with another context. The context lock must be
+ * held.
+ * 
+ * @param context The context owning the region
+ * @param base The address of the region, aligned on 4 MiB
+ * @return paddr_t The page table of the region, or 0 if the region cannot
+ * be collapsed
+ */
+static paddr_t mm_huge_region(struct mm_context *context, const vaddr_t base)
+{
+    const uint_t count = PAGING_LARGE_SIZE / PAGE_SIZE;
+    const pde_t *const pde = &((pde_t *) context->pd)[pd_offset(base)];
+    if (!pde->present || pde->large)
+        return 0;
+
+    // Page directories and page tables are reachable through the direct
+    // map, so the context does not need to be loaded
+    const paddr_t pt = pde_get_address(pde);
+    if (page_pt_count(pt) != count || page_counter(pt) != 1)
+        return 0;
+    const pte_t *const ptes = (pte_t *) phys_to_virt(pt);
+    for (uint_t i = 0; i < count; i++) {
+        if (!ptes[i].present)
+            return 0;
+        if (page_counter(pte_get_address(&ptes[i])) != 1)
+            return 0;
+    }
+    return pt;
+}
+
+/**
+ * @brief Invalidate a region of a context in the TLB of all CPUs. The
+ * context lock must be held.
+ */
+static void mm_huge_flush(struct mm_context *context, const vaddr_t base)
+{
+    if (virt_to_phys(context->pd) == PAGE_ALIGN(get_cr3()))
+        flush_tlb();
+    smp_flush_tlb(base, base + PAGING_LARGE_SIZE);
+}
+
+/**
+ * @brief Replace a fully populated page table with a large page. The pages
+ * are write-protected and flushed from all TLBs, then copied into a
+ * physically contiguous block without holding any lock. The page table is
+ * referenced meanwhile, so it cannot be reused nor reclaimed, see
+ * mm/lru.c. If a page was written or unmapped during the copy, the region
+ * is left as is. Otherwise, the large page is installed and the page table
+ * and the old pages are released. Pages shared with another context are
+ * never collapsed.
+ * 
+ * @param context The context owning the region, referenced by the caller
+ * @param base The address of the region, aligned on 4 MiB
+ * @return true if the region was collapsed, false otherwise
+ */
+static bool mm_huge_collapse(struct mm_context *context, const vaddr_t base)
+{
+    const uint_t count = PAGING_LARGE_SIZE / PAGE_SIZE;
+    const paddr_t large = page_alloc_range(
+        count,
+        PAGING_LARGE_SIZE,
+        PAGE_HIGH);
+    if (large == 0)
+        return false;
+
+    // A write to a write-protected page faults and restores its write
+    // access (see mm_fault_cow()), which is detected after the copy
+    paddr_t pt = 0;
+    spin_acquire(&context->lock) {
+        pt = mm_huge_region(context, base);
+        if (pt != 0) {
+            pte_t *const ptes = (pte_t *) phys_to_virt(pt);
+            for (uint_t i = 0; i < count; i++) {
+                sources[i] = pte_get_address(&ptes[i]);
+                ptes[i].write = 0;
+            }
+            page_reference(pt);
+            mm_huge_flush(context, base);
+        }
+    }
+    if (pt == 0) {
+        page_free_range(large, count);
+        return false;
+    }
+
+    for (uint_t i = 0; i < count; i++)
+        page_copy(large + (i << PAGE_SHIFT), sources[i]);
+
+    bool collapsed = false;
+    spin_acquire(&context->lock) {
+        pde_t *const pde = &((pde_t *) context->pd)[pd_offset(base)];
+        struct mm_area *area = mm_area_find(context, base);
+        if (area == NULL ||
+            !(area->flags & MM_AREA_ANONYMOUS) ||
+            base + PAGING_LARGE_SIZE > area->end ||
+            !pde->present || pde->large ||
+            (paddr_t) pde_get_address(pde) != pt ||
+            page_pt_count(pt) != count ||
+            page_counter(pt) != 2)
+            break;
+
+        const pte_t *const ptes = (pte_t *) phys_to_virt(pt);
+        uint_t i = 0;
+        while (i < count &&
+               ptes[i].present && !ptes[i].write &&
+               (paddr_t) pte_get_address(&ptes[i]) == sources[i] &&
+               page_counter(sources[i]) == 1)
+            i++;
+        if (i != count)
+            break;
+
+        pde_t entry = {.value = 0};
+        pde_set_address(&entry, large);
+        entry.write = !!(area->access & PAGING_WRITE);
+        entry.present = 1;
+        entry.large = 1;
+        entry.user = 1;
+        pde_copy(pde, &entry);
+        mm_huge_flush(context, base);
+
+        for (i = 0; i < count; i++)
+            page_free(sources[i]);
+        page_free(pt);
+        area->flags &= ~MM_AREA_NOHUGE;
+        collapsed = true;
+    }
+
+    page_free(pt);
+    if (!collapsed)
+        page_free_range(large, count);
+    return collapsed;
+}
+
+/**
+ * @brief Find the eligible regions of all anonymous areas of a context,
+ * until MM_HUGE_SCAN_MAX regions are found. The context is referenced once
+ * for each region found, so that the regions can be collapsed once the list
+ * of contexts is unlocked.
+ * 
+ * @param context The context to scan
+ */
+static void mm_huge_scan(struct mm_context *context)
+{
+    spin_acquire(&context->lock) {
+        list_foreach(&context->areas, entry) {
+            struct mm_area *area = list_entry(entry, struct mm_area, node);
+            if (!(area->flags & MM_AREA_ANONYMOUS))
+                continue;
+
+            for (vaddr_t base = align(area->start, PAGING_LARGE_SIZE);
+                base + PAGING_LARGE_SIZE <= area->end;
+                base += PAGING_LARGE_SIZE) {
+                if (nr_candidates == MM_HUGE_SCAN_MAX)
+                    return;
+                if (mm_huge_region(context, base) == 0)
+                    continue;
+                if (!mm_context_tryuse(context))
+                    return;
+                candidates[nr_candidates].context = context;
+                candidates[nr_candidates].base = base;
+                nr_candidates++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief The collapser thread: periodically scan all memory contexts to
+ * promote fully populated regions to large pages.
+ */
+_noreturn
+static void mm_huge_collapser(void)
+{
+    for (;;) {
+        scheduler_sleep(MM_HUGE_SCAN_PERIOD);
+        nr_candidates = 0;
+        mm_context_foreach(mm_huge_scan);
+        for (uint_t i = 0; i < nr_candidates; i++) {
+            mm_huge_collapse(candidates[i].context, candidates[i].base);
+            mm_context_drop(candidates[i].context);
+        }
+    }
+}
+
+/**
+ * @brief Start the collapser thread. Must be called after the process
+ * subsystem is initialized.
+ */
+_init void mm_huge_setup(void)
+{
+    if (process_creat_kthread(mm_huge_collapser) == NULL)
+        warn("Failed to start the large pages collapser");
+}
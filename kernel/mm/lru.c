@@ -0,0 +1,595 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/list.h>
+#include <lib/maths.h>
+#include <lib/spinlock.h>
+#include <mm/lru.h>
+#include <mm/context.h>
+#include <mm/page.h>
+#include <mm/zram.h>
+#include <mm/paging.h>
+#include <arch/x86/smp.h>
+#include <process/process.h>
+#include <process/schedule.h>
+
+/**
+ * @file LRU lists of user pages. Anonymous pages mapped by the page fault
+ * handler are added to the active list, with a reverse mapping to the page
+ * table entry that maps them. Pages are aged with the accessed bit of this
+ * entry, like a clock: the pages at the end of the active list that were
+ * not accessed since the last scan are moved to the inactive list, and the
+ * pages at the end of the inactive list that are still not accessed are
+ * compressed (see mm/zram.c). Pages accessed in the meantime go back to the
+ * head of the active list.
+ * 
+ * The reclaim is done in the background by kswapd, woken up by the page
+ * allocator when the free memory of a zone falls below its low watermark, and
+ * directly by the page fault handler when an allocation fails.
+ * 
+ * Page table entries are modified with the LRU lock and the lock of the
+ * context that owns the page table held. The page fault handler takes the
+ * LRU lock with the context lock held, so the context lock is only tried
+ * here and the pages of a busy context are skipped. The TLB of the other
+ * CPUs is flushed once per batch of pages: the pages are write-protected
+ * and flushed before they are compressed, so that no write can be lost, and
+ * flushed again once their swap entries are set, before they are freed. The
+ * pages are compressed without the LRU lock, on the isolated list.
+ */
+
+/**
+ * @brief A range of user addresses whose TLB entries must be invalidated on
+ * the other CPUs, see lru_flush().
+ */
+typedef struct lru_flush {
+    vaddr_t start;
+    vaddr_t end;
+} lru_flush_t;
+
+static DECLARE_SPINLOCK(lock);
+static DECLARE_LIST(active_list);
+static DECLARE_LIST(inactive_list);
+static DECLARE_LIST(isolated_list);     // Inactive pages being reclaimed
+static uint_t nr_active = 0;
+static uint_t nr_inactive = 0;
+static thread_t *kswapd = NULL;
+
+/**
+ * @brief Insert a page at the head of the active or the inactive list. The
+ * lock must be held.
+ */
+static void __lru_add(struct page_info *page, const bool active)
+{
+    page->active = active;
+    page->lru = 1;
+    if (active) {
+        list_add_head(&active_list, &page->entry);
+        nr_active++;
+    } else {
+        list_add_head(&inactive_list, &page->entry);
+        nr_inactive++;
+    }
+}
+
+/**
+ * @brief Add a page to the active list. The page must have just been mapped
+ * at the given address of the current address space, with a normal page
+ * table entry.
+ * 
+ * @param context The context of the current address space
+ * @param paddr The physical page
+ * @param vaddr The address where the page is mapped
+ */
+void lru_add(
+    struct mm_context *context,
+    const paddr_t paddr,
+    const vaddr_t vaddr)
+{
+    struct page_info *const page = page_get(paddr);
+    const pde_t *const pde = paging_get_pde(vaddr);
+    assert(pde->present && !pde->large);
+    spin_acquire(&lock) {
+        assert(!page->lru);
+        page->rmap_context = context;
+        page->rmap_pt = pde_get_address(pde);
+        page->rmap_vaddr = PAGE_ALIGN(vaddr);
+        __lru_add(page, true);
+    }
+}
+
+/**
+ * @brief Remove a page from its LRU list. The lock must be held.
+ */
+static void __lru_del(struct page_info *page)
+{
+    list_remove(&page->entry);
+    if (page->active)
+        nr_active--;
+    else
+        nr_inactive--;
+    page->active = 0;
+    page->lru = 0;
+}
+
+/**
+ * @brief Remove a page from its LRU list, when it is freed.
+ * 
+ * @param page The page to remove
+ */
+void lru_del(struct page_info *page)
+{
+    spin_acquire(&lock) {
+        if (page->lru)
+            __lru_del(page);
+    }
+}
+
+/**
+ * @brief Remove the pages of a list whose reverse mapping belongs to a
+ * context. The lock must be held.
+ */
+static void __lru_forget(struct list_head *list, struct mm_context *context)
+{
+    list_foreach_safe(list, entry) {
+        struct page_info *page = list_entry(entry, struct page_info, entry);
+        if (page->rmap_context == context)
+            __lru_del(page);
+    }
+}
+
+/**
+ * @brief Remove all the pages whose reverse mapping belongs to a context,
+ * before the context is destroyed. Most of them are freed with the context
+ * anyway, but pages shared with a clone may outlive it, and their reverse
+ * mapping must not refer to the context anymore.
+ * 
+ * @param context The context being destroyed
+ */
+void lru_forget(struct mm_context *context)
+{
+    spin_acquire(&lock) {
+        __lru_forget(&active_list, context);
+        __lru_forget(&inactive_list, context);
+        __lru_forget(&isolated_list, context);
+    }
+}
+
+/**
+ * @brief Move a page to the head of the active or the inactive list. The
+ * lock must be held.
+ */
+static void lru_move(struct page_info *page, const bool active)
+{
+    __lru_del(page);
+    __lru_add(page, active);
+}
+
+/**
+ * @brief Get the page table entry that maps a page of a LRU list. Page
+ * tables are always reachable through the direct map.
+ */
+static pte_t *lru_pte(const struct page_info *page)
+{
+    pte_t *const pt = (pte_t *) phys_to_virt(page->rmap_pt);
+    return &pt[pt_offset(page->rmap_vaddr)];
+}
+
+/**
+ * @brief Check if the page table of a page is used by the address space
+ * loaded on the CPU: in that case, the TLB entry of the page must be
+ * invalidated when its page table entry is modified.
+ */
+static bool lru_loaded(const struct page_info *page)
+{
+    const pde_t *const pde = paging_get_pde(page->rmap_vaddr);
+    return pde->present && !pde->large &&
+        (paddr_t) pde_get_address(pde) == page->rmap_pt;
+}
+
+/**
+ * @brief Try to lock the context that owns the page table of a page. The
+ * context cannot be destroyed while the page is linked in a list, because
+ * its pages are removed from the LRU lists before it is freed. The lock
+ * must be held.
+ * 
+ * @return true if the context is locked
+ */
+static bool lru_lock_context(const struct page_info *page)
+{
+    return spin_trylock(&page->rmap_context->lock);
+}
+
+/**
+ * @brief Unlock the context locked with lru_lock_context().
+ */
+static void lru_unlock_context(const struct page_info *page)
+{
+    spin_unlock(&page->rmap_context->lock);
+}
+
+/**
+ * @brief Invalidate the TLB entry of a page whose page table entry was
+ * modified on the current CPU, and add it to the range to invalidate on the
+ * other CPUs.
+ */
+static void lru_invalidate(
+    const struct page_info *page,
+    struct lru_flush *flush)
+{
+    if (lru_loaded(page))
+        invlpg(page->rmap_vaddr);
+    if (flush->start >= flush->end) {
+        flush->start = page->rmap_vaddr;
+        flush->end = page->rmap_vaddr + PAGE_SIZE;
+    } else {
+        flush->start = min(flush->start, page->rmap_vaddr);
+        flush->end = max(flush->end, page->rmap_vaddr + PAGE_SIZE);
+    }
+}
+
+/**
+ * @brief Invalidate the range collected with lru_invalidate() on the other
+ * CPUs, with a single shootdown, and empty the range.
+ */
+static void lru_flush(struct lru_flush *flush)
+{
+    if (flush->start < flush->end)
+        smp_flush_tlb(flush->start, flush->end);
+    flush->start = 0;
+    flush->end = 0;
+}
+
+/**
+ * @brief Check if the reverse mapping of a page is still valid. A page
+ * shared after a clone (see paging_unshare_pt()) stays in the LRU lists
+ * when it is unmapped from the page table of its reverse mapping, because
+ * it is still mapped elsewhere: such a page is removed from the lists by
+ * the caller, since it cannot be found anymore. The context lock must be
+ * held.
+ * 
+ * The page table of the reverse mapping may have been released and reused
+ * since, so it is only accessed if the page directory of the context still
+ * refers to it: the context holds a reference on it, and its lock keeps it
+ * in place.
+ */
+static bool lru_mapped(const struct page_info *page)
+{
+    const paddr_t paddr = page_index_to_address(page->index);
+    const pde_t *const pd = (pde_t *) page->rmap_context->pd;
+    const pde_t *const pde = &pd[pd_offset(page->rmap_vaddr)];
+    if (!pde->present || pde->large ||
+        (paddr_t) pde_get_address(pde) != page->rmap_pt)
+        return false;
+    const pte_t *const pte = lru_pte(page);
+    return pte->present && (paddr_t) pte_get_address(pte) == paddr;
+}
+
+/**
+ * @brief Test and clear the accessed bit of a page. The context lock must
+ * be held. Only the TLB of the current CPU is invalidated: a stale entry on
+ * another CPU hides the next accesses until it is evicted, which only makes
+ * the page look colder than it is. A page is always write-protected and
+ * flushed on all CPUs before it is compressed.
+ * 
+ * @return true if the page was accessed since the last call
+ */
+static bool lru_referenced(const struct page_info *page)
+{
+    pte_t *const pte = lru_pte(page);
+    if (!pte->accessed)
+        return false;
+    pte->accessed = 0;
+    if (lru_loaded(page))
+        invlpg(page->rmap_vaddr);
+    return true;
+}
+
+/**
+ * @brief Age the pages at the end of the active list: pages accessed since
+ * the last scan are moved back to the head of the active list, and the
+ * others to the inactive list. Pages of a busy context are kept active,
+ * and pages that are not mapped by their reverse mapping anymore are
+ * removed from the lists. The lock must be held.
+ * 
+ * @param count The number of pages to scan
+ * @return uint_t The number of pages scanned
+ */
+static uint_t lru_shrink_active(const uint_t count)
+{
+    uint_t i = 0;
+    for (; i < count && !list_empty(&active_list); i++) {
+        struct page_info *page = list_entry(
+            active_list.prev,
+            struct page_info,
+            entry);
+        if (!lru_lock_context(page)) {
+            lru_move(page, true);
+            continue;
+        }
+        if (lru_mapped(page))
+            lru_move(page, lru_referenced(page));
+        else
+            __lru_del(page);
+        lru_unlock_context(page);
+    }
+    return i;
+}
+
+/**
+ * @brief Check if a page can be reclaimed: it must be mapped once, by a
+ * page table that is not shared. The context lock must be held.
+ * 
+ * @param page The page to check
+ * @param refs The references expected on the page: 1 for its mapping, plus
+ * 1 if it is isolated, see lru_isolate()
+ */
+static bool lru_private(const struct page_info *page, const int refs)
+{
+    const paddr_t paddr = page_index_to_address(page->index);
+    return page_counter(paddr) == refs && page_counter(page->rmap_pt) == 1;
+}
+
+/**
+ * @brief Isolate a page of the inactive list to reclaim it: if the page was
+ * not accessed and is not shared, its page table entry is write-protected
+ * and the page is moved to the isolated list, where it is still counted as
+ * inactive. Otherwise, the page is moved to the active list, rotated if its
+ * context is busy, or removed from the lists if it is not mapped by its
+ * reverse mapping anymore. The lock must be held. If the page is not reclaimed
+ * in the end, it stays write-protected until its next write fault, see
+ * mm_fault_cow().
+ * 
+ * An isolated page is referenced, so that it cannot be freed and reused
+ * while it is compressed without the lock. Its mapping holds a reference
+ * and the context lock is held, so the page lock is never waited for by a
+ * page_free() waiting for the LRU lock.
+ * 
+ * @param page The page to isolate
+ * @param flush The range to invalidate on the other CPUs
+ * @return true if the page was isolated
+ */
+static bool lru_isolate(struct page_info *page, struct lru_flush *flush)
+{
+    if (!lru_lock_context(page)) {
+        lru_move(page, false);
+        return false;
+    }
+    if (!lru_mapped(page)) {
+        __lru_del(page);
+        lru_unlock_context(page);
+        return false;
+    }
+
+    const bool reclaim = !lru_referenced(page) && lru_private(page, 1);
+    if (reclaim) {
+        pte_t *const pte = lru_pte(page);
+        if (pte->write) {
+            pte->write = 0;
+            lru_invalidate(page, flush);
+        }
+        page_reference(page_index_to_address(page->index));
+        list_remove(&page->entry);
+        list_add_tail(&isolated_list, &page->entry);
+    } else {
+        lru_move(page, true);
+    }
+    lru_unlock_context(page);
+    return reclaim;
+}
+
+/**
+ * @brief Replace the page table entry of an isolated page by the swap entry
+ * of its compressed copy. The page is removed from the LRU lists if the
+ * entry is unchanged since the page was isolated. Otherwise, the page was
+ * written, shared or unmapped in the meantime: the copy is released and the
+ * page is moved to the active list. The lock must be held.
+ * 
+ * @param page The isolated page
+ * @param slot The slot of the compressed copy
+ * @param flush The range to invalidate on the other CPUs
+ * @return true if the page was reclaimed and must be freed by the caller
+ * once the other CPUs are flushed and the lock is released
+ */
+static bool lru_unmap(
+    struct page_info *page,
+    const uint_t slot,
+    struct lru_flush *flush)
+{
+    if (lru_lock_context(page)) {
+        pte_t *const pte = lru_pte(page);
+        const bool unchanged = lru_mapped(page) && !pte->write &&
+            lru_private(page, 2);
+        if (unchanged) {
+            pte_set_swap(pte, slot);
+            lru_invalidate(page, flush);
+            __lru_del(page);
+        }
+        lru_unlock_context(page);
+        if (unchanged)
+            return true;
+    }
+    zram_free(slot);
+    lru_move(page, true);
+    return false;
+}
+
+/**
+ * @brief Isolate a batch of pages at the end of the inactive list, and
+ * write-protect them. The lock must be held.
+ * 
+ * @param victims Where to store the isolated pages, of LRU_BATCH entries
+ * @param target The number of pages to isolate, at most LRU_BATCH
+ * @param zones A mask of the zones to reclaim pages from
+ * @param scanned Incremented by the number of pages scanned
+ * @param flush The range to invalidate on the other CPUs
+ * @return uint_t The number of pages isolated
+ */
+static uint_t lru_isolate_batch(
+    struct page_info **victims,
+    const uint_t target,
+    const uint_t zones,
+    uint_t *scanned,
+    struct lru_flush *flush)
+{
+    uint_t nr = 0;
+    for (uint_t i = 0; i < LRU_BATCH && nr < target; i++) {
+        if (list_empty(&inactive_list))
+            break;
+        struct page_info *page = list_entry(
+            inactive_list.prev,
+            struct page_info,
+            entry);
+        const paddr_t paddr = page_index_to_address(page->index);
+        if (!(zones & (1 << page_zone(paddr))))
+            lru_move(page, false);
+        else if (lru_isolate(page, flush))
+            victims[nr++] = page;
+        (*scanned)++;
+    }
+    return nr;
+}
+
+/**
+ * @brief Reclaim a batch of isolated pages. The pages are compressed
+ * without the lock, since they cannot be written once their write-protection
+ * is visible to all CPUs, then unmapped with the lock held. The lock must
+ * not be held.
+ * 
+ * @param victims The pages isolated with lru_isolate_batch()
+ * @param nr The number of isolated pages
+ * @return uint_t The number of pages reclaimed
+ */
+static uint_t lru_reclaim_batch(struct page_info **victims, const uint_t nr)
+{
+    struct lru_flush flush = {0, 0};
+    int slots[LRU_BATCH];
+    for (uint_t i = 0; i < nr; i++)
+        slots[i] = zram_store(page_index_to_address(victims[i]->index));
+
+    spin_acquire(&lock) {
+        for (uint_t i = 0; i < nr; i++) {
+            struct page_info *page = victims[i];
+            if (!page->lru) {
+                // Its context was destroyed meanwhile, see lru_forget()
+                if (slots[i] >= 0)
+                    zram_free(slots[i]);
+                slots[i] = -1;
+            } else if (slots[i] < 0) {
+                lru_move(page, true);
+            } else if (!lru_unmap(page, slots[i], &flush)) {
+                slots[i] = -1;
+            }
+        }
+    }
+
+    // The TLB entries of the reclaimed pages were invalidated on all CPUs:
+    // their mapping and the reference taken by lru_isolate() are dropped
+    lru_flush(&flush);
+    uint_t reclaimed = 0;
+    for (uint_t i = 0; i < nr; i++) {
+        const paddr_t paddr = page_index_to_address(victims[i]->index);
+        if (slots[i] >= 0) {
+            page_free(paddr);
+            reclaimed++;
+        }
+        page_free(paddr);
+    }
+    return reclaimed;
+}
+
+/**
+ * @brief Reclaim cold pages until the target is reached, or until
+ * LRU_SCAN_MAX pages were scanned. The active list is aged when it is
+ * larger than the inactive list. Inactive pages outside the given zones are
+ * skipped and rotated to the head of the inactive list. The lock of the
+ * current memory context must not be held.
+ * 
+ * @param target The number of pages to reclaim
+ * @param zones A mask of the zones to reclaim pages from (see
+ * page_zones_below())
+ * @return uint_t The number of pages reclaimed
+ */
+_export uint_t lru_reclaim(const uint_t target, const uint_t zones)
+{
+    struct page_info *victims[LRU_BATCH];
+    uint_t reclaimed = 0;
+    uint_t scanned = 0;
+
+    while (reclaimed < target && scanned < LRU_SCAN_MAX) {
+        struct lru_flush flush = {0, 0};
+        const uint_t last = scanned;
+        uint_t nr = 0;
+        spin_acquire(&lock) {
+            if (nr_inactive < nr_active)
+                scanned += lru_shrink_active(LRU_BATCH);
+            nr = lru_isolate_batch(
+                victims,
+                min(target - reclaimed, (uint_t) LRU_BATCH),
+                zones,
+                &scanned,
+                &flush);
+        }
+
+        // The pages cannot be modified once the write-protection is visible
+        // to all CPUs
+        lru_flush(&flush);
+        reclaimed += lru_reclaim_batch(victims, nr);
+        if (scanned == last)
+            break;
+    }
+    return reclaimed;
+}
+
+/**
+ * @brief The kswapd thread: when woken up, reclaim pages until the free
+ * memory of every zone is above its high watermark or nothing can be
+ * reclaimed anymore.
+ */
+_noreturn
+static void kswapd_main(void)
+{
+    for (;;) {
+        scheduler_sleep(KSWAPD_PERIOD);
+        uint_t zones;
+        while ((zones = page_zones_below(PAGE_WMARK_HIGH)) != 0) {
+            if (lru_reclaim(LRU_BATCH, zones) == 0)
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Wake up kswapd, if it is started. Can be called with preemption
+ * disabled.
+ */
+void kswapd_wakeup(void)
+{
+    if (kswapd != NULL)
+        scheduler_wakeup(kswapd);
+}
+
+/**
+ * @brief Start kswapd. Must be called after the process subsystem is
+ * initialized.
+ */
+_init void kswapd_setup(void)
+{
+    kswapd = process_creat_kthread(kswapd_main);
+    if (kswapd == NULL)
+        warn("Failed to start kswapd");
+}
@@ -21,6 +21,7 @@
 #include <lib/maths.h>
 #include <lib/memory.h>
 #include <lib/spinlock.h>
+#include <mm/lru.h>
 #include <mm/page.h>
 #include <arch/x86/paging.h>
 
@@ -36,32 +37,66 @@
  * But for my kernel, it is not a problem because I don't need to allocate 
  * contiguous pages :)
  * 
+ * Free pages are split between memory zones (see PAGE_ZONE_*), each with
+ * its own free list, watermarks and counters. All zones are protected by
+ * the same lock.
+ * 
  * TODO: Fix potential concurrency issues by using a lock or an atomic counter
  */
+struct page_zone {
+    struct list_head free_list;
+    struct page_zone_stats stats;
+};
+
 static struct page_table_info table;
-static DECLARE_LIST(bios_free_list);
-static DECLARE_LIST(isa_free_list);
-static DECLARE_LIST(free_list);
+static struct page_zone zones[PAGE_ZONE_COUNT] = {
+    [PAGE_ZONE_BIOS].stats.name = "bios",
+    [PAGE_ZONE_ISA].stats.name = "isa",
+    [PAGE_ZONE_NORMAL].stats.name = "normal",
+    [PAGE_ZONE_HIGH].stats.name = "high",
+};
 static DECLARE_SPINLOCK(lock);
+static paddr_t zero_page = 0;
+
+// Part of the zone kept for allocations that prefer it: present / ratio,
+// or nothing if the ratio is 0. The BIOS zone is small and needed by real
+// mode code, so it is never used by fallbacks
+static const uint_t reserve_ratio[PAGE_ZONE_COUNT] = {1, 4, 32, 0};
 
 extern const char _end;
 static const vaddr_t end = (vaddr_t) &_end;
 
-static struct page_info *page_get(paddr_t paddr)
+struct page_info *page_get(const paddr_t paddr)
 {
     if (paddr >= table.nb_pages * PAGE_SIZE)
         return NULL;
     return &table.pages[page_address_to_index(paddr)];
 }
 
+static int page_zone_index(const struct page_info *info)
+{
+    if (info->bios)
+        return PAGE_ZONE_BIOS;
+    if (info->isa)
+        return PAGE_ZONE_ISA;
+    if (info->high)
+        return PAGE_ZONE_HIGH;
+    return PAGE_ZONE_NORMAL;
+}
+
 static void page_insert_free_list(struct page_info * info)
 {
-    if(info->bios) 
-        list_add_tail(&bios_free_list, &info->entry);
-    else if (info->isa)
-        list_add_tail(&isa_free_list, &info->entry);
-    else 
-        list_add_tail(&free_list, &info->entry);
+    struct page_zone *const zone = &zones[page_zone_index(info)];
+    list_add_tail(&zone->free_list, &info->entry);
+    zone->stats.free++;
+}
+
+static void page_remove_free_list(struct page_info *info)
+{
+    if (list_empty(&info->entry))
+        return;
+    list_remove(&info->entry);
+    zones[page_zone_index(info)].stats.free--;
 }
 
 /**
@@ -136,11 +171,19 @@ _init void page_mark_free_area(const struct mb_mmap *const entry)
 
 _init void page_construct_lists(void)
 {
+    for (int i = 0; i < PAGE_ZONE_COUNT; i++) {
+        list_init(&zones[i].free_list);
+        zones[i].stats.present = 0;
+        zones[i].stats.free = 0;
+    }
+
     for (size_t i = 0; i < table.nb_pages; i++) {
         list_entry_init(&table.pages[i].entry);
-        if (table.pages[i].reserved || table.pages[i].count)
+        if (table.pages[i].reserved)
             continue;
-        page_insert_free_list(&table.pages[i]);
+        zones[page_zone_index(&table.pages[i])].stats.present++;
+        if (table.pages[i].count == 0)
+            page_insert_free_list(&table.pages[i]);
     }
 }
 
@@ -156,7 +199,7 @@ _init void page_reserve(const paddr_t addr)
     if (page->count)
         panic("Page %p is used and cannot be reserved", page);
 
-    list_remove(&page->entry);
+    page_remove_free_list(page);
     page->reserved = 1;
 }
 
@@ -169,29 +212,36 @@ _init void page_use(const paddr_t addr)
         panic("Page %p is reserved and cannot be used", page);
     if (page->count != 0)
         panic("Page %p is already used", page);
-    list_remove(&page->entry);
+    page_remove_free_list(page);
     page->count = 1;
 }
 
+/**
+ * @brief Access the page array through the direct map, once the kernel
+ * page directory is loaded.
+ */
 _init void page_map_table(void)
 {
-    const vaddr_t length = table.nb_pages * sizeof(page_info_t);
+    const paddr_t length = table.nb_pages * sizeof(page_info_t);
     const paddr_t array = (const paddr_t) table.pages;
-    const vaddr_t start = end;
-    for (vaddr_t i = 0; i < length; i += PAGE_SIZE) {
-        paging_map_page(
-            start + i,
-            array + i,
-            PAGING_READ | PAGING_WRITE,
-            PAGING_PRESENT);
-    }
+    if (highmem(array + length - 1))
+        panic("The page array is not in the direct map");
 
-    table.pages = (page_info_t *) start;
+    table.pages = (page_info_t *) phys_to_virt(array);
     // Rebuild linked lists
-    list_init(&bios_free_list);
-    list_init(&isa_free_list);
-    list_init(&free_list);
     page_construct_lists();
+
+    // The memory used until the end of the boot is small enough to compute
+    // the watermarks from the free memory now
+    for (int i = 0; i < PAGE_ZONE_COUNT; i++) {
+        struct page_zone_stats *const stats = &zones[i].stats;
+        const uint_t min = stats->free / PAGE_WMARK_RATIO;
+        stats->watermarks[PAGE_WMARK_MIN] = min;
+        stats->watermarks[PAGE_WMARK_LOW] = min * 2;
+        stats->watermarks[PAGE_WMARK_HIGH] = min * 3;
+        if (reserve_ratio[i] != 0)
+            stats->reserve = stats->present / reserve_ratio[i];
+    }
 }
 
 /**
@@ -217,11 +267,14 @@ _init void page_setup(struct mb_info *info)
         table.pages[i].reserved = 1;
         table.pages[i].count = 0;
         table.pages[i].flags = 0;
+        table.pages[i].pt_count = 0;
         table.pages[i].index = i;
         if (i < page_address_to_index(0x100000))
             table.pages[i].bios = 1;
         if (i < page_address_to_index(0x1000000))
             table.pages[i].isa = 1;
+        if (i >= page_address_to_index(DIRECT_MAP_SIZE))
+            table.pages[i].high = 1;
     }
 
     for_each_mmap(info->mmap_addr, info->mmap_length, page_mark_free_area);
@@ -243,11 +296,151 @@ _init void page_setup(struct mb_info *info)
  */
 static void page_clear(paddr_t paddr)
 {
-    static char buffer[PAGE_SIZE] _align(PAGE_SIZE);
+    const vaddr_t page = kmap_atomic(paddr);
+    memzero((void *) page, PAGE_SIZE);
+    kunmap_atomic(page);
+}
 
-    paging_unmap_page((vaddr_t) buffer);
-    paging_map_page((vaddr_t) buffer, paddr, PAGING_WRITE, PAGING_PRESENT);
-    memzero(buffer, PAGE_SIZE);
+/**
+ * @brief Copy the content of a physical page into another one
+ * 
+ * @param dst Address of the destination page, must be aligned on PAGE_SIZE
+ * @param src Address of the source page, must be aligned on PAGE_SIZE
+ */
+_export void page_copy(const paddr_t dst, const paddr_t src)
+{
+    const vaddr_t d = kmap_atomic(dst);
+    const vaddr_t s = kmap_atomic(src);
+    memcpy((void *) d, (void *) s, PAGE_SIZE);
+    kunmap_atomic(s);
+    kunmap_atomic(d);
+}
+
+/**
+ * @brief Allocate the shared zero page. Must be called once the kernel page
+ * directory is loaded and the page array is mapped.
+ */
+_init void page_zero_setup(void)
+{
+    zero_page = page_alloc(PAGE_CLEAR);
+    if (zero_page == 0)
+        panic("Failed to allocate the zero page");
+}
+
+/**
+ * @brief Get the shared zero page: a page filled with zeros that must never
+ * be written. It can be mapped read-only anywhere, each mapping holding a
+ * reference like any other page (see page_reference() and page_free()).
+ * The page itself is never released.
+ * 
+ * @return paddr_t The physical address of the zero page
+ */
+_export paddr_t page_zero(void)
+{
+    return zero_page;
+}
+
+/**
+ * @brief Get the zone of a physical page.
+ * 
+ * @param addr Address of the page
+ * @return int The zone of the page (PAGE_ZONE_*), or -EINVAL if the page
+ * does not exist
+ */
+_export int page_zone(const paddr_t addr)
+{
+    const page_info_t *const page = page_get(PAGE_ALIGN(addr));
+    if (page == NULL)
+        return -EINVAL;
+    return page_zone_index(page);
+}
+
+/**
+ * @brief Get the zones whose free memory is below a watermark. When the
+ * free memory of a zone falls below the low watermark, the reclaim thread
+ * is woken up and reclaims pages of the zone until its free memory is
+ * above the high watermark. Empty zones are never reported.
+ * 
+ * @param wmark PAGE_WMARK_MIN, PAGE_WMARK_LOW or PAGE_WMARK_HIGH
+ * @return uint_t A mask of zones, with the bit (1 << PAGE_ZONE_*) set for
+ * each zone below the watermark
+ */
+_export uint_t page_zones_below(const int wmark)
+{
+    assert(wmark >= PAGE_WMARK_MIN && wmark <= PAGE_WMARK_HIGH);
+    uint_t mask = 0;
+    for (int i = 0; i < PAGE_ZONE_COUNT; i++) {
+        const struct page_zone_stats *const stats = &zones[i].stats;
+        if (stats->present != 0 && stats->free < stats->watermarks[wmark])
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+/**
+ * @brief Get a copy of the state and the counters of a memory zone.
+ * 
+ * @param zone The zone (PAGE_ZONE_*)
+ * @param info Where to copy the state of the zone
+ * @return int 0 on success, or
+ *  -EINVAL if the zone does not exist
+ */
+_export int page_get_zone_stats(
+    const int zone,
+    struct page_zone_stats *info)
+{
+    if (zone < 0 || zone >= PAGE_ZONE_COUNT)
+        return -EINVAL;
+    spin_acquire(&lock) {
+        *info = zones[zone].stats;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the zone preferred by an allocation: the highest zone allowed
+ * by the flags that is not empty.
+ * 
+ * @param flags Flags of the allocation
+ * @return int The preferred zone
+ */
+static int page_preferred_zone(const int flags)
+{
+    int zone = PAGE_ZONE_NORMAL;
+    if (flags & PAGE_BIOS)
+        zone = PAGE_ZONE_BIOS;
+    else if (flags & PAGE_ISA)
+        zone = PAGE_ZONE_ISA;
+    else if (flags & PAGE_HIGH)
+        zone = PAGE_ZONE_HIGH;
+    while (zone > PAGE_ZONE_BIOS && zones[zone].stats.present == 0)
+        zone--;
+    return zone;
+}
+
+/**
+ * @brief Check if a zone can give pages to an allocation that prefers a
+ * higher zone. The lock must be held.
+ * 
+ * @param zone The zone
+ * @param count Number of pages needed
+ * @return true if the zone keeps its min watermark and its reserve
+ */
+static bool page_fallback_allowed(const struct page_zone *zone, uint_t count)
+{
+    const struct page_zone_stats *const stats = &zone->stats;
+    return stats->free >= 
+        stats->watermarks[PAGE_WMARK_MIN] + stats->reserve + count;
+}
+
+/**
+ * @brief Get the end of the physical memory managed by the page allocator
+ * 
+ * @return paddr_t The address following the last physical page
+ */
+_export paddr_t page_memory_end(void)
+{
+    return table.nb_pages * PAGE_SIZE;
 }
 
 /**
@@ -268,50 +461,190 @@ _export int page_counter(const paddr_t addr)
 
 
 /**
- * Incremente the reference counter of a page.
+ * Incremente the reference counter of a page. The counter is modified with
+ * the page lock held, like in page_free(), so that a page referenced on a
+ * CPU cannot be freed by another CPU meanwhile.
  * @param page The physical address of the page.
- * @return The physical address of the page, aligned to PAGE_SIZE.
  */
 _export void page_reference(const paddr_t addr)
 {
-    page_info_t *const page = page_get(addr);
-    if (page->count++ == 0)
-        panic("Trying to reference a free page");
+    page_info_t *const page = page_get(PAGE_ALIGN(addr));
+    spin_acquire(&page->lock) {
+        if (page->count == 0)
+            panic("Trying to reference a free page");
+        page->count++;
+    }
+}
+
+/**
+ * Decremente the reference counter of a page that is still referenced
+ * elsewhere, so it is never freed. The page must be locked with page_lock():
+ * unlike page_free(), the counter can be checked and decremented atomically.
+ * @param page The physical address of the page.
+ */
+_export void page_dereference(const paddr_t addr)
+{
+    page_info_t *const page = page_get(PAGE_ALIGN(addr));
+    if (page->count <= 1)
+        panic("Trying to dereference the last reference of a page");
+    page->count--;
 }
 
 /**
- * Allocation a page and return the address of the allocated page.
+ * Allocation a page and return the address of the allocated page. The page
+ * is taken from the zone preferred by the flags, or from a lower zone if it
+ * does not keep its reserve (see page_fallback_allowed()). When the free
+ * memory of the zone falls below its low watermark, the reclaim thread is
+ * woken up: the allocation itself never waits for memory to be reclaimed.
  * @param flags Flags 
- * @return The physical address of the allocated page.
+ * @return The physical address of the allocated page, or 0 if there is no
+ * free page.
  */
 _export paddr_t page_alloc(const int flags)
 {
+    const int preferred = page_preferred_zone(flags);
+    struct page_zone *zone = NULL;
     page_info_t *page = NULL;
     paddr_t paddr = 0;
+    bool low = false;
 
     spin_acquire(&lock) {
-        struct list_head *list = &free_list;
-        if (flags & PAGE_ISA || list_empty(list))
-            list = &isa_free_list;
-        if (flags & PAGE_BIOS || list_empty(list))
-            list = &bios_free_list;
-        if (list_empty(list)) {
-            error("No free pages");
+        for (int i = preferred; i >= PAGE_ZONE_BIOS; i--) {
+            if (list_empty(&zones[i].free_list))
+                continue;
+            if (i == preferred || page_fallback_allowed(&zones[i], 1)) {
+                zone = &zones[i];
+                break;
+            }
+        }
+        if (zone == NULL) {
+            zones[preferred].stats.failures++;
+            error("No free pages in the %s zone", zones[preferred].stats.name);
+            kswapd_wakeup();
             return 0;
         }
 
-        page = container_of(list->next, page_info_t, entry);
+        page = container_of(zone->free_list.next, page_info_t, entry);
         paddr = page_index_to_address(page->index);
-        list_remove(&page->entry);
+        page_remove_free_list(page);
+        zone->stats.allocs++;
+        if (zone != &zones[preferred])
+            zone->stats.fallbacks++;
+        low = zone->stats.free < zone->stats.watermarks[PAGE_WMARK_LOW];
     }
+
+    if (low)
+        kswapd_wakeup();
     
     if (flags & PAGE_CLEAR && !page->cleared)
         page_clear(paddr);
     page->cleared = 0;
+    page->pt_count = 0;
     page->count = 1;
     return paddr;
 }
 
+/**
+ * @brief Check if a page can be used to satisfy a contiguous allocation.
+ * The lock must be held.
+ * 
+ * @param page The page to check
+ * @param preferred The zone preferred by the allocation
+ * @param count Number of pages of the allocation
+ * @return true if the page is free and in an allowed zone, false otherwise
+ */
+static bool page_range_eligible(
+    const page_info_t *page,
+    const int preferred,
+    const uint_t count)
+{
+    if (page->reserved || page->count != 0)
+        return false;
+    const int zone = page_zone_index(page);
+    if (zone > preferred)
+        return false;
+    return zone == preferred || page_fallback_allowed(&zones[zone], count);
+}
+
+/**
+ * @brief Allocate physically contiguous pages. Unlike page_alloc(), this
+ * function walks the page array and its complexity is O(n), so it should
+ * only be used when contiguous memory is really needed (large pages...).
+ * Each page of the range has its own reference counter and can be freed
+ * individually, or with page_free_range().
+ * 
+ * @param count Number of contiguous pages to allocate
+ * @param alignment Alignment of the first page, must be a multiple of 
+ * PAGE_SIZE
+ * @param flags Allocation flags
+ * @return paddr_t The physical address of the first page, or 0 if there is
+ * not enough contiguous free memory
+ */
+_export paddr_t page_alloc_range(
+    const uint_t count,
+    const size_t alignment,
+    const int flags)
+{
+    const size_t step = max(alignment / PAGE_SIZE, (size_t) 1);
+    const int preferred = page_preferred_zone(flags);
+    paddr_t paddr = 0;
+
+    spin_acquire(&lock) {
+        // The first page is never allocated, 0 is used to report errors
+        size_t first = step;
+        while (first + count <= table.nb_pages) {
+            const page_info_t *const pages = &table.pages[first];
+            uint_t i = 0;
+            while (i < count &&
+                   page_range_eligible(&pages[i], preferred, count))
+                i++;
+            if (i != count) {
+                first = align(first + i + 1, step);
+                continue;
+            }
+
+            for (i = 0; i < count; i++) {
+                page_info_t *const page = &table.pages[first + i];
+                const int zone = page_zone_index(page);
+                page_remove_free_list(page);
+                zones[zone].stats.allocs++;
+                if (zone != preferred)
+                    zones[zone].stats.fallbacks++;
+                page->pt_count = 0;
+                page->count = 1;
+            }
+            paddr = page_index_to_address(first);
+            break;
+        }
+        if (paddr == 0)
+            zones[preferred].stats.failures++;
+    }
+
+    if (page_zones_below(PAGE_WMARK_LOW))
+        kswapd_wakeup();
+    if (paddr == 0)
+        return 0;
+    for (uint_t i = 0; i < count; i++) {
+        page_info_t *const page = page_get(paddr + i * PAGE_SIZE);
+        if (flags & PAGE_CLEAR && !page->cleared)
+            page_clear(paddr + i * PAGE_SIZE);
+        page->cleared = 0;
+    }
+    return paddr;
+}
+
+/**
+ * @brief Free contiguous pages, see page_alloc_range()
+ * 
+ * @param addr The physical address of the first page
+ * @param count Number of pages to free
+ */
+_export void page_free_range(const paddr_t addr, const uint_t count)
+{
+    for (uint_t i = 0; i < count; i++)
+        page_free(addr + i * PAGE_SIZE);
+}
+
 /**
  * Decremente the reference counter of a page and free it if the reference
  * counter is 0.
@@ -320,15 +653,18 @@ _export paddr_t page_alloc(const int flags)
 _export void page_free(const paddr_t addr)
 {
     page_info_t *const page = page_get(PAGE_ALIGN(addr));
-    if (page->count == 0) 
-        panic("Trying to free a page that is already free");
     if (page->reserved)
         panic("Trying to free a reserved page");
 
     spin_acquire(&page->lock) {
+        if (page->count == 0)
+            panic("Trying to free a page that is already free");
         if (--page->count == 0) {
-            list_remove(&page->entry);
+            if (page->lru)
+                lru_del(page);
+            spin_lock(&lock);
             page_insert_free_list(page);
+            spin_unlock(&lock);
         }
     }
 }
@@ -354,3 +690,52 @@ _export int page_lock(const paddr_t addr)
     spin_lock(&page->lock);
     return 0;
 }
+
+/**
+ * @brief Get the number of used entries of a page table.
+ * 
+ * @param addr Physical address of the page table
+ * @return uint_t The number of used entries
+ */
+_export uint_t page_pt_count(const paddr_t addr)
+{
+    const page_info_t *const page = page_get(PAGE_ALIGN(addr));
+    if (page == NULL || page->count == 0)
+        panic("Page table %p is not allocated", addr);
+    return page->pt_count;
+}
+
+/**
+ * @brief Increment the number of used entries of a page table. Must be
+ * called each time an entry of the page table becomes present.
+ * 
+ * @param addr Physical address of the page table
+ * @return uint_t The new number of used entries
+ */
+_export uint_t page_pt_inc(const paddr_t addr)
+{
+    page_info_t *const page = page_get(PAGE_ALIGN(addr));
+    if (page == NULL || page->count == 0)
+        panic("Page table %p is not allocated", addr);
+    if (page->pt_count >= PAGE_SIZE / sizeof(uint32_t))
+        panic("Page table %p has too many entries", addr);
+    return ++page->pt_count;
+}
+
+/**
+ * @brief Decrement the number of used entries of a page table. Must be
+ * called each time an entry of the page table is cleared.
+ * 
+ * @param addr Physical address of the page table
+ * @return uint_t The new number of used entries: when it reaches 0, the
+ * page table can be released
+ */
+_export uint_t page_pt_dec(const paddr_t addr)
+{
+    page_info_t *const page = page_get(PAGE_ALIGN(addr));
+    if (page == NULL || page->count == 0)
+        panic("Page table %p is not allocated", addr);
+    if (page->pt_count == 0)
+        panic("Page table %p has no used entries", addr);
+    return --page->pt_count;
+}
@@ -16,6 +16,7 @@
  * You should have received a copy of the GNU General Public License
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <lib/maths.h>
 #include <mm/page.h>
 #include <mm/paging.h>
 
@@ -25,7 +26,8 @@ _export void paging_set_directory(const paddr_t directory)
 }
 
 /**
- * @brief Change the rights of a range of virtual pages.
+ * @brief Change the rights of a range of virtual pages. The TLB is
+ * invalidated only once for the whole range.
  * @param start The start of the range.
  * @param end The end of the range.
  * @param access The access rights to set.
@@ -36,14 +38,21 @@ _export int paging_change_rights_interval(
     const vaddr_t end,
     const int access)
 {
-    for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
-        if (paging_set_rights(vaddr, access) != 0)
-            return -1;
-    return 0;
+    int ret = 0;
+    paging_batch_t batch;
+    paging_batch_init(&batch);
+    for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        ret = paging_batch_set_rights(&batch, vaddr, access);
+        if (ret != 0)
+            break;
+    }
+    paging_batch_commit(&batch);
+    return ret;
 }
 
 /**
- * @brief Map an interval of virtual addresses
+ * @brief Map an interval of virtual addresses. The pages of the interval
+ * must not be mapped, so no TLB invalidation is needed.
  * @param start The start of the interval.
  * @param end The end of the interval.
  * @param access The access rights of the mapped pages.
@@ -55,18 +64,23 @@ _export int paging_map_interval(
     const int access)
 {
     for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
-        const paddr_t page = page_alloc(PAGE_CLEAR);
+        const paddr_t page = page_alloc(PAGE_CLEAR | PAGE_HIGH);
         if (page == 0)
             return -1;
-        if (paging_map_page(vaddr, page, access, PAGING_PRESENT) != 0)
+        if (paging_map_page(vaddr, page, access, PAGING_PRESENT) != 0) {
+            page_free(page);
             return -1;
+        }
     }
     return 0;
 }
 
 /**
  * @brief Unmap an interval of virtual addresses and free the associated
- * physical pages
+ * physical pages. Pages of the interval that are not mapped are skipped.
+ * The TLB is invalidated once for the whole interval, before the pages
+ * are freed. User page tables shared by a clone are unshared before their
+ * entries are cleared, so that the other address spaces keep their pages.
  * 
  * @param start Start address of the interval to unmap.
  * @param end End address of the interval to unmap.
@@ -76,6 +90,83 @@ _export void paging_unmap_interval(
     const vaddr_t start,
     const vaddr_t end)
 {
-    for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
-        page_free(paging_unmap_page(vaddr));
+    paging_batch_t batch;
+    paging_batch_init(&batch);
+    for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        if (!(vaddr & ~PAGING_LARGE_MASK) && end - vaddr >= PAGING_LARGE_SIZE) {
+            const paddr_t large = paging_unmap_large(vaddr);
+            if (large != 0) {
+                page_free_range(large, PAGING_LARGE_SIZE / PAGE_SIZE);
+                vaddr += PAGING_LARGE_SIZE - PAGE_SIZE;
+                continue;
+            }
+        }
+
+        // A shared page table is unshared once, on the first page of the
+        // interval it maps. If the copy cannot be allocated, the pages it
+        // maps stay mapped, read-only
+        if (vaddr < KERNEL_BASE &&
+            (vaddr == start || !(vaddr & ~PAGING_LARGE_MASK)) &&
+            paging_unshare_pt(vaddr) != 0) {
+            const vaddr_t next = (vaddr & PAGING_LARGE_MASK) +
+                                 PAGING_LARGE_SIZE;
+            vaddr = min(next, end) - PAGE_SIZE;
+            continue;
+        }
+
+        // Only a part of a large page is unmapped: split it first. If the
+        // split fails, the pages of the large page stay mapped
+        if (vaddr < KERNEL_BASE && paging_split_large(vaddr) != 0)
+            continue;
+        paging_batch_unmap(&batch, vaddr, true);
+    }
+    paging_batch_commit(&batch);
+}
+
+/**
+ * @brief Map an interval of virtual addresses, using a large page for each
+ * 4 MiB aligned chunk of the interval when physically contiguous memory is
+ * available. Other parts of the interval are mapped with normal pages.
+ * 
+ * @param start The start of the interval.
+ * @param end The end of the interval.
+ * @param access The access rights of the mapped pages.
+ * @return 0 on success, -1 on error (nothing is mapped).
+ */
+_export int paging_map_interval_large(
+    const vaddr_t start,
+    const vaddr_t end,
+    const int access)
+{
+    const uint_t count = PAGING_LARGE_SIZE / PAGE_SIZE;
+    vaddr_t vaddr = start;
+    while (vaddr < end) {
+        if (!(vaddr & ~PAGING_LARGE_MASK) && end - vaddr >= PAGING_LARGE_SIZE) {
+            const paddr_t large = page_alloc_range(
+                count,
+                PAGING_LARGE_SIZE,
+                PAGE_CLEAR | PAGE_HIGH);
+            if (large != 0) {
+                const int ret = paging_map_large(
+                    vaddr,
+                    large,
+                    access,
+                    PAGING_PRESENT);
+                if (ret == 0) {
+                    vaddr += PAGING_LARGE_SIZE;
+                    continue;
+                }
+                page_free_range(large, count);
+            }
+        }
+
+        const vaddr_t limit = (vaddr & PAGING_LARGE_MASK) + PAGING_LARGE_SIZE;
+        const vaddr_t next = min(limit, end);
+        if (paging_map_interval(vaddr, next, access) != 0) {
+            paging_unmap_interval(start, next);
+            return -1;
+        }
+        vaddr = next;
+    }
+    return 0;
 }
@@ -70,7 +70,49 @@ _init void vmalloc_setup(void)
 }
 
 /**
- * @brief Allocates a virtual memory area of the given size.
+ * @brief Find a free area that can hold size bytes at an address aligned on
+ * alignment. If the aligned address is not the base of the area, the head
+ * of the area is split in its own free area. The lock must be held.
+ * 
+ * @param size Size of the area to find
+ * @param alignment Alignment of the area, must be a multiple of PAGE_SIZE
+ * @return vmarea_t* A free area starting at an aligned address, or NULL if
+ * there is no such area
+ */
+static vmarea_t *vmarea_find_free(const size_t size, const vaddr_t alignment)
+{
+    list_foreach(&free_list, entry) {
+        vmarea_t *const vma = list_entry(entry, vmarea_t, node);
+        const vaddr_t base = align(vma->base, alignment);
+        if (base + size > vma->base + vma->length || base + size < base)
+            continue;
+        if (base == vma->base)
+            return vma;
+
+        vmarea_t *const head = vmarea_allocate();
+        if (head == NULL)
+            return NULL;
+        head->base = vma->base;
+        head->length = base - vma->base;
+        head->mapped = 0;
+        list_add_tail(&free_list, &head->node);
+        vma->length -= head->length;
+        vma->base = base;
+        return vma;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocates a virtual memory area of the given size. Mapped areas of
+ * at least 4 MiB are aligned on 4 MiB if possible, and mapped with large
+ * pages when physically contiguous memory is available.
+ * 
+ * The lock only protects the lists of areas: the area is moved to the used
+ * list before being mapped and zeroed, so that no other allocation can use
+ * it, and the long mapping and zeroing work is done without the lock. The
+ * lock cannot be a sleeping lock because vmalloc() is used by the slub
+ * allocators with their own lock held.
  * 
  * @param size Size of the area to allocate, must be a multiple of PAGE_SIZE
  * @param flags Flags to control the allocation
@@ -83,16 +125,14 @@ _export vaddr_t vmalloc(size_t size, int flags)
 #endif
 
     // Find the first free area that is big enough
-    // TODO: The spinlock is used too long...
+    const bool large = (flags & VMALLOC_MAP) && size >= PAGING_LARGE_SIZE;
+    vmarea_t *vma = NULL;
     spin_acquire(&lock) {
-        vmarea_t *vma = NULL;
-        list_foreach(&free_list, entry) {
-            vma = list_entry(entry, vmarea_t, node);
-            if (vma->length >= size) 
-                break;
-        }
-
-        if(vma == NULL)
+        if (large)
+            vma = vmarea_find_free(size, PAGING_LARGE_SIZE);
+        if (vma == NULL)
+            vma = vmarea_find_free(size, PAGE_SIZE);
+        if (vma == NULL)
             return 0;
 
         list_remove(&vma->node);
@@ -112,25 +152,27 @@ _export vaddr_t vmalloc(size_t size, int flags)
             vma->length = size;
             list_add_tail(&free_list, &new_vma->node);
         }
+    }
 
-        if (flags & VMALLOC_MAP) {
-            const int ret = paging_map_interval(
-                                vma->base,
-                                vma->base + vma->length,
-                                PAGING_READ | PAGING_WRITE);
-            if (ret < 0) {
-                // We can't map the area, so we put it back in the free list
+    if (flags & VMALLOC_MAP) {
+        const vaddr_t end = vma->base + vma->length;
+        const int access = PAGING_READ | PAGING_WRITE;
+        const int ret = (large) ?
+            paging_map_interval_large(vma->base, end, access) :
+            paging_map_interval(vma->base, end, access);
+        if (ret < 0) {
+            // We can't map the area, so we put it back in the free list
+            spin_acquire(&lock) {
                 list_remove(&vma->node);
                 list_add_tail(&free_list, &vma->node);
-                return 0;
             }
-            if (flags & VMALLOC_ZERO)
-                memzero(vma->base, vma->length);
-            vma->mapped = 1;
+            return 0;
         }
-        return vma->base;
+        if (flags & VMALLOC_ZERO)
+            memzero(vma->base, vma->length);
+        vma->mapped = 1;
     }
-    _unreachable();
+    return vma->base;
 }
 
 /**
@@ -141,21 +183,30 @@ _export vaddr_t vmalloc(size_t size, int flags)
  */
 _export void vmfree(vaddr_t addr)
 {
+    vmarea_t *vma = NULL;
     spin_acquire(&lock) {
         list_foreach(&used_list, entry) {
-            vmarea_t *const vma = list_entry(entry, vmarea_t, node);
-            if (vma->base == addr) {
-                list_remove(&vma->node);
-                if (vma->mapped) {
-                    paging_unmap_interval(vma->base, vma->base + vma->length);
-                    vma->mapped = 0;
-                }
-                list_add_head(&free_list, &vma->node);
-                return;
+            vmarea_t *const area = list_entry(entry, vmarea_t, node);
+            if (area->base == addr) {
+                list_remove(&area->node);
+                vma = area;
+                break;
             }
         }
     }
 
+    // The area is in no list while it is unmapped without the lock
+    if (vma != NULL) {
+        if (vma->mapped) {
+            paging_unmap_interval(vma->base, vma->base + vma->length);
+            vma->mapped = 0;
+        }
+        spin_acquire(&lock) {
+            list_add_head(&free_list, &vma->node);
+        }
+        return;
+    }
+
     warn("vmfree(): impossible to free the memory"
         " because the area doesn't exist");
 }
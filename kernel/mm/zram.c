@@ -0,0 +1,270 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/lz.h>
+#include <lib/memory.h>
+#include <lib/spinlock.h>
+#include <mm/lru.h>
+#include <mm/page.h>
+#include <mm/zram.h>
+#include <mm/malloc.h>
+#include <mm/paging.h>
+
+/**
+ * @file Compressed in-memory swap. Cold anonymous pages chosen by the
+ * reclaim (see mm/lru.c) are compressed into small buffers allocated with
+ * kmalloc() and their page table entries are replaced by swap entries
+ * holding the index of the slot where the page is stored (see
+ * pte_set_swap()). The page fault handler restores the page on the next
+ * access. Pages filled with zeros are stored without any memory, and pages
+ * that do not compress to at least ZRAM_MAX_LENGTH bytes are rejected.
+ */
+
+typedef struct zram_slot {
+    union {
+        void *data;             // Compressed page, NULL if filled with zeros
+        uint_t next;            // Next free slot, if the slot is free
+    };
+    uint16_t length;
+    uint16_t count;             // Swap entries referencing the slot
+} zram_slot_t;
+
+static DECLARE_SPINLOCK(lock);
+static struct zram_slot slots[ZRAM_MAX_SLOTS];
+static uint_t free_slots = 0;       // Head of the list of free slots
+static uint_t next_slot = 1;        // Slot 0 is never used
+static struct zram_stats stats = {0};
+
+// Compression buffers, protected by the lock
+static uint16_t lz_table[LZ_HASH_SIZE];
+static uint8_t buffer[ZRAM_MAX_LENGTH];
+
+/**
+ * @brief Allocate a slot. The lock must be held.
+ * 
+ * @return uint_t The index of the slot, or 0 if the store is full
+ */
+static uint_t zram_slot_alloc(void)
+{
+    if (free_slots != 0) {
+        const uint_t slot = free_slots;
+        free_slots = slots[slot].next;
+        return slot;
+    }
+    if (next_slot == ZRAM_MAX_SLOTS)
+        return 0;
+    return next_slot++;
+}
+
+/**
+ * @brief Check if a page is filled with zeros.
+ */
+static bool zram_is_zero(const uint32_t *page)
+{
+    for (uint_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+        if (page[i] != 0)
+            return false;
+    return true;
+}
+
+/**
+ * @brief Compress a page into a new slot. The lock must be held.
+ * 
+ * @param page The content of the page
+ * @return int The index of the slot, or
+ *  -ENOSPC if the store is full
+ *  -E2BIG if the page does not compress well enough
+ *  -ENOMEM if there is no memory left to store the compressed page
+ */
+static int __zram_store(const void *page)
+{
+    const uint_t slot = zram_slot_alloc();
+    if (slot == 0)
+        return -ENOSPC;
+
+    void *data = NULL;
+    size_t length = 0;
+    if (zram_is_zero(page)) {
+        stats.zero++;
+    } else {
+        length = lz_compress(page, PAGE_SIZE, buffer, sizeof(buffer), lz_table);
+        if (length == 0)
+            stats.rejected++;
+        else
+            data = malloc(length);
+        if (data == NULL) {
+            slots[slot].next = free_slots;
+            free_slots = slot;
+            return length == 0 ? -E2BIG : -ENOMEM;
+        }
+        memcpy(data, buffer, length);
+    }
+
+    slots[slot].data = data;
+    slots[slot].length = length;
+    slots[slot].count = 1;
+    stats.compressed += length;
+    stats.stored++;
+    return slot;
+}
+
+/**
+ * @brief Compress a physical page into the store. The page is not released.
+ * 
+ * @param page The physical page to store
+ * @return int The index of the slot, or a negative error (see
+ * __zram_store())
+ */
+int zram_store(const paddr_t page)
+{
+    const uint64_t start = rdtsc();
+    const vaddr_t vaddr = kmap_atomic(page);
+    int slot;
+    spin_acquire(&lock) {
+        slot = __zram_store((const void *) vaddr);
+        if (slot > 0) {
+            stats.swapouts++;
+            stats.swapout_cycles += rdtsc() - start;
+        }
+    }
+    kunmap_atomic(vaddr);
+    return slot;
+}
+
+/**
+ * @brief Decompress a slot into a physical page. The slot is not released.
+ * 
+ * @param slot The index of the slot
+ * @param page The physical page to fill
+ */
+static void zram_load(const uint_t slot, const paddr_t page)
+{
+    const uint64_t start = rdtsc();
+    const vaddr_t vaddr = kmap_atomic(page);
+    spin_acquire(&lock) {
+        const struct zram_slot *const s = &slots[slot];
+        if (s->data == NULL)
+            memzero((void *) vaddr, PAGE_SIZE);
+        else if (lz_decompress(s->data, s->length,
+                    (void *) vaddr, PAGE_SIZE) != PAGE_SIZE)
+            panic("Compressed page %u is corrupted", slot);
+        stats.swapins++;
+        stats.swapin_cycles += rdtsc() - start;
+    }
+    kunmap_atomic(vaddr);
+}
+
+/**
+ * @brief Add a reference to a slot, when its swap entry is copied into
+ * another page table (see paging_unshare_pt()).
+ * 
+ * @param slot The index of the slot
+ */
+void zram_dup(const uint_t slot)
+{
+    assert(slot > 0 && slot < next_slot);
+    spin_acquire(&lock) {
+        assert(slots[slot].count > 0);
+        slots[slot].count++;
+    }
+}
+
+/**
+ * @brief Drop a reference to a slot, when one of its swap entries is
+ * restored or unmapped. The slot is released with its last reference.
+ * 
+ * @param slot The index of the slot
+ */
+void zram_free(const uint_t slot)
+{
+    assert(slot > 0 && slot < next_slot);
+    spin_acquire(&lock) {
+        struct zram_slot *const s = &slots[slot];
+        assert(s->count > 0);
+        if (--s->count != 0)
+            break;
+        if (s->data == NULL)
+            stats.zero--;
+        stats.compressed -= s->length;
+        stats.stored--;
+        free(s->data);
+        s->next = free_slots;
+        free_slots = slot;
+    }
+}
+
+/**
+ * @brief Restore a compressed page at a faulting address of an anonymous
+ * area. The context of the area must be loaded on the CPU and its lock must
+ * be held. If the page table is shared by a clone, it is unshared first:
+ * the slot is then referenced by both page tables, and is only released by
+ * the last one restoring it.
+ * 
+ * @param context The context of the area
+ * @param area The area containing the faulting address
+ * @param addr The faulting address
+ * @return int 0 on success, or
+ *  -ENOENT if the address is not mapped by a swap entry
+ *  -ENOMEM if there is no memory left to restore the page or to unshare
+ *  the page table
+ */
+int zram_fault(
+    struct mm_context *context,
+    struct mm_area *area,
+    const vaddr_t addr)
+{
+    const vaddr_t vaddr = PAGE_ALIGN(addr);
+    const pte_t *const swap = paging_get_pte(vaddr);
+    if (swap == NULL || !pte_is_swap(swap))
+        return -ENOENT;
+    if (paging_unshare_pt(vaddr) < 0)
+        return -ENOMEM;
+
+    // The page table may have been replaced by a private copy
+    pte_t *const pte = paging_get_pte(vaddr);
+
+    const paddr_t page = page_alloc(PAGE_HIGH);
+    if (page == 0)
+        return -ENOMEM;
+    const uint_t slot = pte_get_swap(pte);
+    zram_load(slot, page);
+
+    // A swap entry is not present, so nothing needs to be invalidated, and
+    // it is already counted as a used entry of the page table
+    pte_t entry = {.value = 0};
+    pte_set_address(&entry, page);
+    entry.write = !!(area->access & PAGING_WRITE);
+    entry.present = 1;
+    entry.user = 1;
+    pte_copy(pte, &entry);
+    zram_free(slot);
+    lru_add(context, page, vaddr);
+    return 0;
+}
+
+/**
+ * @brief Get a copy of the counters of the compressed store.
+ * 
+ * @param info Where to copy the counters
+ */
+_export void zram_get_stats(struct zram_stats *info)
+{
+    spin_acquire(&lock) {
+        *info = stats;
+    }
+}
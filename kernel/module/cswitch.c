@@ -0,0 +1,92 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <module.h>
+#include <lib/log.h>
+#include <mm/vmalloc.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/paging.h>
+
+MODULE_NAME("cswitch")
+MODULE_VERSION("1.0")
+MODULE_LICENSE("GPLv3")
+MODULE_AUTHOR("Romain Cadilhac")
+MODULE_DESCRIPTION("Measure the TLB refills after an address space switch")
+
+#define CSWITCH_PAGES   64      // Kernel pages read after each switch
+#define CSWITCH_ROUNDS  1000    // Switches measured per run
+
+static volatile uint32_t *buffer = NULL;
+
+/**
+ * @brief Switch back and forth between two page directories, and read a
+ * word of each page of the buffer after each switch: the pages of the
+ * buffer are refilled in the TLB after each switch, unless they are global.
+ * Interrupts must be disabled.
+ * 
+ * @param pd The page directory loaded on the CPU
+ * @param other Another page directory
+ * @return uint_t The average number of cycles per switch
+ */
+static uint_t cswitch_run(const paddr_t pd, const paddr_t other)
+{
+    const uint64_t start = rdtsc();
+    for (uint_t i = 0; i < CSWITCH_ROUNDS; i++) {
+        set_cr3((i & 1) ? pd : other);
+        for (uint_t j = 0; j < CSWITCH_PAGES; j++)
+            (void) buffer[j * (PAGE_SIZE / sizeof(uint32_t))];
+    }
+    set_cr3(pd);
+    return (uint32_t) (rdtsc() - start) / CSWITCH_ROUNDS;
+}
+
+static void startup(void)
+{
+    buffer = vmallocp(CSWITCH_PAGES * PAGE_SIZE, VMALLOC_MAP | VMALLOC_ZERO);
+    const uint_t generation = paging_kernel_generation();
+    const vaddr_t other = paging_alloc_pd();
+    if (buffer == NULL || other == 0) {
+        warn("cswitch: not enough memory");
+        if (other != 0)
+            paging_release_pd(other, generation);
+        if (buffer != NULL)
+            vmfreep(buffer);
+        return;
+    }
+
+    uint_t global = 0;
+    uint_t local = 0;
+    irq_acquire() {
+        const paddr_t pd = PAGE_ALIGN(get_cr3());
+        const uint32_t cr4 = get_cr4();
+        global = cswitch_run(pd, virt_to_phys(other));
+
+        // Without CR4.PGE, the global bit of the kernel pages is ignored
+        set_cr4(cr4 & ~CR4_PGE);
+        local = cswitch_run(pd, virt_to_phys(other));
+        set_cr4(cr4);
+    }
+
+    info("cswitch: %u cycles per switch with global kernel pages", global);
+    info("cswitch: %u cycles per switch without global pages", local);
+    paging_release_pd(other, generation);
+    vmfreep(buffer);
+}
+
+MODULE_INIT(startup)
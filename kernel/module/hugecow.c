@@ -0,0 +1,151 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <module.h>
+#include <lib/log.h>
+#include <mm/area.h>
+#include <mm/fault.h>
+#include <mm/context.h>
+#include <core/preempt.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/exception.h>
+
+MODULE_NAME("hugecow")
+MODULE_VERSION("1.0")
+MODULE_LICENSE("GPLv3")
+MODULE_AUTHOR("Romain Cadilhac")
+MODULE_DESCRIPTION("Check the copy-on-write of large pages shared by a clone")
+
+#define HUGECOW_BASE    0x10000000  // Start of the area, aligned on 4 MiB
+
+// A word in each of the first two pages of the large page
+#define HUGECOW_FIRST   (HUGECOW_BASE)
+#define HUGECOW_SECOND  (HUGECOW_BASE + PAGE_SIZE)
+
+/**
+ * @brief Write a word in a context, as an user thread would. If error is
+ * not 0, the write fault is handled first with this error code. Preemption
+ * is disabled so that the context stays loaded on the CPU meanwhile.
+ *
+ * @return int 0 on success, or the error of the page fault handler
+ */
+static int hugecow_write(
+    struct mm_context *context,
+    const vaddr_t addr,
+    const uint32_t value,
+    const int error)
+{
+    int ret = 0;
+    preempt_disable();
+    mm_context_set(context);
+    if (error != 0)
+        ret = mm_page_fault(context, addr, error);
+    if (ret == 0)
+        *(volatile uint32_t *) addr = value;
+    preempt_enable();
+    return ret;
+}
+
+/**
+ * @brief Read a word in a context. The address must be mapped.
+ */
+static uint32_t hugecow_read(struct mm_context *context, const vaddr_t addr)
+{
+    preempt_disable();
+    mm_context_set(context);
+    const uint32_t value = *(volatile uint32_t *) addr;
+    preempt_enable();
+    return value;
+}
+
+/**
+ * @brief Check if the area is mapped by a large page in a context.
+ */
+static bool hugecow_large(struct mm_context *context)
+{
+    preempt_disable();
+    mm_context_set(context);
+    const bool large = paging_get_pde(HUGECOW_BASE)->large;
+    preempt_enable();
+    return large;
+}
+
+/**
+ * @brief Populate a large page, clone its context, then write to it from
+ * both contexts: each write must be copied, and never be seen by the other
+ * context.
+ */
+static void hugecow_run(struct mm_context *parent)
+{
+    const int present = PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE | PAGE_FAULT_USER;
+    const int missing = PAGE_FAULT_WRITE | PAGE_FAULT_USER;
+    vaddr_t addr = HUGECOW_BASE;
+
+    if (mm_map(
+            parent, &addr,
+            PAGING_LARGE_SIZE,
+            PAGING_READ | PAGING_WRITE,
+            MM_AREA_FIXED) < 0) {
+        warn("hugecow: failed to create the area");
+        return;
+    }
+    if (hugecow_write(parent, HUGECOW_FIRST, 1, missing) < 0) {
+        warn("hugecow: failed to populate the area");
+        return;
+    }
+    if (!hugecow_large(parent)) {
+        info("hugecow: skipped, no contiguous memory for a large page");
+        return;
+    }
+    hugecow_write(parent, HUGECOW_SECOND, 2, 0);
+
+    struct mm_context *child = mm_context_clone(parent);
+    if (child == NULL) {
+        warn("hugecow: failed to clone the context");
+        return;
+    }
+
+    // The page copied by the child is not shared anymore by the parent, so
+    // the last write of the parent only restores its write access
+    if (hugecow_write(child, HUGECOW_FIRST, 3, present) < 0 ||
+        hugecow_write(parent, HUGECOW_SECOND, 4, present) < 0 ||
+        hugecow_write(parent, HUGECOW_FIRST, 5, present) < 0) {
+        error("hugecow: write fault on a cloned large page failed");
+    } else if (hugecow_read(parent, HUGECOW_FIRST) != 5 ||
+               hugecow_read(parent, HUGECOW_SECOND) != 4 ||
+               hugecow_read(child, HUGECOW_FIRST) != 3 ||
+               hugecow_read(child, HUGECOW_SECOND) != 2) {
+        error("hugecow: a write is visible in the other context");
+    } else {
+        info("hugecow: cloned large page copied on write in both contexts");
+    }
+    mm_context_drop(child);
+}
+
+static void startup(void)
+{
+    struct mm_context *parent = mm_context_create();
+    if (parent == NULL) {
+        warn("hugecow: not enough memory");
+        return;
+    }
+    hugecow_run(parent);
+    mm_context_drop(parent);
+}
+
+MODULE_INIT(startup)
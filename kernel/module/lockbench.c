@@ -0,0 +1,214 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <module.h>
+#include <lib/log.h>
+#include <lib/spinlock.h>
+#include <core/preempt.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/smp.h>
+#include <process/process.h>
+#include <process/schedule.h>
+
+MODULE_NAME("lockbench")
+MODULE_VERSION("1.0")
+MODULE_LICENSE("GPLv3")
+MODULE_AUTHOR("Romain Cadilhac")
+MODULE_DESCRIPTION("Compare the throughput and the fairness of spinlocks")
+
+#define LOCKBENCH_DURATION  200     // Milliseconds measured per lock
+
+#ifdef CONFIG_SPINLOCK_TICKET
+#define LOCKBENCH_KERNEL    "kernel ticket"
+#else
+#define LOCKBENCH_KERNEL    "kernel queued"
+#endif
+
+/**
+ * @brief A lock measured by the benchmark. Each lock disables preemption
+ * while it is held, like spin_lock().
+ */
+typedef struct lockbench_lock {
+    const char *name;
+    void (*lock)(void);
+    void (*unlock)(void);
+} lockbench_lock_t;
+
+static DECLARE_SPINLOCK(kernel_lock);
+static volatile uint32_t tas_lock = 0;
+static volatile uint16_t ticket_owner = 0;
+static volatile uint16_t ticket_next = 0;
+
+// Incremented with the measured lock held, to check the mutual exclusion
+static volatile uint_t shared = 0;
+
+static uint_t workers = 0;
+static uint_t counts[SMP_MAX_CPUS];
+static atomic_uint next_id = 0;
+static atomic_uint finished = 0;
+static volatile uint_t round = 0;   // Index of the running round, plus one
+static volatile bool running = false;
+
+static void lockbench_kernel_lock(void)
+{
+    spin_lock(&kernel_lock);
+}
+
+static void lockbench_kernel_unlock(void)
+{
+    spin_unlock(&kernel_lock);
+}
+
+/**
+ * @brief The test-and-set lock used before the ticket and queued locks: all
+ * waiters spin on the same word, and nothing orders them.
+ */
+static void lockbench_tas_lock(void)
+{
+    preempt_disable();
+    while (__sync_lock_test_and_set(&tas_lock, 1))
+        while (tas_lock)
+            cpu_relax();
+}
+
+static void lockbench_tas_unlock(void)
+{
+    __sync_lock_release(&tas_lock);
+    preempt_enable();
+}
+
+/**
+ * @brief A ticket lock, as built with CONFIG_SPINLOCK_TICKET: waiters are
+ * served in order, but all spin on the same word.
+ */
+static void lockbench_ticket_lock(void)
+{
+    preempt_disable();
+    const uint16_t ticket = __sync_fetch_and_add(&ticket_next, 1);
+    while (ticket_owner != ticket)
+        cpu_relax();
+    sw_barrier();
+}
+
+static void lockbench_ticket_unlock(void)
+{
+    sw_barrier();
+    ticket_owner++;
+    preempt_enable();
+}
+
+static const struct lockbench_lock locks[] = {
+    {"test-and-set", lockbench_tas_lock, lockbench_tas_unlock},
+    {"ticket", lockbench_ticket_lock, lockbench_ticket_unlock},
+    {LOCKBENCH_KERNEL, lockbench_kernel_lock, lockbench_kernel_unlock},
+};
+
+#define LOCKBENCH_LOCKS (sizeof(locks) / sizeof(locks[0]))
+
+/**
+ * @brief A worker: during each round, take and release the lock of the
+ * round as many times as possible, and record how many times it got it.
+ */
+_noreturn
+static void lockbench_worker(void)
+{
+    const uint_t id = atomic_fetch_add(&next_id, 1);
+    for (uint_t i = 0; i < LOCKBENCH_LOCKS; i++) {
+        while (round != i + 1)
+            scheduler_sleep(1);
+
+        const struct lockbench_lock *lock = &locks[i];
+        uint_t count = 0;
+        while (running) {
+            lock->lock();
+            shared++;
+            lock->unlock();
+            count++;
+        }
+        counts[id] = count;
+        atomic_fetch_add(&finished, 1);
+    }
+    process_exit_kthread();
+}
+
+/**
+ * @brief Run a round with a lock and report its throughput, and its
+ * fairness as the fewest and the most acquisitions of a worker.
+ */
+static void lockbench_round(const uint_t i)
+{
+    const uint_t start = shared;
+    atomic_store(&finished, 0);
+    running = true;
+    round = i + 1;
+    scheduler_sleep(LOCKBENCH_DURATION);
+    running = false;
+    while (atomic_load(&finished) != workers)
+        scheduler_sleep(1);
+
+    uint_t total = 0;
+    uint_t min = counts[0];
+    uint_t max = counts[0];
+    for (uint_t j = 0; j < workers; j++) {
+        total += counts[j];
+        if (counts[j] < min)
+            min = counts[j];
+        if (counts[j] > max)
+            max = counts[j];
+    }
+    if (shared - start != total)
+        error("lockbench: %s lock is not mutually exclusive", locks[i].name);
+    info("lockbench: %s: %u per ms, %u to %u per thread",
+        locks[i].name, total / LOCKBENCH_DURATION, min, max);
+}
+
+/**
+ * @brief The coordinator: run a round for each lock once all the workers
+ * are started.
+ */
+_noreturn
+static void lockbench_main(void)
+{
+    while (atomic_load(&next_id) != workers)
+        scheduler_sleep(1);
+    info("lockbench: %u threads contending for each lock", workers);
+    for (uint_t i = 0; i < LOCKBENCH_LOCKS; i++)
+        lockbench_round(i);
+    process_exit_kthread();
+}
+
+static void startup(void)
+{
+    workers = smp_cpu_count();
+    if (workers < 2) {
+        info("lockbench: skipped, there is no contention with one CPU");
+        return;
+    }
+
+    for (uint_t i = 0; i < workers; i++) {
+        if (process_creat_kthread(lockbench_worker) == NULL) {
+            warn("lockbench: failed to create a worker");
+            workers = i;
+            break;
+        }
+    }
+    if (process_creat_kthread(lockbench_main) == NULL)
+        warn("lockbench: failed to create the coordinator");
+}
+
+MODULE_INIT(startup)
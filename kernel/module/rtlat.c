@@ -0,0 +1,101 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <module.h>
+#include <lib/log.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/smp.h>
+#include <process/process.h>
+#include <process/schedule.h>
+
+MODULE_NAME("rtlat")
+MODULE_VERSION("1.0")
+MODULE_LICENSE("GPLv3")
+MODULE_AUTHOR("Romain Cadilhac")
+MODULE_DESCRIPTION("Measure the wakeup latency of real-time threads")
+
+#define RTLAT_WAKEUPS   500     // Wakeups measured
+#define RTLAT_PERIOD    2       // Milliseconds slept between two wakeups
+#define RTLAT_LOAD      2       // Busy threads of the fair class per CPU
+
+static volatile bool done = false;
+static uint_t load = 0;
+
+/**
+ * @brief A thread of the fair class that keeps its CPU busy until the
+ * measure is done.
+ */
+_noreturn
+static void rtlat_load(void)
+{
+    while (!done)
+        cpu_relax();
+    process_exit_kthread();
+}
+
+/**
+ * @brief The real-time thread: sleep and wake up RTLAT_WAKEUPS times while
+ * the load threads run, then report the latency between each wakeup and
+ * the moment the thread was picked to run. The sum of the latencies is
+ * divided in units of 16 cycles so that it fits in 32 bits.
+ */
+_noreturn
+static void rtlat_main(void)
+{
+    struct scheduler_rt_stats before;
+    struct scheduler_rt_stats after;
+
+    scheduler_get_rt_stats(&before);
+    for (uint_t i = 0; i < RTLAT_WAKEUPS; i++)
+        scheduler_sleep(RTLAT_PERIOD);
+    scheduler_get_rt_stats(&after);
+    done = true;
+
+    const uint_t wakeups = after.wakeups - before.wakeups;
+    const uint32_t total = (after.total_latency - before.total_latency) >> 4;
+    if (wakeups == 0) {
+        warn("rtlat: the real-time thread was never woken up");
+        process_exit_kthread();
+    }
+    info("rtlat: %u wakeups under the load of %u threads",
+        wakeups, load);
+    info("rtlat: average latency of %u cycles, worst case of %u cycles",
+        total / wakeups << 4, (uint32_t) after.max_latency);
+    process_exit_kthread();
+}
+
+static void startup(void)
+{
+    thread_t *thread = process_creat_kthread(rtlat_main);
+    if (thread == NULL) {
+        warn("rtlat: failed to create the real-time thread");
+        return;
+    }
+    scheduler_set_policy(thread, SCHEDULER_POLICY_FIFO);
+    scheduler_set_rt_priority(thread, 0);
+
+    const uint_t count = smp_cpu_count() * RTLAT_LOAD;
+    for (; load < count; load++) {
+        if (process_creat_kthread(rtlat_load) == NULL) {
+            warn("rtlat: failed to create a load thread");
+            break;
+        }
+    }
+}
+
+MODULE_INIT(startup)
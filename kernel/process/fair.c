@@ -0,0 +1,229 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/rbtree.h>
+#include <arch/x86/pit.h>
+#include <process/class.h>
+#include <process/schedule.h>
+
+/**
+ * @file The fair class. Each thread has a virtual run time: the time it
+ * ran, in microseconds, scaled by the inverse of its weight, which depends
+ * on its nice level. Ready threads are ordered by virtual run time in a
+ * red-black tree, and the thread that ran the least (the leftmost one) is
+ * the next to run. Threads with a higher weight get more CPU time because
+ * their virtual time runs slower.
+ * 
+ * Each thread runs for a slice of SCHEDULER_FAIR_LATENCY ticks shared
+ * between the ready threads in proportion to their weight, so every ready
+ * thread runs at least once in this period. A thread woken up after a sleep
+ * starts at most SCHEDULER_FAIR_SLEEPER_CREDIT before the minimum virtual
+ * run time of the queue: interactive threads run quickly after a wakeup,
+ * but cannot accumulate credit while they sleep.
+ * 
+ * The run time is accounted per tick. Each run queue has its own minimum
+ * virtual run time: a thread moved to another CPU keeps its lead or its
+ * lag relative to the minimum of its queue.
+ */
+#define FAIR_TICK_US    (1000000 / PIT_KERN_FREQ)
+
+// Weight of each nice level from SCHEDULER_NICE_MIN: a thread gets about
+// 10% more CPU time than a thread with the next nice level
+static const uint_t nice_weights[] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+/**
+ * @brief Get the weight of a nice level.
+ * 
+ * @param nice The nice level, from SCHEDULER_NICE_MIN to SCHEDULER_NICE_MAX
+ * @return uint_t The weight
+ */
+uint_t fair_nice_weight(const int nice)
+{
+    assert(nice >= SCHEDULER_NICE_MIN && nice <= SCHEDULER_NICE_MAX);
+    return nice_weights[nice - SCHEDULER_NICE_MIN];
+}
+
+static thread_t *fair_first(struct fair_queue *fq)
+{
+    if (fq->leftmost == NULL)
+        return NULL;
+    return rb_entry(fq->leftmost, thread_t, fair_node);
+}
+
+/**
+ * @brief Advance the minimum virtual run time of the queue. It never goes
+ * backward, and follows the thread that ran the least, running or queued.
+ */
+static void fair_update_min(struct fair_queue *fq, const thread_t *current)
+{
+    uint64_t vruntime = fq->min_vruntime;
+    const thread_t *first = fair_first(fq);
+    if (current != NULL)
+        vruntime = current->vruntime;
+    if (first != NULL && (current == NULL || first->vruntime < vruntime))
+        vruntime = first->vruntime;
+    if (vruntime > fq->min_vruntime)
+        fq->min_vruntime = vruntime;
+}
+
+static void fair_init(struct run_queue *rq)
+{
+    rq->fair.timeline.node = NULL;
+    rq->fair.leftmost = NULL;
+    rq->fair.min_vruntime = 0;
+    rq->fair.load = 0;
+}
+
+static void fair_setup(struct run_queue *rq, thread_t *thread)
+{
+    thread->vruntime = rq->fair.min_vruntime;
+    thread->slice = 0;
+}
+
+static void fair_enqueue(
+    struct run_queue *rq,
+    thread_t *thread,
+    const bool wakeup)
+{
+    struct fair_queue *const fq = &rq->fair;
+    if (wakeup && thread->vruntime + SCHEDULER_FAIR_SLEEPER_CREDIT <
+                  fq->min_vruntime)
+        thread->vruntime = fq->min_vruntime - SCHEDULER_FAIR_SLEEPER_CREDIT;
+
+    // Threads with the same virtual run time are queued in FIFO order
+    struct rb_node **link = &fq->timeline.node;
+    struct rb_node *parent = NULL;
+    bool first = true;
+    while (*link != NULL) {
+        parent = *link;
+        if (thread->vruntime <
+            rb_entry(parent, thread_t, fair_node)->vruntime) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            first = false;
+        }
+    }
+
+    rb_link_node(&thread->fair_node, parent, link);
+    rb_insert_color(&fq->timeline, &thread->fair_node);
+    if (first)
+        fq->leftmost = &thread->fair_node;
+    fq->load += thread->weight;
+}
+
+static void fair_dequeue(struct run_queue *rq, thread_t *thread)
+{
+    struct fair_queue *const fq = &rq->fair;
+    if (fq->leftmost == &thread->fair_node)
+        fq->leftmost = rb_next(fq->leftmost);
+    rb_erase(&fq->timeline, &thread->fair_node);
+    fq->load -= thread->weight;
+}
+
+static thread_t *fair_pick(struct run_queue *rq)
+{
+    thread_t *thread = fair_first(&rq->fair);
+    if (thread == NULL)
+        return NULL;
+    fair_dequeue(rq, thread);
+    fair_update_min(&rq->fair, thread);
+    thread->slice = 0;
+    return thread;
+}
+
+/**
+ * @brief Account a tick to the current thread, and reschedule it if it has
+ * run for its share of SCHEDULER_FAIR_LATENCY.
+ */
+static bool fair_tick(struct run_queue *rq, thread_t *current)
+{
+    current->vruntime += FAIR_TICK_US * SCHEDULER_NICE_0_WEIGHT /
+                         current->weight;
+    current->slice++;
+    fair_update_min(&rq->fair, current);
+    if (rq->fair.leftmost == NULL)
+        return false;
+
+    uint_t slice = SCHEDULER_FAIR_LATENCY * current->weight /
+                   (rq->fair.load + current->weight);
+    if (slice < SCHEDULER_FAIR_GRANULARITY)
+        slice = SCHEDULER_FAIR_GRANULARITY;
+    return current->slice >= slice;
+}
+
+static bool fair_preempt(const thread_t *current, const thread_t *thread)
+{
+    return thread->vruntime + SCHEDULER_FAIR_WAKEUP_GRAN < current->vruntime;
+}
+
+static thread_t *fair_steal(struct run_queue *rq)
+{
+    for (struct rb_node *node = rq->fair.leftmost;
+         node != NULL;
+         node = rb_next(node)) {
+        thread_t *thread = rb_entry(node, thread_t, fair_node);
+        if (thread->on_cpu)
+            continue;
+        fair_dequeue(rq, thread);
+        return thread;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Move the virtual run time of a thread to the timeline of its new
+ * queue, keeping its distance to the minimum virtual run time.
+ */
+static void fair_migrate(
+    struct run_queue *src,
+    struct run_queue *dst,
+    thread_t *thread)
+{
+    const uint64_t src_min = src->fair.min_vruntime;
+    const uint64_t dst_min = dst->fair.min_vruntime;
+    if (thread->vruntime >= src_min) {
+        thread->vruntime = thread->vruntime - src_min + dst_min;
+    } else {
+        const uint64_t lag = src_min - thread->vruntime;
+        thread->vruntime = (lag < dst_min) ? dst_min - lag : 0;
+    }
+}
+
+const struct scheduler_class fair_class = {
+    .name = "fair",
+    .rank = 1,
+    .init = fair_init,
+    .setup = fair_setup,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick = fair_pick,
+    .tick = fair_tick,
+    .preempt = fair_preempt,
+    .steal = fair_steal,
+    .migrate = fair_migrate,
+};
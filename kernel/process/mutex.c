@@ -0,0 +1,135 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <process/wait.h>
+#include <process/mutex.h>
+#include <process/schedule.h>
+
+/**
+ * @brief Initialize an unlocked mutex.
+ * 
+ * @param mutex The mutex to initialize
+ */
+void mutex_init(mutex_t *mutex)
+{
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    thread_queue_init(&mutex->queue);
+}
+
+/**
+ * @brief Take the mutex if it is free, without setting its owner. The
+ * locked instruction also orders the queuing of a waiter before the check,
+ * see mutex_unlock().
+ */
+static bool __mutex_acquire(mutex_t *mutex)
+{
+    return __sync_bool_compare_and_swap(&mutex->locked, 0, 1);
+}
+
+/**
+ * @brief Spin while the owner of the mutex runs on another CPU, since it
+ * will probably release the mutex soon.
+ * 
+ * @return true if the mutex was taken, false if the caller must sleep
+ */
+static bool mutex_spin(mutex_t *mutex)
+{
+    for (uint_t i = 0; i < MUTEX_SPIN_MAX; i++) {
+        const thread_t *owner = mutex->owner;
+        if (owner != NULL && !owner->on_cpu)
+            return false;
+        if (__mutex_acquire(mutex))
+            return true;
+        __builtin_ia32_pause();
+    }
+    return false;
+}
+
+/**
+ * @brief Check if the current thread can sleep: there is no thread to
+ * switch to during the boot, and the idle threads never sleep.
+ */
+static bool mutex_can_sleep(const thread_t *current)
+{
+    return current != NULL && current != scheduler_get_idle(current->cpu);
+}
+
+/**
+ * @brief Lock a mutex, sleeping until it is released if needed. Must not be
+ * called with preemption disabled, nor from an interrupt handler.
+ * 
+ * @param mutex The mutex to lock
+ */
+void mutex_lock(mutex_t *mutex)
+{
+    thread_t *current = scheduler_get_current_thread();
+    if (!__mutex_acquire(mutex) && !mutex_spin(mutex)) {
+        if (mutex_can_sleep(current)) {
+            wait_event(&mutex->queue, __mutex_acquire(mutex));
+        } else {
+            while (!__mutex_acquire(mutex))
+                __builtin_ia32_pause();
+        }
+    }
+    mutex->owner = current;
+}
+
+/**
+ * @brief Unlock a mutex and wake up the first thread waiting for it. The
+ * mutex must be held by the current thread.
+ * 
+ * @param mutex The mutex to unlock
+ */
+void mutex_unlock(mutex_t *mutex)
+{
+    assert(mutex->locked);
+    mutex->owner = NULL;
+    __sync_lock_release(&mutex->locked);
+
+    // A waiter queues itself before trying to take the mutex: either it
+    // sees the mutex released, or it is seen in the queue here
+    __sync_synchronize();
+    if (!list_empty(&mutex->queue.node))
+        wake_up_one(&mutex->queue);
+}
+
+/**
+ * @brief Try to lock a mutex without waiting.
+ * 
+ * @param mutex The mutex to lock
+ * @return true if the mutex was locked, false if it is already locked
+ */
+bool mutex_trylock(mutex_t *mutex)
+{
+    if (!__mutex_acquire(mutex))
+        return false;
+    mutex->owner = scheduler_get_current_thread();
+    return true;
+}
+
+/**
+ * @brief Check if a mutex is locked.
+ * 
+ * @param mutex The mutex
+ * @return true if the mutex is locked by any thread
+ */
+bool mutex_locked(const mutex_t *mutex)
+{
+    return mutex->locked;
+}
@@ -16,14 +16,16 @@
  * You should have received a copy of the GNU General Public License
  * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <mm/area.h>
 #include <mm/malloc.h>
+#include <mm/vmalloc.h>
 #include <mm/context.h>
+#include <process/reaper.h>
 #include <process/thread.h>
 #include <process/process.h>
 #include <process/schedule.h>
 
 static struct process *system_process;
-static struct thread *system_idle;
 
 static DECLARE_SPINLOCK(list_lock);
 static DECLARE_LIST(processes);
@@ -38,25 +40,18 @@ static void process_idle(void)
 _noreturn
 void process_start(void)
 {
-    scheduler_run(system_idle, false);
-    _unreachable();
+    scheduler_balance_start();
+    scheduler_start();
 }
 
 _init
 void process_init(void)
 {
+    // Creat the system process and the idle thread of the bootstrap CPU
     system_process = process_allocate();
-    system_idle = thread_allocate();
-
-    // Creat the idle process
-    thread_kernel_creat(system_idle);
-    thread_set_entry(system_idle, (vaddr_t) process_idle);
-    scheduler_set_current(system_idle);
-    scheduler_add_thread(system_idle);
-
-    // Creat the system process
     process_creat(system_process);
-    process_add_thread(system_process, system_idle);
+    if (process_creat_idle(0) == NULL)
+        panic("Failed to create the idle thread");
 
     // TODO: Load the init process
     // TODO: Creat the init process
@@ -131,6 +126,33 @@ int process_destroy(process_t *process)
     return 0;
 }
 
+/**
+ * @brief Create the idle thread of a CPU, in the system process. It runs
+ * when the CPU has no other thread to run.
+ * 
+ * @param cpu The index of the CPU
+ * @return thread_t* The idle thread, or NULL if the kernel ran out of
+ * memory.
+ */
+_init
+thread_t *process_creat_idle(const uint_t cpu)
+{
+    thread_t *thread = thread_allocate();
+    if (thread == NULL)
+        return NULL;
+    if (thread_kernel_creat(thread) < 0) {
+        vmfree(thread->kstack.base);
+        fpu_free_state(thread->fpu_state);
+        free(thread);
+        return NULL;
+    }
+
+    thread_set_entry(thread, (vaddr_t) process_idle);
+    scheduler_set_idle(cpu, thread);
+    process_add_thread(system_process, thread);
+    return thread;
+}
+
 /**
  * @brief Add a thread to the system process (PID 0). All kernel threads sould
  * be added to this process.
@@ -144,6 +166,52 @@ void process_add_system_thread(thread_t *thread)
     process_add_thread(system_process, thread);
 }
 
+/**
+ * @brief Create a kernel thread, add it to the system process and make it
+ * ready to run.
+ * 
+ * @param entry The entry point of the thread, must never return.
+ * @return thread_t* The thread created, or NULL if the thread cannot be
+ * created (out of memory or no free TID).
+ */
+_export thread_t *process_creat_kthread(_noreturn void (*entry)(void))
+{
+    thread_t *thread = thread_allocate();
+    if (thread == NULL)
+        return NULL;
+    if (thread_kernel_creat(thread) < 0) {
+        vmfree(thread->kstack.base);
+        fpu_free_state(thread->fpu_state);
+        free(thread);
+        return NULL;
+    }
+
+    thread_set_entry(thread, (vaddr_t) entry);
+    process_add_system_thread(thread);
+    scheduler_add_thread(thread);
+    return thread;
+}
+
+/**
+ * @brief Terminate the current kernel thread. The thread is removed from
+ * the scheduler and from the system process, and destroyed by the reaper
+ * once it has been switched out for the last time. Interrupts stay disabled
+ * until then, so the thread cannot be preempted in between.
+ */
+_export _noreturn void process_exit_kthread(void)
+{
+    thread_t *thread = scheduler_get_current_thread();
+    assert(thread->type == THREAD_KERNEL);
+
+    cli();
+    scheduler_remove_thread(thread);
+    process_remove_thread(thread->process, thread);
+    thread_zombify(thread, 0);
+    reaper_add_thread(thread);
+    schedule(NULL);
+    _unreachable();
+}
+
 /**
  * @brief Clone a process: Copy its memory context and its metadata (uid,
  * open files...).
@@ -181,11 +249,14 @@ int process_clone(process_t *process, process_t *parent)
 
 /**
  * @brief Add a thread to a process. If it is the first thread of the process,
- * the process PID will be updated and set to the thread TID.
+ * the process PID will be updated and set to the thread TID. If the thread is
+ * an user thread, the stack area is created in the process memory context if
+ * it does not exist yet.
  * 
  * @param process The process to add the thread to.
  * @param thread The thread to add to the process.
- * @return int Always 0.
+ * @return int 0 on success, or
+ *  -ENOMEM if the stack area cannot be created.
  */
 int process_add_thread(process_t *process, thread_t *thread)
 {
@@ -193,6 +264,15 @@ int process_add_thread(process_t *process, thread_t *thread)
     assert(!null(thread));
     assert(list_empty(&thread->process_node));
 
+    if (thread->type == THREAD_USER) {
+        const int ret = mm_area_stack(
+            process->mm_context,
+            THREAD_STACK_TOP,
+            THREAD_STACK_SIZE);
+        if (ret < 0 && ret != -EEXIST)
+            return ret;
+    }
+
     thread->process = process;
     if (process->pid < 0)
         process->pid = thread->tid;
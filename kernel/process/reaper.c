@@ -0,0 +1,120 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/list.h>
+#include <lib/spinlock.h>
+#include <mm/context.h>
+#include <process/reaper.h>
+#include <process/process.h>
+#include <process/schedule.h>
+
+/**
+ * @brief The reaper is a kernel thread that destroys the objects that cannot
+ * or should not be destroyed where they are released: dead memory contexts
+ * (see mm_context_drop()) and zombie threads, which cannot free their own
+ * kernel stack. Exiting and switching threads only queue these objects, and
+ * the reaper destroys them a few at a time, sleeping between two passes so
+ * that a large teardown does not monopolize the CPU.
+ */
+
+static DECLARE_SPINLOCK(lock);
+static DECLARE_LIST(dead_threads);
+static thread_t *reaper = NULL;
+
+/**
+ * @brief Wake up the reaper thread, if it is started. Can be called with
+ * preemption disabled.
+ */
+void reaper_wakeup(void)
+{
+    if (reaper != NULL)
+        scheduler_wakeup(reaper);
+}
+
+/**
+ * @brief Queue a thread to be destroyed by the reaper. The thread must have
+ * been zombified and joined, and it must not be running anymore when the
+ * reaper will run, so this function may be called by the thread itself just
+ * before its last call to schedule().
+ * 
+ * @param thread The thread to destroy.
+ */
+void reaper_add_thread(thread_t *thread)
+{
+    assert(thread->state == THREAD_ZOMBIE);
+    assert(list_empty(&thread->scheduler_node));
+    spin_acquire(&lock) {
+        list_add_tail(&dead_threads, &thread->scheduler_node);
+    }
+    reaper_wakeup();
+}
+
+/**
+ * @brief Destroy the oldest thread queued for destruction.
+ * 
+ * @return true if a thread was destroyed, false if the queue is empty.
+ */
+static bool reaper_reap_thread(void)
+{
+    thread_t *thread = NULL;
+    spin_acquire(&lock) {
+        if (list_empty(&dead_threads))
+            return false;
+        thread = list_entry(dead_threads.next, thread_t, scheduler_node);
+        list_remove(&thread->scheduler_node);
+    }
+
+    // The thread may still be switching out on another CPU, on its stack
+    while (thread->on_cpu)
+        cpu_relax();
+    thread_destroy(thread);
+    return true;
+}
+
+/**
+ * @brief The reaper thread: destroy at most REAPER_BATCH objects, then sleep
+ * until new objects are queued or until REAPER_PERIOD elapsed. If objects
+ * are left, the reaper only yields the CPU for a short time.
+ */
+_noreturn
+static void reaper_main(void)
+{
+    for (;;) {
+        uint_t budget = REAPER_BATCH;
+        while (budget > 0) {
+            const bool thread = reaper_reap_thread();
+            const bool context = mm_context_reap();
+            if (!thread && !context)
+                break;
+            budget--;
+        }
+        scheduler_sleep(budget == 0 ? 1 : REAPER_PERIOD);
+    }
+}
+
+/**
+ * @brief Start the reaper thread. Must be called after the process
+ * subsystem is initialized. Objects released before are queued and
+ * destroyed once the reaper runs.
+ */
+_init void reaper_setup(void)
+{
+    reaper = process_creat_kthread(reaper_main);
+    if (reaper == NULL)
+        panic("Failed to start the reaper thread");
+}
@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/list.h>
+#include <process/class.h>
+#include <process/schedule.h>
+
+/**
+ * @file The round robin class. Each priority has its own list of ready
+ * threads, and a bitmap records the non-empty lists: the next thread to run
+ * is the first thread of the list of the lowest bit set, found in O(1)
+ * whatever the number of threads. A thread whose quantum is exhausted gets
+ * a new one and is queued at the tail of its list.
+ */
+static void robin_init(struct run_queue *rq)
+{
+    for (int i = 0; i < SCHEDULER_PRIORITIES; i++)
+        list_init(&rq->robin.lists[i]);
+    rq->robin.bitmap = 0;
+}
+
+static void robin_setup(struct run_queue *rq, thread_t *thread)
+{
+    thread->quantum = SCHEDULER_DEFAULT_QUANTUM;
+}
+
+static void robin_enqueue(
+    struct run_queue *rq,
+    thread_t *thread,
+    const bool wakeup)
+{
+    assert(list_empty(&thread->scheduler_node));
+    if (thread->quantum <= 0)
+        thread->quantum = SCHEDULER_DEFAULT_QUANTUM;
+    list_add_tail(
+        &rq->robin.lists[thread->priority],
+        &thread->scheduler_node);
+    rq->robin.bitmap |= 1u << thread->priority;
+}
+
+static void robin_dequeue(struct run_queue *rq, thread_t *thread)
+{
+    list_remove(&thread->scheduler_node);
+    if (list_empty(&rq->robin.lists[thread->priority]))
+        rq->robin.bitmap &= ~(1u << thread->priority);
+}
+
+static thread_t *robin_pick(struct run_queue *rq)
+{
+    if (rq->robin.bitmap == 0)
+        return NULL;
+
+    const int priority = __builtin_ctz(rq->robin.bitmap);
+    thread_t *thread = list_entry(
+        rq->robin.lists[priority].next,
+        thread_t,
+        scheduler_node);
+    robin_dequeue(rq, thread);
+    return thread;
+}
+
+static bool robin_tick(struct run_queue *rq, thread_t *current)
+{
+    return --current->quantum <= 0;
+}
+
+static bool robin_preempt(const thread_t *current, const thread_t *thread)
+{
+    return thread->priority < current->priority;
+}
+
+/**
+ * @brief Steal the thread that would run last: the tail of the lowest
+ * priority list, skipping the threads still running.
+ */
+static thread_t *robin_steal(struct run_queue *rq)
+{
+    for (int i = SCHEDULER_PRIORITIES - 1; i >= 0; i--) {
+        if (!(rq->robin.bitmap & (1u << i)))
+            continue;
+        list_foreach_reverse(&rq->robin.lists[i], entry) {
+            thread_t *thread = list_entry(entry, thread_t, scheduler_node);
+            if (thread->on_cpu)
+                continue;
+            robin_dequeue(rq, thread);
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+const struct scheduler_class robin_class = {
+    .name = "robin",
+    .rank = 2,
+    .init = robin_init,
+    .setup = robin_setup,
+    .enqueue = robin_enqueue,
+    .dequeue = robin_dequeue,
+    .pick = robin_pick,
+    .tick = robin_tick,
+    .preempt = robin_preempt,
+    .steal = robin_steal,
+};
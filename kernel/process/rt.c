@@ -0,0 +1,162 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <lib/list.h>
+#include <arch/x86/cpu.h>
+#include <process/class.h>
+#include <process/schedule.h>
+
+/**
+ * @file The real-time class, ranked above all other classes: a ready
+ * real-time thread always runs before normal threads, and a real-time
+ * thread woken up preempts a normal thread at the next return from
+ * interrupt. Each of the SCHEDULER_RT_PRIORITIES static priorities has its
+ * own list, with a bitmap of the non-empty lists like the round robin
+ * class.
+ * 
+ * A FIFO thread runs until it sleeps or is preempted by a higher priority
+ * thread. A RR thread also gets a quantum, and goes to the tail of its list
+ * when it is exhausted. Its quantum is also refreshed when it is woken up
+ * with an exhausted quantum. A thread preempted with time left goes back to
+ * the head of its list.
+ * 
+ * The delay between the wakeup of a real-time thread and the moment it is
+ * picked is measured with the TSC, see scheduler_get_rt_stats().
+ */
+static void rt_init(struct run_queue *rq)
+{
+    for (int i = 0; i < SCHEDULER_RT_PRIORITIES; i++)
+        list_init(&rq->rt.lists[i]);
+    for (int i = 0; i < RT_BITMAP_WORDS; i++)
+        rq->rt.bitmap[i] = 0;
+    rq->rt.stats.wakeups = 0;
+    rq->rt.stats.max_latency = 0;
+    rq->rt.stats.total_latency = 0;
+}
+
+static void rt_setup(struct run_queue *rq, thread_t *thread)
+{
+    thread->quantum = SCHEDULER_RT_QUANTUM;
+    thread->wakeup_tsc = 0;
+}
+
+static void rt_enqueue(
+    struct run_queue *rq,
+    thread_t *thread,
+    const bool wakeup)
+{
+    struct list_head *const list = &rq->rt.lists[thread->rt_priority];
+    assert(list_empty(&thread->scheduler_node));
+
+    // A RR thread that exhausted its quantum, even before sleeping, gets
+    // a new one and goes to the tail of its list
+    const bool expired = thread->policy == SCHEDULER_POLICY_RR &&
+                         thread->quantum <= 0;
+    if (expired)
+        thread->quantum = SCHEDULER_RT_QUANTUM;
+    if (wakeup) {
+        thread->wakeup_tsc = rdtsc();
+        list_add_tail(list, &thread->scheduler_node);
+    } else if (expired) {
+        list_add_tail(list, &thread->scheduler_node);
+    } else {
+        list_add_head(list, &thread->scheduler_node);
+    }
+    rq->rt.bitmap[thread->rt_priority / 32] |=
+        1u << thread->rt_priority % 32;
+}
+
+static void rt_dequeue(struct run_queue *rq, thread_t *thread)
+{
+    list_remove(&thread->scheduler_node);
+    if (list_empty(&rq->rt.lists[thread->rt_priority]))
+        rq->rt.bitmap[thread->rt_priority / 32] &=
+            ~(1u << thread->rt_priority % 32);
+}
+
+static thread_t *rt_pick(struct run_queue *rq)
+{
+    struct scheduler_rt_stats *const stats = &rq->rt.stats;
+    for (int i = 0; i < RT_BITMAP_WORDS; i++) {
+        if (rq->rt.bitmap[i] == 0)
+            continue;
+
+        const int priority = i * 32 + __builtin_ctz(rq->rt.bitmap[i]);
+        thread_t *thread = list_entry(
+            rq->rt.lists[priority].next,
+            thread_t,
+            scheduler_node);
+        rt_dequeue(rq, thread);
+
+        if (thread->wakeup_tsc != 0) {
+            const uint64_t latency = rdtsc() - thread->wakeup_tsc;
+            if (latency > stats->max_latency)
+                stats->max_latency = latency;
+            stats->total_latency += latency;
+            stats->wakeups++;
+            thread->wakeup_tsc = 0;
+        }
+        return thread;
+    }
+    return NULL;
+}
+
+static bool rt_tick(struct run_queue *rq, thread_t *current)
+{
+    if (current->policy != SCHEDULER_POLICY_RR)
+        return false;
+    return --current->quantum <= 0;
+}
+
+static bool rt_preempt(const thread_t *current, const thread_t *thread)
+{
+    return thread->rt_priority < current->rt_priority;
+}
+
+/**
+ * @brief Steal the lowest priority real-time thread that is not running: a
+ * thread moved to an idle CPU runs immediately.
+ */
+static thread_t *rt_steal(struct run_queue *rq)
+{
+    for (int i = SCHEDULER_RT_PRIORITIES - 1; i >= 0; i--) {
+        if (!(rq->rt.bitmap[i / 32] & (1u << i % 32)))
+            continue;
+        list_foreach_reverse(&rq->rt.lists[i], entry) {
+            thread_t *thread = list_entry(entry, thread_t, scheduler_node);
+            if (thread->on_cpu)
+                continue;
+            rt_dequeue(rq, thread);
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+const struct scheduler_class rt_class = {
+    .name = "rt",
+    .rank = 0,
+    .init = rt_init,
+    .setup = rt_setup,
+    .enqueue = rt_enqueue,
+    .dequeue = rt_dequeue,
+    .pick = rt_pick,
+    .tick = rt_tick,
+    .preempt = rt_preempt,
+    .steal = rt_steal,
+};
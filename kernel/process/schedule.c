@@ -18,89 +18,333 @@
  */
 #include <lib/list.h>
 #include <lib/spinlock.h>
+#include <core/timer.h>
 #include <core/preempt.h>
 #include <arch/x86/fpu.h>
 #include <arch/x86/gdt.h>
+#include <arch/x86/smp.h>
 #include <arch/x86/tss.h>
+#include <arch/x86/percpu.h>
+#include <process/class.h>
 #include <process/process.h>
 #include <process/schedule.h>
 
-static DECLARE_SPINLOCK(run_queue_lock);
-static DECLARE_LIST(run_queue);
+/**
+ * @brief The file contains the core of the scheduler. Threads are scheduled
+ * by classes (see process/class.h), each with its own queue and policies:
+ * the real-time class (rt.c), the fair class (fair.c) and the round robin
+ * class (robin.c). The next thread to run is taken from the highest ranked
+ * class with a ready thread.
+ * 
+ * Only ready threads are queued: the running thread is queued again when
+ * it is preempted, and sleeping threads when they are woken up. The idle
+ * thread belongs to no class and runs when all queues are empty.
+ * 
+ * Each CPU has its own run queue, and a thread stays in the run queue of
+ * the CPU it was placed on. The queues are balanced periodically, and by a
+ * CPU that has no thread to run: the balancing moves ready threads from the
+ * busiest queue. The balancing and the placement of new threads are only
+ * enabled once the boot is completed, see scheduler_balance_start().
+ */
+static DEFINE_PER_CPU(struct run_queue, run_queue);
+static bool balance_enabled = false;
+
+// The running thread of the CPU, also in its run queue: the copy is read
+// with a single instruction without locking the run queue
+static DEFINE_PER_CPU(thread_t *, current_thread);
+
+// Scheduling classes of each policy
+static const struct scheduler_class *const classes[SCHEDULER_POLICIES] = {
+    [SCHEDULER_POLICY_FIFO] = &rt_class,
+    [SCHEDULER_POLICY_RR] = &rt_class,
+    [SCHEDULER_POLICY_FAIR] = &fair_class,
+    [SCHEDULER_POLICY_ROBIN] = &robin_class,
+};
+
+// Scheduling classes, ordered by rank
+static const struct scheduler_class *const ranked[SCHEDULER_CLASSES] = {
+    &rt_class,
+    &fair_class,
+    &robin_class,
+};
+
+static const struct scheduler_class *scheduler_class(const thread_t *thread)
+{
+    return classes[thread->policy];
+}
+
+/**
+ * @brief Get the run queue of the current CPU. Interrupts must be disabled,
+ * otherwise the thread may be moved to another CPU.
+ */
+static struct run_queue *this_rq(void)
+{
+    return this_cpu_ptr(run_queue);
+}
+
+/**
+ * @brief Check if a thread is the idle thread of a CPU. Idle threads are
+ * never moved, and other threads are never idle threads.
+ */
+static bool scheduler_is_idle(const thread_t *thread)
+{
+    return thread == per_cpu_ptr(run_queue, thread->cpu)->idle;
+}
+
+/**
+ * @brief Lock a run queue with interrupts disabled.
+ * 
+ * @return uint32_t The flags to give to rq_unlock()
+ */
+static uint32_t rq_lock(struct run_queue *rq)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&rq->lock);
+    return eflags;
+}
 
-static thread_t *current = NULL;
+static void rq_unlock(struct run_queue *rq, const uint32_t eflags)
+{
+    spin_unlock(&rq->lock);
+    set_eflags(eflags);
+}
 
 /**
- * @brief The file contains the scheduler implementation. For now, it is
- * a simple round robin scheduler with awful performance: IO thread can
- * be starved if the CPU is very busy, and the algorithm is not scalable
- * because we use a lock to avoid race conditions.
+ * @brief Lock the run queue of a thread. The thread may be moved to another
+ * run queue while the lock is taken, so the queue is checked again once it
+ * is locked.
  * 
- * It is largely suffisant for now, but it should be improved in the future.
+ * @param thread The thread
+ * @param eflags Where to save the flags to give to rq_unlock()
+ * @return struct run_queue* The locked run queue of the thread
  */
+static struct run_queue *thread_rq_lock(thread_t *thread, uint32_t *eflags)
+{
+    for (;;) {
+        struct run_queue *rq = per_cpu_ptr(run_queue, thread->cpu);
+        *eflags = rq_lock(rq);
+        if (rq == per_cpu_ptr(run_queue, thread->cpu))
+            return rq;
+        rq_unlock(rq, *eflags);
+    }
+}
 
 /**
- * @brief Redisitrubte a quantum for all thread. This function does not lock
- * the run queue, it is to the caller to do so.
+ * @brief Lock two run queues, always in the order of their CPU so that two
+ * CPUs locking the same queues cannot deadlock. Interrupts must be
+ * disabled.
  */
-static void scheduler_redistribute(void)
+static void rq_double_lock(struct run_queue *a, struct run_queue *b)
 {
-    list_foreach(&run_queue, entry) {
-        thread_t *thread = list_entry(entry, thread_t, scheduler_node);
-        if (thread->tid != THREAD_IDLE_TID)
-            thread->quantum = SCHEDULER_DEFAULT_QUANTUM;
+    if (a->cpu > b->cpu) {
+        struct run_queue *tmp = a;
+        a = b;
+        b = tmp;
     }
+    spin_lock(&a->lock);
+    spin_lock(&b->lock);
 }
 
 /**
- * @brief Find the next thread to run. The algorithm is simple: we try to
- * find a ready thread with a quantum left. If none is found, we redistribute
- * the quantum to all threads and we try again. And if we still don't find
- * any thread, we return the idle thread.
+ * @brief Get the number of threads that compete for a CPU, including its
+ * running thread unless it is the idle thread.
+ */
+static uint_t rq_load(const struct run_queue *rq)
+{
+    return rq->nr_ready + (rq->current != rq->idle);
+}
+
+/**
+ * @brief Add a ready thread to the queue of its class. The lock must be
+ * held.
+ */
+static void __scheduler_enqueue(
+    struct run_queue *rq,
+    thread_t *thread,
+    const bool wakeup)
+{
+    assert(!thread->queued);
+    scheduler_class(thread)->enqueue(rq, thread, wakeup);
+    thread->queued = true;
+    rq->nr_ready++;
+}
+
+/**
+ * @brief Remove a thread from the queue of its class. The lock must be
+ * held.
+ */
+static void __scheduler_dequeue(struct run_queue *rq, thread_t *thread)
+{
+    assert(thread->queued);
+    scheduler_class(thread)->dequeue(rq, thread);
+    thread->queued = false;
+    rq->nr_ready--;
+}
+
+/**
+ * @brief Find the next thread to run and remove it from the run queue. The
+ * lock must be held.
  * 
  * @return thread_t* The next thread to run: cannot be NULL. If there is no
  * thread to run, it returns the idle thread.
  */
-static thread_t* schedule_next(void)
+static thread_t* schedule_next(struct run_queue *rq)
 {
-    spin_acquire(&run_queue_lock) {
-        // Find the next thread to run
-        list_foreach(&run_queue, entry) {
-            thread_t *thread = list_entry(entry, thread_t, scheduler_node);
-            if (thread->tid != THREAD_IDLE_TID &&
-                thread->state == THREAD_READY && 
-                thread->quantum > 0)
-                return thread;
-        }
+    if (rq->nr_ready == 0)
+        return rq->idle;
 
-        // All thread are blocked, we need to redistribute the quantum.
-        scheduler_redistribute();
-        list_foreach(&run_queue, entry) {
-            thread_t *thread = list_entry(entry, thread_t, scheduler_node);
-            if (thread->tid != THREAD_IDLE_TID &&
-                thread->state == THREAD_READY && 
-                thread->quantum > 0)
-                return thread;
+    for (int i = 0; i < SCHEDULER_CLASSES; i++) {
+        thread_t *thread = ranked[i]->pick(rq);
+        if (thread != NULL) {
+            thread->queued = false;
+            rq->nr_ready--;
+            return thread;
         }
+    }
+    panic("%u threads are ready but none was found", rq->nr_ready);
+}
 
-        // No threads ready to run, return the idle thread
-        list_foreach(&run_queue, entry) {
-            thread_t *thread = list_entry(entry, thread_t, scheduler_node);
-            if (thread->tid == THREAD_IDLE_TID)
-                return thread;
+/**
+ * @brief Reschedule the current thread of a run queue at its next return
+ * from interrupt. If the run queue is the one of another CPU, the CPU is
+ * interrupted. The lock must be held.
+ */
+static void __scheduler_resched(struct run_queue *rq)
+{
+    rq->current->reschedule = true;
+    if (rq->cpu != smp_cpu_id())
+        smp_send_reschedule(rq->cpu);
+}
+
+/**
+ * @brief Move ready threads from the busiest run queue to the given run
+ * queue, if the busiest queue has at least two more ready threads. Half of
+ * the difference is moved, and threads still running on their CPU are
+ * skipped. Interrupts must be disabled and the run queue must not be locked.
+ * 
+ * @param rq The run queue of the current CPU
+ */
+static void scheduler_balance(struct run_queue *rq)
+{
+    struct run_queue *busiest = NULL;
+    for (uint_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct run_queue *other = per_cpu_ptr(run_queue, cpu);
+        if (other == rq || !smp_cpu_online(cpu))
+            continue;
+        if (busiest == NULL || other->nr_ready > busiest->nr_ready)
+            busiest = other;
+    }
+    if (busiest == NULL || busiest->nr_ready < rq->nr_ready + 2)
+        return;
+
+    rq_double_lock(rq, busiest);
+    uint_t count = 0;
+    if (busiest->nr_ready >= rq->nr_ready + 2)
+        count = (busiest->nr_ready - rq->nr_ready) / 2;
+
+    for (int i = 0; i < SCHEDULER_CLASSES && count > 0; i++) {
+        const struct scheduler_class *class = ranked[i];
+        thread_t *thread;
+        while (count > 0 && (thread = class->steal(busiest)) != NULL) {
+            thread->queued = false;
+            busiest->nr_ready--;
+            if (class->migrate != NULL)
+                class->migrate(busiest, rq, thread);
+            thread->cpu = rq->cpu;
+            __scheduler_enqueue(rq, thread, false);
+            count--;
         }
     }
-    _unreachable();
+
+    if (rq->current == rq->idle && rq->nr_ready != 0)
+        rq->current->reschedule = true;
+    spin_unlock(&busiest->lock);
+    spin_unlock(&rq->lock);
 }
 
 /**
- * @brief Do I really need to explain ?
+ * @brief Set the idle thread of a CPU and initialize its run queue. The
+ * idle thread runs when there is no other thread ready to run, and is the
+ * current thread of the CPU until its first scheduling.
  * 
- * @param thread The thread to add.
+ * @param cpu The index of the CPU
+ * @param thread The idle thread.
+ */
+_init void scheduler_set_idle(const uint_t cpu, thread_t *thread)
+{
+    struct run_queue *rq = per_cpu_ptr(run_queue, cpu);
+    spin_init(&rq->lock);
+    rq->cpu = cpu;
+    rq->nr_ready = 0;
+    rq->ticks = 0;
+    for (int i = 0; i < SCHEDULER_CLASSES; i++)
+        ranked[i]->init(rq);
+
+    thread->state = THREAD_READY;
+    thread->cpu = cpu;
+    thread->on_cpu = true;
+    rq->current = thread;
+    rq->idle = thread;
+    *per_cpu_ptr(current_thread, cpu) = thread;
+}
+
+/**
+ * @brief Get the idle thread of a CPU.
+ * 
+ * @param cpu The index of the CPU
+ * @return thread_t* The idle thread, or NULL if it was not set
  */
-_init void scheduler_set_current(thread_t *thread)
+thread_t *scheduler_get_idle(const uint_t cpu)
 {
-    current = thread;
+    assert(cpu < SMP_MAX_CPUS);
+    return per_cpu_ptr(run_queue, cpu)->idle;
+}
+
+/**
+ * @brief Enable the load balancing and the placement of new threads on
+ * other CPUs. Until then, all threads run on the bootstrap processor.
+ */
+void scheduler_balance_start(void)
+{
+    balance_enabled = true;
+}
+
+/**
+ * @brief Switch from a thread to another on the current CPU. The previous
+ * thread can run on another CPU as soon as its state is saved.
+ * 
+ * @param prev The thread running on the current CPU
+ * @param next The thread to run
+ * @param save A flag to indicate if the previous thread state must be
+ * saved. If set, the thread state is saved in the thread structure and
+ * will resume to the caller function. If not, the thread state must be
+ * already saved in the thread structure.
+ */
+static void scheduler_switch(thread_t *prev, thread_t *next, const bool save)
+{
+    if (next->type == THREAD_USER)
+        tss_get_current()->esp0 = next->kstack.top;
+
+    if (save)
+        save_switch_to(&prev->cpu_state, next->cpu_state, &prev->on_cpu);
+    else
+        switch_to(next->cpu_state, &prev->on_cpu);
+}
+
+/**
+ * @brief Run the idle thread of the current CPU, with an empty run queue.
+ * Called once by each CPU at the end of its initialization.
+ */
+_noreturn
+void scheduler_start(void)
+{
+    cli();
+    thread_t *idle = this_rq()->idle;
+    assert(idle != NULL);
+    idle->state = THREAD_RUNNING;
+    switch_to(idle->cpu_state, NULL);
+    _unreachable();
 }
 
 /**
@@ -118,107 +362,402 @@ _no_inline
 void schedule(cpu_state_t *state) 
 {
     assert(preempt_enabled());
-    
-    thread_t *next = schedule_next();
-    if (current == NULL || current == next)
+    const uint32_t eflags = get_eflags();
+    cli();
+
+    struct run_queue *rq = this_rq();
+    thread_t *prev = rq->current;
+    if (prev == NULL) {
+        set_eflags(eflags);
+        return;
+    }
+
+    if (rq->nr_ready == 0 && balance_enabled)
+        scheduler_balance(rq);
+
+    spin_lock(&rq->lock);
+    // The current thread competes with the ready threads if it can still
+    // run, or if it was woken up before calling this function
+    if (prev->state == THREAD_RUNNING)
+        prev->state = THREAD_READY;
+    if (prev != rq->idle && prev->state == THREAD_READY)
+        __scheduler_enqueue(rq, prev, false);
+    thread_t *next = schedule_next(rq);
+    next->state = THREAD_RUNNING;
+    prev->reschedule = false;
+    if (next != prev) {
+        next->on_cpu = true;
+        rq->current = next;
+        percpu_write(current_thread, next);
+    }
+    spin_unlock(&rq->lock);
+
+    if (next == prev) {
+        set_eflags(eflags);
         return;
-    
-    set_task_switched();
-    if (current->state == THREAD_RUNNING)
-        current->state = THREAD_READY;
-    if (current->fpu_loaded) {
-        fpu_save(current->fpu_state);
-        current->fpu_loaded = false;
     }
     
-    if (next->type == THREAD_KERNEL) {
-        // We keep the current process context
-    } else if (current->process->mm_context != next->process->mm_context) {
-        mm_context_use(next->process->mm_context);
+    fpu_switch(prev, next);
+
+    // Kernel threads never access user memory, so they run on the context
+    // of the previous thread without taking a reference to it: the context
+    // is unloaded by mm_context_drop() before being destroyed. The switch
+    // itself never changes any usage counter nor destroys any context, and
+    // mm_context_set() does not reload CR3 if the context is already active.
+    // In both cases, the loaded page directory is synchronized with the
+    // kernel page tables, so the kernel stack of next is always mapped
+    if (next->type == THREAD_USER)
         mm_context_set(next->process->mm_context);
-        mm_context_drop(current->process->mm_context);
-    }
+    else
+        mm_context_sync_kernel();
 
-    current->reschedule = false;
-    current->cpu_state = state;
-    scheduler_run(next, !state);
+    prev->cpu_state = state;
+    scheduler_switch(prev, next, !state);
+    set_eflags(eflags);
 }
 
 /**
- * @brief This function is called every tick. It is used to update the quantum
- * of the current thread. If the quantum is 0 or if it is the idle processus,
- * the reschedule flag is set.
+ * @brief This function is called every tick on each CPU. The tick is
+ * accounted to the current thread by its class, which decides if the thread
+ * must be rescheduled. The idle thread is rescheduled if another thread is
+ * ready. The run queues are balanced every SCHEDULER_BALANCE_PERIOD ticks,
+ * or every tick if the CPU is idle.
  */
 void schedule_tick(void)
 {
-    if (current->tid == THREAD_IDLE_TID) {
-        current->reschedule = true;
-    } else {
-        current->quantum--;
-        if (current->quantum == 0)
+    const uint32_t eflags = get_eflags();
+    cli();
+
+    struct run_queue *rq = this_rq();
+    spin_lock(&rq->lock);
+    thread_t *current = rq->current;
+    if (current == rq->idle) {
+        if (rq->nr_ready != 0)
             current->reschedule = true;
+    } else if (scheduler_class(current)->tick(rq, current)) {
+        current->reschedule = true;
     }
+    const bool balance = current == rq->idle ||
+                         ++rq->ticks % SCHEDULER_BALANCE_PERIOD == 0;
+    spin_unlock(&rq->lock);
+
+    if (balance && balance_enabled)
+        scheduler_balance(rq);
+    set_eflags(eflags);
 }
 
 /**
- * @brief Run the given thread. This function is called by the scheduler
- * internally and to run the first thread during the boot.
- * 
- * @param thread The thread to run
- * @param save A flag to indicate if the current thread state must be saved.
- * If set, the current thread state is saved in the thread structure and will
- * resume to the caller function. If not, the thread state must be already
- * staved in the thread structure.
+ * @brief Check if a thread that becomes ready must preempt the current
+ * thread of its run queue: if its class is ranked higher, or if its class
+ * decides so.
  */
-void scheduler_run(thread_t *thread, const bool save)
+static bool scheduler_preempt(
+    const struct run_queue *rq,
+    const thread_t *thread)
 {
-    thread_t *prev = current;
+    const thread_t *current = rq->current;
+    if (current == rq->idle)
+        return true;
+    const struct scheduler_class *class = scheduler_class(thread);
+    const int rank = scheduler_class(current)->rank;
+    if (class->rank != rank)
+        return class->rank < rank;
+    return class->preempt(current, thread);
+}
 
-    current = thread;
-    current->state = THREAD_RUNNING;
-    if (current->type == THREAD_USER)
-        tss_get_current()->esp0 = current->kstack.top;
+/**
+ * @brief Queue a ready thread. If it must preempt the current thread, the
+ * current thread is rescheduled at the next return from interrupt. The lock
+ * must be held.
+ */
+static void __scheduler_ready(
+    struct run_queue *rq,
+    thread_t *thread,
+    const bool wakeup)
+{
+    thread->state = THREAD_READY;
+    if (thread == rq->current)
+        return;
+    __scheduler_enqueue(rq, thread, wakeup);
+    if (scheduler_preempt(rq, thread))
+        __scheduler_resched(rq);
+}
 
-    if(save)
-        save_switch_to(&prev->cpu_state, current->cpu_state);
-    else
-        switch_to(current->cpu_state);
+/**
+ * @brief Find the run queue of the CPU with the fewest threads to run. New
+ * threads are placed on it once the balancing is enabled.
+ */
+static struct run_queue *scheduler_idlest(void)
+{
+    struct run_queue *idlest = per_cpu_ptr(run_queue, 0);
+    if (!balance_enabled)
+        return idlest;
+    for (uint_t cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+        struct run_queue *rq = per_cpu_ptr(run_queue, cpu);
+        if (smp_cpu_online(cpu) && rq_load(rq) < rq_load(idlest))
+            idlest = rq;
+    }
+    return idlest;
 }
 
 /**
- * @brief Add a thread to the run queue and set the thread state to ready.
- * The thread added is given a quantum of SCHEDULER_DEFAULT_QUANTUM.
+ * @brief Add a thread to a run queue and set the thread state to ready.
+ * The thread joins the class of its policy, on the least loaded CPU.
  * 
  * @param thread The thread to add.
  * @return int Always 0.
  */
 int scheduler_add_thread(thread_t *thread)
 {
-    assert(list_empty(&thread->scheduler_node));
-    thread->quantum = SCHEDULER_DEFAULT_QUANTUM;
-    thread->state = THREAD_READY;
-    spin_acquire(&run_queue_lock) {
-        list_add_tail(&run_queue, &thread->scheduler_node);
-    }
+    struct run_queue *rq = scheduler_idlest();
+    thread->cpu = rq->cpu;
+
+    const uint32_t eflags = rq_lock(rq);
+    scheduler_class(thread)->setup(rq, thread);
+    __scheduler_ready(rq, thread, false);
+    rq_unlock(rq, eflags);
     return 0;
 }
 
 /**
- * @brief Remove a thread from the run queue and set its state to UNRUNNABLE.
+ * @brief Remove a thread from its run queue and set its state to
+ * UNRUNNABLE. The thread may be the current thread, which is not queued: it
+ * will not be run anymore once it calls schedule().
  * 
  * @param thread The thread to remove.
  * @return int Always 0.
  */
 int scheduler_remove_thread(thread_t *thread)
 {
-    assert(!list_empty(&thread->scheduler_node));
-    spin_acquire(&run_queue_lock) {
-        list_remove(&thread->scheduler_node);
-    }
+    assert(!scheduler_is_idle(thread));
+    uint32_t eflags;
+    struct run_queue *rq = thread_rq_lock(thread, &eflags);
+    if (thread->queued)
+        __scheduler_dequeue(rq, thread);
     thread->state = THREAD_UNRUNNABLE;
+    rq_unlock(rq, eflags);
     return 0;
 }
 
+/**
+ * @brief Wake up a sleeping thread: it will be run again at the next
+ * scheduling. If the thread is not sleeping, this function does nothing.
+ * Can be called from an interrupt handler and from any CPU.
+ * 
+ * @param thread The thread to wake up.
+ * @return bool true if the thread was sleeping and was woken up
+ */
+bool scheduler_wakeup(thread_t *thread)
+{
+    uint32_t eflags;
+    struct run_queue *rq = thread_rq_lock(thread, &eflags);
+    const bool sleeping = thread->state == THREAD_SLEEPING;
+    if (sleeping)
+        __scheduler_ready(rq, thread, true);
+    rq_unlock(rq, eflags);
+    return sleeping;
+}
+
+/**
+ * @brief Remove a thread from its queue before changing its scheduling
+ * parameters. The lock must be held.
+ * 
+ * @return bool true if the thread was queued and must be queued again
+ * with __scheduler_requeue()
+ */
+static bool __scheduler_unqueue(struct run_queue *rq, thread_t *thread)
+{
+    if (!thread->queued)
+        return false;
+    __scheduler_dequeue(rq, thread);
+    return true;
+}
+
+/**
+ * @brief Queue again a thread after changing its scheduling parameters. The
+ * current thread is rescheduled so that the change is applied immediately.
+ * The lock must be held.
+ */
+static void __scheduler_requeue(
+    struct run_queue *rq,
+    thread_t *thread,
+    const bool queued)
+{
+    if (queued)
+        __scheduler_ready(rq, thread, false);
+    else if (thread == rq->current)
+        __scheduler_resched(rq);
+}
+
+/**
+ * @brief Change the round robin priority of a thread. The thread is moved
+ * to the list of its new priority if it is queued.
+ * 
+ * @param thread The thread
+ * @param priority The new priority, from 0 (highest) to
+ * SCHEDULER_PRIORITIES - 1 (lowest)
+ * @return int 0 on success, or
+ *  -EINVAL if the priority is invalid or the thread is an idle thread
+ */
+int scheduler_set_priority(thread_t *thread, const int priority)
+{
+    if (priority < 0 || priority >= SCHEDULER_PRIORITIES ||
+        scheduler_is_idle(thread))
+        return -EINVAL;
+
+    uint32_t eflags;
+    struct run_queue *rq = thread_rq_lock(thread, &eflags);
+    const bool queued = __scheduler_unqueue(rq, thread);
+    thread->priority = priority;
+    __scheduler_requeue(rq, thread, queued);
+    rq_unlock(rq, eflags);
+    return 0;
+}
+
+/**
+ * @brief Change the nice level of a thread, used by the fair policy: each
+ * level gives about 10% less CPU time than the previous one.
+ * 
+ * @param thread The thread
+ * @param nice The new nice level, from SCHEDULER_NICE_MIN (highest weight)
+ * to SCHEDULER_NICE_MAX (lowest weight)
+ * @return int 0 on success, or
+ *  -EINVAL if the nice level is invalid or the thread is an idle thread
+ */
+int scheduler_set_nice(thread_t *thread, const int nice)
+{
+    if (nice < SCHEDULER_NICE_MIN || nice > SCHEDULER_NICE_MAX ||
+        scheduler_is_idle(thread))
+        return -EINVAL;
+
+    uint32_t eflags;
+    struct run_queue *rq = thread_rq_lock(thread, &eflags);
+    const bool queued = __scheduler_unqueue(rq, thread);
+    thread->nice = nice;
+    thread->weight = fair_nice_weight(nice);
+    __scheduler_requeue(rq, thread, queued);
+    rq_unlock(rq, eflags);
+    return 0;
+}
+
+/**
+ * @brief Change the scheduling policy of a thread: the thread leaves its
+ * class and joins the class of the new policy.
+ * 
+ * @param thread The thread
+ * @param policy The new policy (SCHEDULER_POLICY_*)
+ * @return int 0 on success, or
+ *  -EINVAL if the policy is invalid or the thread is an idle thread
+ */
+_export int scheduler_set_policy(thread_t *thread, const int policy)
+{
+    if (policy < 0 || policy >= SCHEDULER_POLICIES ||
+        scheduler_is_idle(thread))
+        return -EINVAL;
+
+    uint32_t eflags;
+    struct run_queue *rq = thread_rq_lock(thread, &eflags);
+    const bool queued = __scheduler_unqueue(rq, thread);
+    thread->policy = policy;
+    classes[policy]->setup(rq, thread);
+    __scheduler_requeue(rq, thread, queued);
+    rq_unlock(rq, eflags);
+    return 0;
+}
+
+/**
+ * @brief Change the static priority of a thread, used by the real-time
+ * policies (FIFO and RR).
+ * 
+ * @param thread The thread
+ * @param priority The new priority, from 0 (highest) to
+ * SCHEDULER_RT_PRIORITIES - 1 (lowest)
+ * @return int 0 on success, or
+ *  -EINVAL if the priority is invalid or the thread is an idle thread
+ */
+_export int scheduler_set_rt_priority(thread_t *thread, const int priority)
+{
+    if (priority < 0 || priority >= SCHEDULER_RT_PRIORITIES ||
+        scheduler_is_idle(thread))
+        return -EINVAL;
+
+    uint32_t eflags;
+    struct run_queue *rq = thread_rq_lock(thread, &eflags);
+    const bool queued = __scheduler_unqueue(rq, thread);
+    thread->rt_priority = priority;
+    __scheduler_requeue(rq, thread, queued);
+    rq_unlock(rq, eflags);
+    return 0;
+}
+
+/**
+ * @brief Get a copy of the wakeup latency counters of real-time threads,
+ * summed over all CPUs: the worst case is the maximum delay between the
+ * wakeup of a real-time thread and the moment it was picked to run.
+ * 
+ * @param info Where to copy the counters
+ */
+_export void scheduler_get_rt_stats(struct scheduler_rt_stats *info)
+{
+    info->wakeups = 0;
+    info->max_latency = 0;
+    info->total_latency = 0;
+    for (uint_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct run_queue *rq = per_cpu_ptr(run_queue, cpu);
+        if (rq->idle == NULL)
+            continue;
+
+        const uint32_t eflags = rq_lock(rq);
+        const struct scheduler_rt_stats *stats = &rq->rt.stats;
+        info->wakeups += stats->wakeups;
+        info->total_latency += stats->total_latency;
+        if (stats->max_latency > info->max_latency)
+            info->max_latency = stats->max_latency;
+        rq_unlock(rq, eflags);
+    }
+}
+
+/**
+ * @brief Timer callback used to wake up a thread sleeping in
+ * scheduler_sleep().
+ * 
+ * @param data The thread to wake up.
+ */
+static void scheduler_timeout(void *data)
+{
+    scheduler_wakeup((thread_t *) data);
+}
+
+/**
+ * @brief Put the current thread to sleep for at least the given time. Other
+ * threads are run in the meantime. Must not be called with preemption
+ * disabled.
+ * 
+ * Interrupts are disabled from the moment the thread is marked as sleeping
+ * until it calls the scheduler: if the thread was preempted in between, it
+ * would leave its run queue before its timer exists and never wake up.
+ * 
+ * @param ms The minimum sleeping time, in milliseconds.
+ */
+_export void scheduler_sleep(const time_t ms)
+{
+    timer_t timer;
+    timer_init(&timer);
+    timer.callback = scheduler_timeout;
+    timer.data = scheduler_get_current_thread();
+    timer_expire(&timer, ms);
+
+    thread_t *current = timer.data;
+    const uint32_t eflags = get_eflags();
+    cli();
+    current->state = THREAD_SLEEPING;
+    if (timer_add(&timer) == 0)
+        schedule(NULL);
+    set_eflags(eflags);
+    timer_remove(&timer);
+    current->state = THREAD_RUNNING;
+}
+
 /**
  * @brief Return the current thread on the current CPU.
  * 
@@ -226,5 +765,5 @@ int scheduler_remove_thread(thread_t *thread)
  */
 thread_t *scheduler_get_current_thread(void)
 {
-    return current;
+    return percpu_read(current_thread);
 }
@@ -0,0 +1,213 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <arch/x86/cpu.h>
+#include <process/wait.h>
+#include <process/semaphore.h>
+
+/**
+ * @brief Semaphores are built on wait queues: their state is protected by
+ * the lock of their wait queue, always taken with interrupts disabled. The
+ * functions that take the semaphore are used as conditions of wait_event(),
+ * which calls them with interrupts already disabled. Semaphores must not be
+ * taken with preemption disabled, nor from an interrupt handler.
+ */
+
+static uint32_t sem_lock(thread_queue_t *queue)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&queue->lock);
+    return eflags;
+}
+
+static void sem_unlock(thread_queue_t *queue, const uint32_t eflags)
+{
+    spin_unlock(&queue->lock);
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Initialize a counting semaphore.
+ * 
+ * @param sem The semaphore to initialize
+ * @param count The initial count
+ */
+void semaphore_init(semaphore_t *sem, const uint_t count)
+{
+    sem->count = count;
+    thread_queue_init(&sem->queue);
+}
+
+/**
+ * @brief Decrement the count of a semaphore if it is positive.
+ * 
+ * @param sem The semaphore
+ * @return true if the count was decremented
+ */
+bool semaphore_trydown(semaphore_t *sem)
+{
+    bool done = false;
+    const uint32_t eflags = sem_lock(&sem->queue);
+    if (sem->count > 0) {
+        sem->count--;
+        done = true;
+    }
+    sem_unlock(&sem->queue, eflags);
+    return done;
+}
+
+/**
+ * @brief Sleep until the count of a semaphore is positive, and decrement
+ * it.
+ * 
+ * @param sem The semaphore
+ */
+void semaphore_down(semaphore_t *sem)
+{
+    wait_event(&sem->queue, semaphore_trydown(sem));
+}
+
+/**
+ * @brief Same as semaphore_down(), but give up after a timeout.
+ * 
+ * @param sem The semaphore
+ * @param ms The timeout, in milliseconds
+ * @return int 0 if the count was decremented, or
+ *  -ETIMEDOUT if the timeout expired before
+ */
+int semaphore_down_timeout(semaphore_t *sem, const time_t ms)
+{
+    return wait_event_timeout(&sem->queue, semaphore_trydown(sem), ms);
+}
+
+/**
+ * @brief Increment the count of a semaphore and wake up the first waiting
+ * thread. Can be called from an interrupt handler.
+ * 
+ * @param sem The semaphore
+ */
+void semaphore_up(semaphore_t *sem)
+{
+    const uint32_t eflags = sem_lock(&sem->queue);
+    sem->count++;
+    sem_unlock(&sem->queue, eflags);
+    wake_up_one(&sem->queue);
+}
+
+/**
+ * @brief Initialize a read-write semaphore, held by nobody.
+ * 
+ * @param sem The semaphore to initialize
+ */
+void rw_semaphore_init(rw_semaphore_t *sem)
+{
+    sem->readers = 0;
+    sem->writers = 0;
+    sem->writer = false;
+    thread_queue_init(&sem->queue);
+}
+
+/**
+ * @brief Take a read-write semaphore as a reader, if it is not held by a
+ * writer and no writer is waiting for it.
+ */
+static bool rw_semaphore_tryread(rw_semaphore_t *sem)
+{
+    bool done = false;
+    const uint32_t eflags = sem_lock(&sem->queue);
+    if (!sem->writer && sem->writers == 0) {
+        sem->readers++;
+        done = true;
+    }
+    sem_unlock(&sem->queue, eflags);
+    return done;
+}
+
+/**
+ * @brief Take a read-write semaphore as a writer, if nobody holds it. The
+ * caller is counted as a waiting writer until it takes it.
+ */
+static bool rw_semaphore_trywrite(rw_semaphore_t *sem)
+{
+    bool done = false;
+    const uint32_t eflags = sem_lock(&sem->queue);
+    if (!sem->writer && sem->readers == 0) {
+        sem->writers--;
+        sem->writer = true;
+        done = true;
+    }
+    sem_unlock(&sem->queue, eflags);
+    return done;
+}
+
+/**
+ * @brief Sleep until a read-write semaphore can be taken as a reader.
+ * 
+ * @param sem The semaphore
+ */
+void down_read(rw_semaphore_t *sem)
+{
+    wait_event(&sem->queue, rw_semaphore_tryread(sem));
+}
+
+/**
+ * @brief Release a read-write semaphore held as a reader. The last reader
+ * wakes up the waiting writers.
+ * 
+ * @param sem The semaphore
+ */
+void up_read(rw_semaphore_t *sem)
+{
+    const uint32_t eflags = sem_lock(&sem->queue);
+    assert(sem->readers > 0);
+    const bool last = --sem->readers == 0;
+    sem_unlock(&sem->queue, eflags);
+    if (last)
+        wake_up_all(&sem->queue);
+}
+
+/**
+ * @brief Sleep until a read-write semaphore can be taken as a writer. New
+ * readers are blocked as soon as the writer starts waiting.
+ * 
+ * @param sem The semaphore
+ */
+void down_write(rw_semaphore_t *sem)
+{
+    const uint32_t eflags = sem_lock(&sem->queue);
+    sem->writers++;
+    sem_unlock(&sem->queue, eflags);
+    wait_event(&sem->queue, rw_semaphore_trywrite(sem));
+}
+
+/**
+ * @brief Release a read-write semaphore held as a writer, and wake up the
+ * waiting readers and writers.
+ * 
+ * @param sem The semaphore
+ */
+void up_write(rw_semaphore_t *sem)
+{
+    const uint32_t eflags = sem_lock(&sem->queue);
+    assert(sem->writer);
+    sem->writer = false;
+    sem_unlock(&sem->queue, eflags);
+    wake_up_all(&sem->queue);
+}
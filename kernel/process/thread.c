@@ -22,6 +22,7 @@
 #include <arch/x86/gdt.h>
 #include <process/thread.h>
 #include <process/process.h>
+#include <process/schedule.h>
 
 static DECLARE_SPINLOCK(tid_lock);
 static DECLARE_SPINLOCK(lock);
@@ -99,9 +100,21 @@ static int thread_creat(thread_t *thread)
     list_init(&thread->process_node);
     list_init(&thread->thread_node);
     thread->state = THREAD_CREATED;
+    thread->policy = SCHEDULER_DEFAULT_POLICY;
+    thread->priority = SCHEDULER_DEFAULT_PRIORITY;
+    thread->rt_priority = SCHEDULER_RT_PRIORITIES - 1;
+    thread->wakeup_tsc = 0;
+    thread->nice = 0;
+    thread->weight = SCHEDULER_NICE_0_WEIGHT;
+    thread->vruntime = 0;
     thread->reschedule = false;
+    thread->queued = false;
+    thread->on_cpu = false;
+    thread->cpu = 0;
     thread->fpu_loaded = false;
     thread->fpu_used = false;
+    thread->fpu_cpu = -1;
+    thread->fpu_counter = 0;
 
     thread_generate_tid(thread);    // Cannot fail
     return 0;
@@ -119,7 +132,7 @@ thread_t *thread_allocate(void)
     if (thread == NULL)
         return NULL;
 
-    thread->fpu_state = malloc(sizeof(struct fpu_state));
+    thread->fpu_state = fpu_alloc_state();
     if (thread->fpu_state == NULL) {
         free(thread);
         return NULL;
@@ -128,7 +141,7 @@ thread_t *thread_allocate(void)
     thread->kstack.base = vmalloc(KSTACK_SIZE, VMALLOC_MAP);
     thread->kstack.size = KSTACK_SIZE;
     if (thread->kstack.base == 0) {
-        free(thread->fpu_state);
+        fpu_free_state(thread->fpu_state);
         free(thread);
         return NULL;
     }
@@ -159,15 +172,17 @@ int thread_kernel_creat(thread_t *thread)
     thread->cpu_state->ds = GDT_KDATA_SELECTOR;
     thread->cpu_state->es = GDT_KDATA_SELECTOR;
     thread->cpu_state->fs = GDT_KDATA_SELECTOR;
-    thread->cpu_state->gs = GDT_KDATA_SELECTOR;
+    thread->cpu_state->gs = GDT_PERCPU_SELECTOR;
     thread->cpu_state->ss = GDT_KSTACK_SELECTOR;
     thread->cpu_state->eflags = EFLAGS_IF;
     return 0;
 }
 
 /**
- * @brief Creat a new user thread. It will allocate a memory context for the
- * thread, and initialize the CPU state.
+ * @brief Creat a new user thread and initialize the CPU state. The user stack
+ * is not mapped here: it is an area of the process memory context, created
+ * when the thread is added to its process, and populated on demand by the
+ * page fault handler.
  * 
  * @param thread The thread to initialize. This function does not allocate
  * any memory, so the caller must allocate it with thread_allocate() before
@@ -183,7 +198,7 @@ int thread_user_creat(thread_t *thread)
         return ret;
 
     thread->process = NULL;
-    thread->type = THREAD_KERNEL;
+    thread->type = THREAD_USER;
     thread->cpu_state->cs = GDT_UCODE_SELECTOR;
     thread->cpu_state->ds = GDT_UDATA_SELECTOR;
     thread->cpu_state->es = GDT_UDATA_SELECTOR;
@@ -193,7 +208,6 @@ int thread_user_creat(thread_t *thread)
     thread->cpu_state->ss3 = GDT_USTACK_SELECTOR;
     thread->cpu_state->esp3 = THREAD_STACK_TOP - 16;
     thread->cpu_state->eflags = EFLAGS_IF;
-    // TODO: Map the stack
     return 0;
 }
 
@@ -228,12 +242,18 @@ int thread_clone(
     if (clone == NULL)
         return ret;
 
-    // Copy the cpu state and the FPU state
-    memcpy(clone->fpu_state, thread->fpu_state, sizeof(struct fpu_state));
+    // Copy the cpu state and the FPU state, which may be in the registers
+    fpu_flush(thread);
+    memcpy(clone->fpu_state, thread->fpu_state, fpu_state_size());
     memcpy(clone->cpu_state, cpu_state, sizeof(struct cpu_state));
 
     clone->fpu_used = thread->fpu_used;
     clone->state = thread->state;
+    clone->policy = thread->policy;
+    clone->priority = thread->priority;
+    clone->rt_priority = thread->rt_priority;
+    clone->nice = thread->nice;
+    clone->weight = thread->weight;
     clone->type = thread->type;
     if (clone->type == THREAD_RUNNING)
         clone->type = THREAD_READY;
@@ -274,21 +294,23 @@ void thread_zombify(thread_t *thread, const int code)
 
 /**
  * @brief Destroy a thread: free all its memory and remove it from the thread
- * list
+ * list. A thread cannot destroy itself because it would free the stack it
+ * runs on: use reaper_add_thread() instead.
  * 
  * @param thread The thread to destroy: it must have been zombified before
  * calling this function.
  */
 void thread_destroy(thread_t *thread)
 {
+    assert(thread != scheduler_get_current_thread());
     // Remove the thread from the thread list
     spin_acquire(&lock) {
-        list_remove(&thread->scheduler_node);
+        list_remove(&thread->thread_node);
     }
 
     // Free the thread structure
     vmfree(thread->kstack.base);
-    free(thread->fpu_state);
+    fpu_free_state(thread->fpu_state);
     free(thread);
     thread_count--;
 }
@@ -0,0 +1,300 @@
+/**
+ * Copyright (C) 2022 Romain CADILHAC
+ *
+ * This file is part of Silicium.
+ *
+ * Silicium is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Silicium is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Silicium. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <lib/list.h>
+#include <lib/spinlock.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/time.h>
+#include <process/wait.h>
+#include <process/schedule.h>
+
+/**
+ * @brief Wait queues let threads sleep until a condition becomes true,
+ * without spinning nor polling. A waiting thread queues itself on a thread
+ * queue and sleeps: it leaves its run queue at its next scheduling, and is
+ * queued again on its run queue when it is woken up.
+ * 
+ * The lock of a thread queue is always taken with interrupts disabled,
+ * because the wakeup functions may be called from interrupt handlers. A
+ * wakeup removes the entries it wakes up from the queue, and the woken
+ * threads queue themselves again if their condition is still false.
+ */
+
+/**
+ * @brief Wake up threads sleeping on a wait queue. The entries are removed
+ * from the queue as they are woken up. Entries of threads that are already
+ * awake, for example because their timeout expired, are removed without
+ * counting as a wakeup. The lock must be held.
+ * 
+ * @param queue The wait queue
+ * @param all Wake up all threads, or only the first sleeping one
+ */
+static void __wake_up(thread_queue_t *queue, const bool all)
+{
+    list_foreach_safe(&queue->node, node) {
+        thread_queue_t *entry = container_of(node, thread_queue_t, node);
+        list_remove(&entry->node);
+        if (scheduler_wakeup(entry->thread) && !all)
+            break;
+    }
+}
+
+/**
+ * @brief Initialize a wait queue entry for the current thread.
+ * 
+ * @param entry The entry, usually on the stack of the waiting thread
+ */
+void wait_init(thread_queue_t *entry)
+{
+    entry->thread = scheduler_get_current_thread();
+    list_entry_init(&entry->node);
+}
+
+/**
+ * @brief Queue the current thread on a wait queue and mark it as sleeping,
+ * before its condition is checked. Interrupts are disabled on return, so
+ * that the thread cannot be preempted while it is marked as sleeping.
+ * 
+ * @param queue The wait queue
+ * @param entry The entry of the current thread
+ * @return uint32_t The flags to give to wait_sleep() or wait_finish()
+ */
+uint32_t wait_prepare(thread_queue_t *queue, thread_queue_t *entry)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&queue->lock);
+    if (list_empty(&entry->node))
+        list_add_tail(&queue->node, &entry->node);
+    entry->thread->state = THREAD_SLEEPING;
+    spin_unlock(&queue->lock);
+    return eflags;
+}
+
+/**
+ * @brief Sleep until the current thread is woken up. If it was already
+ * woken up since wait_prepare(), it stays in its run queue and the call to
+ * the scheduler returns immediately or after other threads have run.
+ * 
+ * @param eflags The flags returned by wait_prepare()
+ */
+void wait_sleep(const uint32_t eflags)
+{
+    schedule(NULL);
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Remove the current thread from a wait queue once its condition is
+ * true or its timeout expired, and mark it as running again. If a wakeup
+ * already removed the entry since wait_prepare(), it was spent on a thread
+ * that was not sleeping: it is passed on to the next sleeping thread, which
+ * may be waiting for the same event.
+ * 
+ * @param queue The wait queue
+ * @param entry The entry of the current thread
+ * @param eflags The flags returned by wait_prepare()
+ */
+void wait_finish(
+    thread_queue_t *queue,
+    thread_queue_t *entry,
+    const uint32_t eflags)
+{
+    spin_lock(&queue->lock);
+    if (!list_empty(&entry->node))
+        list_remove(&entry->node);
+    else
+        __wake_up(queue, false);
+    spin_unlock(&queue->lock);
+    entry->thread->state = THREAD_RUNNING;
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Timer callback used to wake up a thread waiting with a timeout.
+ * 
+ * @param data The thread to wake up.
+ */
+static void wait_timeout(void *data)
+{
+    scheduler_wakeup((thread_t *) data);
+}
+
+/**
+ * @brief Start the timer of a wait with a timeout. The timer wakes up the
+ * current thread when it expires, like scheduler_sleep().
+ * 
+ * @param timer The timer, usually on the stack of the waiting thread
+ * @param ms The timeout, in milliseconds
+ */
+void wait_timeout_start(timer_t *timer, const time_t ms)
+{
+    timer_init(timer);
+    timer->callback = wait_timeout;
+    timer->data = scheduler_get_current_thread();
+    timer_expire(timer, ms);
+    timer_add(timer);
+}
+
+/**
+ * @brief Check if the timeout of a wait has expired.
+ * 
+ * @param timer The timer given to wait_timeout_start()
+ * @return true if the timeout has expired
+ */
+bool wait_timed_out(const timer_t *timer)
+{
+    return timer->expire <= time_startup_ms();
+}
+
+/**
+ * @brief Stop the timer of a wait, if it has not expired yet.
+ * 
+ * @param timer The timer given to wait_timeout_start()
+ */
+void wait_timeout_end(timer_t *timer)
+{
+    timer_remove(timer);
+}
+
+/**
+ * @brief Wake up the first thread sleeping on a wait queue, in the order
+ * they started waiting. Can be called from an interrupt handler.
+ * 
+ * @param queue The wait queue
+ */
+void wake_up_one(thread_queue_t *queue)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&queue->lock);
+    __wake_up(queue, false);
+    spin_unlock(&queue->lock);
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Wake up all threads sleeping on a wait queue. Can be called from
+ * an interrupt handler.
+ * 
+ * @param queue The wait queue
+ */
+void wake_up_all(thread_queue_t *queue)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&queue->lock);
+    __wake_up(queue, true);
+    spin_unlock(&queue->lock);
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Initialize a completion, not done yet.
+ * 
+ * @param completion The completion to initialize
+ */
+void completion_init(completion_t *completion)
+{
+    completion->done = 0;
+    thread_queue_init(&completion->queue);
+}
+
+/**
+ * @brief Signal a completion: one waiting thread, or the next thread that
+ * will wait, is let through. Can be called from an interrupt handler.
+ * 
+ * @param completion The completion
+ */
+void complete(completion_t *completion)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&completion->queue.lock);
+    if (completion->done != COMPLETION_ALL)
+        completion->done++;
+    __wake_up(&completion->queue, false);
+    spin_unlock(&completion->queue.lock);
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Signal a completion for good: all waiting threads and all threads
+ * that will wait are let through, until completion_init() is called again.
+ * 
+ * @param completion The completion
+ */
+void complete_all(completion_t *completion)
+{
+    const uint32_t eflags = get_eflags();
+    cli();
+    spin_lock(&completion->queue.lock);
+    completion->done = COMPLETION_ALL;
+    __wake_up(&completion->queue, true);
+    spin_unlock(&completion->queue.lock);
+    set_eflags(eflags);
+}
+
+/**
+ * @brief Consume a signal of a completion, if any. Interrupts must be
+ * disabled, as in the condition of wait_event().
+ * 
+ * @param completion The completion
+ * @return true if the completion was signaled
+ */
+bool completion_try(completion_t *completion)
+{
+    bool done = false;
+    spin_lock(&completion->queue.lock);
+    if (completion->done != 0) {
+        if (completion->done != COMPLETION_ALL)
+            completion->done--;
+        done = true;
+    }
+    spin_unlock(&completion->queue.lock);
+    return done;
+}
+
+/**
+ * @brief Sleep until a completion is signaled. Must not be called with
+ * preemption disabled.
+ * 
+ * @param completion The completion to wait for
+ */
+void wait_for_completion(completion_t *completion)
+{
+    wait_event(&completion->queue, completion_try(completion));
+}
+
+/**
+ * @brief Sleep until a completion is signaled, or until a timeout expires.
+ * Must not be called with preemption disabled.
+ * 
+ * @param completion The completion to wait for
+ * @param ms The timeout, in milliseconds
+ * @return int 0 if the completion was signaled, or
+ *  -ETIMEDOUT if the timeout expired before
+ */
+int wait_for_completion_timeout(completion_t *completion, const time_t ms)
+{
+    return wait_event_timeout(
+        &completion->queue,
+        completion_try(completion),
+        ms);
+}